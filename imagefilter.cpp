@@ -0,0 +1,582 @@
+#include "imagefilter.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace ifl {
+
+namespace {
+
+// Lookup table shared by the fast apply kernels. The group only depends on the five pairwise comparisons of the channels, so it is looked up
+// from a 5-bit key instead of walking the reference branches. This works for any sample type.
+struct ClassTables {
+    unsigned char applyGroups[32];
+
+    static const ClassTables &get(void) {
+        static const ClassTables tables;
+        return tables;
+    }
+    template <typename V>
+    static int comparisonKey(V r, V g, V b) {
+        return (r >= g) | (r >= b) << 1 | (g >= b) << 2 | (g >= r) << 3 | (b >= r) << 4;
+    }
+
+private:
+    ClassTables() {
+        for (int key = 0; key < 32; key++) {
+            bool rg = key & 1, rb = key & 2, gb = key & 4, gr = key & 8, br = key & 16;
+            int group;
+            if (rg && gr && rb && br) {
+                group = 6;
+            } else if (rg && rb) {
+                group = gb ? 0 : 1;
+            } else if (gr && gb) {
+                group = rb ? 2 : 3;
+            } else {
+                group = -1;
+            }
+            applyGroups[key] = group >= 0 ? group : (rg ? 4 : 5);
+        }
+    }
+};
+
+// Luminosity index of the dominant channel: 0 above the high threshold, 2 below the low one, 1 between. Two comparisons instead of a table,
+// so it needs no 64K entries for 16-bit samples and works unchanged for float.
+template <typename T>
+int luminosityIndex(typename SampleTraits<T>::Value top) {
+    return (top <= SampleTraits<T>::high()) + (top < SampleTraits<T>::low());
+}
+
+// Pixel accessors the kernels are instantiated on, so each layout compiles to fixed channel offsets and no conversion pass is needed.
+// transparent(i) is true for pixels whose alpha is zero; layouts without alpha compile it to a constant false.
+template <typename T, bool Alpha>
+struct PlanarPixels {
+    typedef T Sample;
+    T *red;
+    T *green;
+    T *blue;
+    T *alpha;
+    T &r(long i) const { return red[i]; }
+    T &g(long i) const { return green[i]; }
+    T &b(long i) const { return blue[i]; }
+    bool transparent(long i) const { return Alpha && alpha[i] == 0; }
+};
+
+// Interleaved pixels with the colour channels at offsets R, G and B, and alpha at offset A or no alpha when A is negative. Step is the pixel
+// stride in samples, or 0 when it is only known at run time.
+template <typename T, int R, int G, int B, int A, long Step>
+struct PackedPixels {
+    typedef T Sample;
+    T *base;
+    long step;
+    long at(long i) const { return i * (Step ? Step : step); }
+    T &r(long i) const { return base[at(i) + R]; }
+    T &g(long i) const { return base[at(i) + G]; }
+    T &b(long i) const { return base[at(i) + B]; }
+    bool transparent(long i) const { return A >= 0 && base[at(i) + (A >= 0 ? A : 0)] == 0; }
+};
+
+// Greyscale pixels `step` samples apart, with alpha at the same index of a separate pointer when there is any.
+template <typename T>
+struct GrayPixels {
+    T *gray;
+    T *alpha;
+    long step;
+    T &v(long i) const { return gray[i * step]; }
+    bool transparent(long i) const { return alpha && alpha[i * step] == 0; }
+};
+
+// The running average of one noColor band. A grey pixel has r == g == b, so mergeValue would repeat the same arithmetic on all three
+// channels; doing it once gives identical results for a third of the work.
+template <typename V>
+struct GrayBand {
+    V level;
+    int frequency;
+    void merge(V value) {
+        if (frequency < 10) {
+            level = ((frequency * level) + value) / (frequency + 1);
+        } else {
+            level = (level * 9 + value) / 10;
+        }
+        frequency++;
+    }
+};
+
+// Maps a grey level to the level of its noColor band. 8-bit samples get a full 256-entry table so the apply loop is a single lookup per
+// pixel; wider samples pick one of the three bands by luminosity.
+template <typename T>
+struct GrayTable {
+    T bands[3];
+    explicit GrayTable(const T *paletteTable) {
+        for (int i = 0; i < 3; i++) {
+            bands[i] = paletteTable[3 * (18 + i)];
+        }
+    }
+    T operator()(T value) const { return bands[luminosityIndex<T>(value)]; }
+};
+
+template <>
+struct GrayTable<unsigned char> {
+    unsigned char levels[256];
+    explicit GrayTable(const unsigned char *paletteTable) {
+        for (int i = 0; i < 256; i++) {
+            levels[i] = paletteTable[3 * (18 + luminosityIndex<unsigned char>(i))];
+        }
+    }
+    unsigned char operator()(unsigned char value) const { return levels[value]; }
+};
+
+// The class is picked with branches rather than ClassTables: on natural images they predict well, and a table lookup would put a load in
+// front of every mergeValue's dependency chain. Fully transparent pixels carry no visible colour and are left out of the statistics.
+template <typename T, typename Pixels>
+void mergeRun(typename BasicColorPalette<T>::Triple *const *classes, const Pixels &pixels, long count) {
+    typedef typename SampleTraits<T>::Value Value;
+    for (long i = 0; i < count; i++) {
+        if (pixels.transparent(i)) {
+            continue;
+        }
+        Value r = pixels.r(i), g = pixels.g(i), b = pixels.b(i);
+        typename BasicColorPalette<T>::Triple *target;
+        if (r == g && r == b) {
+            target = classes[18 + luminosityIndex<T>(r)];
+        } else if (r >= g && r >= b) {
+            target = classes[(g >= b ? 0 : 3) + luminosityIndex<T>(r)];
+        } else if (g >= r && g >= b) {
+            target = classes[(r >= b ? 6 : 9) + luminosityIndex<T>(g)];
+        } else {
+            // mergeReference splits blue-dominant pixels on r >= b, which can never hold here, so they all land in Bg.
+            target = classes[15 + luminosityIndex<T>(b)];
+        }
+        target->mergeValue(r, g, b);
+    }
+}
+
+// The scalar kernels, over pixels [first, count). Whatever the SSE2 kernels below do not take runs these: the 16-bit and float
+// instantiations, the 8-bit layouts without a vector path, and the last few pixels of the rows that have one.
+template <typename T, typename Pixels>
+void applyScalar(const T *paletteTable, const Pixels &pixels, long first, long count) {
+    typedef typename SampleTraits<T>::Value Value;
+    const ClassTables &tables = ClassTables::get();
+    for (long i = first; i < count; i++) {
+        Value r = pixels.r(i), g = pixels.g(i), b = pixels.b(i);
+        Value top = std::max(r, std::max(g, b));
+        const T *color = paletteTable + 3 * (tables.applyGroups[ClassTables::comparisonKey(r, g, b)] * 3 + luminosityIndex<T>(top));
+        pixels.r(i) = color[0];
+        pixels.g(i) = color[1];
+        pixels.b(i) = color[2];
+    }
+}
+
+template <typename Pixels>
+void classifyScalar(const Pixels &pixels, long first, long count, unsigned char *classes) {
+    typedef typename Pixels::Sample T;
+    typedef typename SampleTraits<T>::Value Value;
+    const ClassTables &tables = ClassTables::get();
+    for (long i = first; i < count; i++) {
+        Value r = pixels.r(i), g = pixels.g(i), b = pixels.b(i);
+        Value top = std::max(r, std::max(g, b));
+        classes[i] = tables.applyGroups[ClassTables::comparisonKey(r, g, b)] * 3 + luminosityIndex<T>(top);
+    }
+}
+
+template <typename T, typename Pixels>
+void applyRun(const T *paletteTable, const Pixels &pixels, long count) {
+    applyScalar(paletteTable, pixels, 0, count);
+}
+
+template <typename Pixels>
+void classifyRun(const Pixels &pixels, long count, unsigned char *classes) {
+    classifyScalar(pixels, 0, count, classes);
+}
+
+#ifdef __SSE2__
+__m128i select(__m128i mask, __m128i ifSet, __m128i ifClear) {
+    return _mm_or_si128(_mm_and_si128(mask, ifSet), _mm_andnot_si128(mask, ifClear));
+}
+
+// Classes of 16 8-bit pixels, the same as ClassTables and luminosityIndex give. SSE2 has no unsigned byte comparisons, so a >= b is
+// tested as max(a, b) == a, and the group is put together from the comparison masks.
+__m128i classify16(__m128i r, __m128i g, __m128i b) {
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i rg = _mm_cmpeq_epi8(_mm_max_epu8(r, g), r), rb = _mm_cmpeq_epi8(_mm_max_epu8(r, b), r);
+    __m128i gb = _mm_cmpeq_epi8(_mm_max_epu8(g, b), g);
+    __m128i grey = _mm_and_si128(_mm_cmpeq_epi8(r, g), _mm_cmpeq_epi8(r, b));
+    // Red on top gives group 0 or 1 on g >= b; then green on top (g >= b) gives 2 or 3 on r >= b, and blue 4 or 5 on r >= g. Grey pixels
+    // count as red on top with g >= b, so or-ing in 6 makes their group 6.
+    __m128i greenOrBlue = select(gb, _mm_sub_epi8(_mm_set1_epi8(3), _mm_and_si128(rb, one)), _mm_sub_epi8(_mm_set1_epi8(5), _mm_and_si128(rg, one)));
+    __m128i group = select(_mm_and_si128(rg, rb), _mm_andnot_si128(gb, one), greenOrBlue);
+    group = _mm_or_si128(group, _mm_and_si128(grey, _mm_set1_epi8(6)));
+    __m128i top = _mm_max_epu8(r, _mm_max_epu8(g, b));
+    __m128i notLight = _mm_cmpeq_epi8(_mm_min_epu8(top, _mm_set1_epi8((char)SampleTraits<unsigned char>::high())), top);
+    __m128i dark = _mm_cmpeq_epi8(_mm_min_epu8(top, _mm_set1_epi8((char)(SampleTraits<unsigned char>::low() - 1))), top);
+    __m128i luminosity = _mm_add_epi8(_mm_and_si128(notLight, one), _mm_and_si128(dark, one));
+    return _mm_add_epi8(_mm_add_epi8(group, _mm_add_epi8(group, group)), luminosity);
+}
+
+__m128i load16(const unsigned char *bytes) { return _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes)); }
+
+// The bytes at `offset` of 16 four-byte pixels, in pixel order.
+__m128i channel16(const __m128i *words, int offset) {
+    const __m128i low = _mm_set1_epi32(255), shift = _mm_cvtsi32_si128(8 * offset);
+    __m128i part[4];
+    for (int i = 0; i < 4; i++) {
+        part[i] = _mm_and_si128(_mm_srl_epi32(words[i], shift), low);
+    }
+    return _mm_packus_epi16(_mm_packs_epi32(part[0], part[1]), _mm_packs_epi32(part[2], part[3]));
+}
+
+template <int R, int G, int B>
+__m128i classifyPacked16(const unsigned char *pixel) {
+    __m128i words[4] = {load16(pixel), load16(pixel + 16), load16(pixel + 32), load16(pixel + 48)};
+    return classify16(channel16(words, R), channel16(words, G), channel16(words, B));
+}
+
+// Planar 8-bit rows are classified 16 pixels per step. The palette lookups that follow stay one pixel at a time: SSE2 cannot index a
+// vector by another, so there is no vector form of the lookup.
+template <bool Alpha>
+void applyRun(const unsigned char *paletteTable, const PlanarPixels<unsigned char, Alpha> &pixels, long count) {
+    unsigned char classes[16];
+    long i = 0;
+    for (; i + 16 <= count; i += 16) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(classes), classify16(load16(pixels.red + i), load16(pixels.green + i), load16(pixels.blue + i)));
+        for (int j = 0; j < 16; j++) {
+            const unsigned char *color = paletteTable + 3 * classes[j];
+            pixels.red[i + j] = color[0];
+            pixels.green[i + j] = color[1];
+            pixels.blue[i + j] = color[2];
+        }
+    }
+    applyScalar(paletteTable, pixels, i, count);
+}
+
+template <bool Alpha>
+void classifyRun(const PlanarPixels<unsigned char, Alpha> &pixels, long count, unsigned char *classes) {
+    long i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i found = classify16(load16(pixels.red + i), load16(pixels.green + i), load16(pixels.blue + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(classes + i), found);
+    }
+    classifyScalar(pixels, i, count, classes);
+}
+
+template <int R, int G, int B, int A>
+void classifyRun(const PackedPixels<unsigned char, R, G, B, A, 4> &pixels, long count, unsigned char *classes) {
+    long i = 0;
+    for (; i + 16 <= count; i += 16) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(classes + i), classifyPacked16<R, G, B>(pixels.base + 4 * i));
+    }
+    classifyScalar(pixels, i, count, classes);
+}
+#endif
+
+// 8-bit pixels four bytes apart (RGBA, BGRA, RGBx) are read and written as one 32-bit word each. The palette is pre-packed into words in
+// memory order, and the fourth byte is carried over from the source word, so alpha or padding is preserved in the same store. With SSE2,
+// 16 pixels are loaded and classified at a time, and only the word stores go one pixel at a time.
+template <int R, int G, int B, int A>
+void applyRun(const unsigned char *paletteTable, const PackedPixels<unsigned char, R, G, B, A, 4> &pixels, long count) {
+    const ClassTables &tables = ClassTables::get();
+    uint32_t colors[21], keep;
+    unsigned char bytes[4] = {0, 0, 0, 0xFF};
+    std::memcpy(&keep, bytes, 4);
+    for (int i = 0; i < 21; i++) {
+        bytes[R] = paletteTable[3 * i];
+        bytes[G] = paletteTable[3 * i + 1];
+        bytes[B] = paletteTable[3 * i + 2];
+        bytes[3] = 0;
+        std::memcpy(&colors[i], bytes, 4);
+    }
+    unsigned char *pixel = pixels.base;
+    long i = 0;
+#ifdef __SSE2__
+    unsigned char classes[16];
+    for (; i + 16 <= count; i += 16, pixel += 64) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(classes), classifyPacked16<R, G, B>(pixel));
+        for (int j = 0; j < 16; j++) {
+            uint32_t word;
+            std::memcpy(&word, pixel + 4 * j, 4);
+            word = (word & keep) | colors[classes[j]];
+            std::memcpy(pixel + 4 * j, &word, 4);
+        }
+    }
+#endif
+    for (; i < count; i++, pixel += 4) {
+        uint32_t word;
+        std::memcpy(&word, pixel, 4);
+        int r = pixel[R], g = pixel[G], b = pixel[B];
+        int top = std::max(r, std::max(g, b));
+        word = (word & keep) | colors[tables.applyGroups[ClassTables::comparisonKey(r, g, b)] * 3 + luminosityIndex<unsigned char>(top)];
+        std::memcpy(pixel, &word, 4);
+    }
+}
+
+// Single-channel planar images (and planar grey plus alpha) are greyscale, as are Gray views.
+template <typename T>
+bool isGray(const BasicImageView<T> &view) {
+    return view.layout == Layout::Gray || (view.layout == Layout::Planar && view.channels < 3);
+}
+
+template <typename T>
+void checkView(const BasicImageView<T> &view) {
+    int minimumChannels = (view.layout == Layout::RGBA || view.layout == Layout::BGRA) ? 4 : isGray(view) ? 1 : 3;
+    if (view.width < 0 || view.height < 0 || view.channels < minimumChannels) {
+        throw std::invalid_argument("image view needs non-negative dimensions and enough channels for its layout");
+    }
+    if (view.width && view.height && !view.data) {
+        throw std::invalid_argument("image view has no pixel data");
+    }
+    long packedRow = (view.layout == Layout::Planar ? view.width : view.width * view.channels) * (long)sizeof(T);
+    if (view.rowStride < packedRow || (view.layout == Layout::Planar && view.planeStride < view.rowStride * view.height)) {
+        throw std::invalid_argument("image view strides are smaller than its rows or planes");
+    }
+    if (view.rowStride % sizeof(T) || view.planeStride % sizeof(T)) {
+        throw std::invalid_argument("image view strides are not a whole number of samples");
+    }
+}
+
+template <typename T, int R, int G, int B, int A, typename Run>
+void runPackedRow(T *row, long step, long count, Run &run) {
+    switch (step) {
+    case 3:
+        run(PackedPixels<T, R, G, B, A, 3>{row, step}, count);
+        break;
+    case 4:
+        run(PackedPixels<T, R, G, B, A, 4>{row, step}, count);
+        break;
+    default:
+        run(PackedPixels<T, R, G, B, A, 0>{row, step}, count);
+    }
+}
+
+// Calls run(pixels, count) once per row of the view, with pixels being the accessor instantiation for its layout. Strides are in bytes, so
+// rows and planes are located on the byte pointer and then addressed as samples. Alpha is the fourth plane of a planar view with at least
+// four channels, and the fourth sample of RGBA and BGRA pixels.
+template <typename T, typename Run>
+void forEachRow(const BasicImageView<T> &view, Run &run) {
+    checkView(view);
+    long planeSamples = view.planeStride / (long)sizeof(T);
+    for (long y = 0; y < view.height; y++) {
+        T *row = reinterpret_cast<T *>(reinterpret_cast<unsigned char *>(view.data) + y * view.rowStride);
+        if (view.layout == Layout::Planar && view.channels >= 4) {
+            run(PlanarPixels<T, true>{row, row + planeSamples, row + 2 * planeSamples, row + 3 * planeSamples}, view.width);
+        } else if (view.layout == Layout::Planar) {
+            run(PlanarPixels<T, false>{row, row + planeSamples, row + 2 * planeSamples, nullptr}, view.width);
+        } else if (view.layout == Layout::RGBA) {
+            runPackedRow<T, 0, 1, 2, 3>(row, view.channels, view.width, run);
+        } else if (view.layout == Layout::BGRA) {
+            runPackedRow<T, 2, 1, 0, 3>(row, view.channels, view.width, run);
+        } else if (view.layout == Layout::BGR) {
+            runPackedRow<T, 2, 1, 0, -1>(row, view.channels, view.width, run);
+        } else {
+            runPackedRow<T, 0, 1, 2, -1>(row, view.channels, view.width, run);
+        }
+    }
+}
+
+// Calls run(pixels, count) once per row of a greyscale view. A second channel, as the next plane or the next sample, is alpha.
+template <typename T, typename Run>
+void forEachGrayRow(const BasicImageView<T> &view, Run run) {
+    checkView(view);
+    long planeSamples = view.planeStride / (long)sizeof(T);
+    bool planar = view.layout == Layout::Planar;
+    for (long y = 0; y < view.height; y++) {
+        T *row = reinterpret_cast<T *>(reinterpret_cast<unsigned char *>(view.data) + y * view.rowStride);
+        T *alpha = view.channels < 2 ? nullptr : planar ? row + planeSamples : row + 1;
+        run(GrayPixels<T>{row, alpha, planar ? 1 : view.channels}, view.width);
+    }
+}
+
+}  // namespace
+
+template <typename T>
+void BasicColorPalette<T>::mergeReference(Value r, Value g, Value b) {
+    if (r == g && r == b) {
+        noColor[getLuminosityIndex(r)].mergeValue(r, g, b);
+    } else if (r >= g && r >= b) {
+        if (g >= b) {
+            Rg[getLuminosityIndex(r)].mergeValue(r, g, b);
+        } else {
+            Rb[getLuminosityIndex(r)].mergeValue(r, g, b);
+        }
+    } else if (g >= r && g >= b) {
+        if (r >= b) {
+            Gr[getLuminosityIndex(g)].mergeValue(r, g, b);
+        } else {
+            Gb[getLuminosityIndex(g)].mergeValue(r, g, b);
+        }
+    } else if (b >= r && b >= g) {
+        if (r >= b) {
+            Br[getLuminosityIndex(b)].mergeValue(r, g, b);
+        } else {
+            Bg[getLuminosityIndex(b)].mergeValue(r, g, b);
+        }
+    }
+}
+
+template <typename T>
+typename BasicColorPalette<T>::Triple BasicColorPalette<T>::getPaletteHue(Value r, Value g, Value b) {
+    if (r == g && r == b) {
+        return noColor[getLuminosityIndex(r)];
+    } else if (r >= g && r >= b) {
+        if (g >= b) {
+            return Rg[getLuminosityIndex(r)];
+        }
+        return Rb[getLuminosityIndex(r)];
+    } else if (g >= r && g >= b) {
+        if (r >= b) {
+            return Gr[getLuminosityIndex(g)];
+        }
+        return Gb[getLuminosityIndex(g)];
+    }
+    if (r >= g) {
+        return Br[getLuminosityIndex(b)];
+    }
+    return Bg[getLuminosityIndex(b)];
+}
+
+template <typename T>
+typename BasicColorPalette<T>::Triple &BasicColorPalette<T>::entry(int classIndex) {
+    std::vector<Triple> *groups[7] = {&Rg, &Rb, &Gr, &Gb, &Br, &Bg, &noColor};
+    return (*groups[classIndex / 3])[classIndex % 3];
+}
+
+template <typename T>
+const typename BasicColorPalette<T>::Triple &BasicColorPalette<T>::entry(int classIndex) const {
+    const std::vector<Triple> *groups[7] = {&Rg, &Rb, &Gr, &Gb, &Br, &Bg, &noColor};
+    return (*groups[classIndex / 3])[classIndex % 3];
+}
+
+template <typename T>
+void BasicColorPalette<T>::reset(void) {
+    for (int i = 0; i < 21; i++) {
+        entry(i) = vectorDefault;
+    }
+}
+
+namespace {
+
+// Generic lambdas would need C++14, so the per-layout dispatch goes through these small functors.
+template <typename T>
+struct MergeRow {
+    typename BasicColorPalette<T>::Triple *classes[21];
+    template <typename Pixels>
+    void operator()(const Pixels &pixels, long count) {
+        mergeRun<T>(classes, pixels, count);
+    }
+};
+
+template <typename T>
+struct ApplyRow {
+    const T *paletteTable;
+    template <typename Pixels>
+    void operator()(const Pixels &pixels, long count) {
+        applyRun(paletteTable, pixels, count);
+    }
+};
+
+// Rows of classes follow the rows of the view, classStride bytes apart.
+template <typename T>
+struct ClassifyRow {
+    unsigned char *classes;
+    long classStride;
+    template <typename Pixels>
+    void operator()(const Pixels &pixels, long count) {
+        classifyRun(pixels, count, classes);
+        classes += classStride;
+    }
+};
+
+}  // namespace
+
+template <typename T>
+void BasicColorPalette<T>::merge(const BasicImageView<T> &view) {
+    if (isGray(view)) {
+        GrayBand<Value> bands[3];
+        for (int i = 0; i < 3; i++) {
+            bands[i] = {noColor[i].getRed(), noColor[i].getFrequency()};
+        }
+        forEachGrayRow(view, [&bands](const GrayPixels<T> &pixels, long count) {
+            for (long i = 0; i < count; i++) {
+                if (!pixels.transparent(i)) {
+                    Value value = pixels.v(i);
+                    bands[luminosityIndex<T>(value)].merge(value);
+                }
+            }
+        });
+        for (int i = 0; i < 3; i++) {
+            noColor[i] = Triple(bands[i].level, bands[i].level, bands[i].level, bands[i].frequency);
+        }
+        return;
+    }
+    MergeRow<T> run;
+    for (int i = 0; i < 21; i++) {
+        run.classes[i] = &entry(i);
+    }
+    forEachRow(view, run);
+}
+
+template <typename T>
+void BasicColorPalette<T>::finalize(void) {
+    for (int i = 0; i < 21; i++) {
+        Triple &color = entry(i);
+        paletteTable[3 * i] = color.getRed();
+        paletteTable[3 * i + 1] = color.getGreen();
+        paletteTable[3 * i + 2] = color.getBlue();
+    }
+}
+
+template <typename T>
+void BasicColorPalette<T>::apply(const BasicImageView<T> &view) const {
+    if (isGray(view)) {
+        GrayTable<T> table(paletteTable);
+        forEachGrayRow(view, [&table](const GrayPixels<T> &pixels, long count) {
+            for (long i = 0; i < count; i++) {
+                pixels.v(i) = table(pixels.v(i));
+            }
+        });
+        return;
+    }
+    ApplyRow<T> run = {paletteTable};
+    forEachRow(view, run);
+}
+
+template <typename T>
+void BasicColorPalette<T>::classify(const BasicImageView<T> &view, unsigned char *classes, long classStride) const {
+    if (!classes && view.width && view.height) {
+        throw std::invalid_argument("class map has no data");
+    }
+    if (isGray(view)) {
+        forEachGrayRow(view, [&classes, classStride](const GrayPixels<T> &pixels, long count) {
+            for (long i = 0; i < count; i++) {
+                classes[i] = 18 + luminosityIndex<T>(pixels.v(i));
+            }
+            classes += classStride;
+        });
+        return;
+    }
+    ClassifyRow<T> run = {classes, classStride};
+    forEachRow(view, run);
+}
+
+template <typename T>
+void filterImage(const BasicImageView<T> &view) {
+    BasicColorPalette<T> palette;
+    palette.merge(view);
+    palette.finalize();
+    palette.apply(view);
+}
+
+// The sample types the library is built for. Each gets its own copy of every kernel.
+template class BasicColorPalette<unsigned char>;
+template class BasicColorPalette<unsigned short>;
+template class BasicColorPalette<float>;
+template void filterImage(const BasicImageView<unsigned char> &);
+template void filterImage(const BasicImageView<unsigned short> &);
+template void filterImage(const BasicImageView<float> &);
+
+}  // namespace ifl
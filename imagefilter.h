@@ -0,0 +1,174 @@
+#ifndef IMAGEFILTER_H
+#define IMAGEFILTER_H
+
+#include <vector>
+
+// libimagefilter: the palette filter over caller-owned pixel buffers. It does no file I/O and does not depend on CImg, so services can decode
+// and encode however they like and hand the filter their own memory. Nothing here copies or frees the caller's pixels.
+namespace ifl {
+
+// Value range and luminosity thresholds for each supported sample type. The thresholds are the 8-bit filter's 85 and 170 scaled to the
+// type's full range: 85 * 257 and 170 * 257 for 16-bit samples, a third and two thirds of 1.0 for float samples.
+template <typename T>
+struct SampleTraits;
+
+template <>
+struct SampleTraits<unsigned char> {
+    typedef int Value;
+    static constexpr Value low(void) { return 85; }
+    static constexpr Value high(void) { return 170; }
+};
+
+template <>
+struct SampleTraits<unsigned short> {
+    typedef int Value;
+    static constexpr Value low(void) { return 85 * 257; }
+    static constexpr Value high(void) { return 170 * 257; }
+};
+
+template <>
+struct SampleTraits<float> {
+    typedef float Value;
+    static constexpr Value low(void) { return 85.0f / 255; }
+    static constexpr Value high(void) { return 170.0f / 255; }
+};
+
+// RGB_Triple is a frequently-used structure for storing data about a given color within an image. V is the type the running average is kept
+// in: int for integer samples, so averages truncate exactly as they always have, and float for float samples.
+template <typename V>
+class BasicRGB_Triple {
+private:
+    // Commonly used variables. Instantiated here and reused to speed up by reducing the number of allocations needed in loops.
+    V red;
+    V green;
+    V blue;
+    int frequency;
+
+public:
+    BasicRGB_Triple(V r = 0, V g = 0, V b = 0, int fr = 0) : red(r), green(g), blue(b), frequency(fr){};
+    void mergeValue(V r, V g, V b) {
+        if (frequency < 10) {
+            red = ((frequency * red) + r) / (frequency + 1);
+            green = ((frequency * green) + g) / (frequency + 1);
+            blue = ((frequency * blue) + b) / (frequency + 1);
+        } else {
+            red = (red * 9 + r) / 10;
+            green = (green * 9 + g) / 10;
+            blue = (blue * 9 + b) / 10;
+        }
+        frequency++;
+    }
+    V getRed(void) const { return red; }
+    V getGreen(void) const { return green; }
+    V getBlue(void) const { return blue; }
+    int getFrequency(void) const { return frequency; }
+};
+
+typedef BasicRGB_Triple<int> RGB_Triple;
+
+// How the channels of a pixel buffer are arranged in memory. Interleaved pixels are `channels` samples apart, so RGB and BGR also describe padded
+// formats such as RGBx. RGBA and BGRA carry alpha in the fourth sample, as does the fourth plane of a planar image: alpha is copied through
+// untouched and fully transparent pixels are left out of the palette statistics. Other channels past the colour ones are never touched.
+enum class Layout {
+    // One plane per channel, as CImg stores images. planeStride is the byte distance between planes. With fewer than three channels the
+    // image is greyscale, with alpha in the second plane if there is one.
+    Planar,
+    RGB,
+    BGR,
+    RGBA,
+    BGRA,
+    // One grey sample per pixel, followed by alpha when `channels` is at least 2. Greyscale images only ever use the three noColor classes.
+    Gray
+};
+
+// A caller-owned image with samples of type T.
+template <typename T>
+struct BasicImageView {
+    T *data;
+    long width;
+    long height;
+    // Bytes from the start of one row to the start of the next. May be larger than the packed row for padded buffers.
+    long rowStride;
+    int channels;
+    Layout layout;
+    // Planar only: bytes from the start of one channel plane to the next.
+    long planeStride;
+};
+
+typedef BasicImageView<unsigned char> ImageView;
+
+// Views over caller buffers. A rowStride of 0 means packed rows.
+template <typename T>
+BasicImageView<T> planarView(T *data, long width, long height, int channels) {
+    BasicImageView<T> view = {data, width, height, width * (long)sizeof(T), channels, Layout::Planar, width * height * (long)sizeof(T)};
+    return view;
+}
+
+template <typename T>
+BasicImageView<T> interleavedView(T *data, long width, long height, int channels, long rowStride = 0, Layout layout = Layout::RGB) {
+    BasicImageView<T> view = {data, width, height, rowStride ? rowStride : width * channels * (long)sizeof(T), channels, layout, 0};
+    return view;
+}
+
+// The palette itself: the averaged colour of every class, plus the kernels that build it and map pixels onto it. A pixel's class is
+// group * 3 + luminosity index, with groups ordered Rg, Rb, Gr, Gb, Br, Bg, noColor. Instantiated for unsigned char, unsigned short and float
+// samples, each with its own kernels, so wide images are filtered at full precision without a conversion pass.
+template <typename T>
+class BasicColorPalette {
+public:
+    typedef typename SampleTraits<T>::Value Value;
+    typedef BasicRGB_Triple<Value> Triple;
+
+private:
+    // The filter averages the colors in different R, G, and B color categories and creates a palette with light and dark options for each.
+    int getLuminosityIndex(Value intensity) {
+        if (intensity > SampleTraits<T>::high()) {
+            return 0;
+        } else if (intensity < SampleTraits<T>::low()) {
+            return 2;
+        }
+        return 1;
+    }
+    int getColorIndex(Value intensity) { return (intensity > SampleTraits<T>::high() ? 0 : 1); }
+    Triple vectorDefault;
+    // Colors ranked by greatest to least pronounced color value. Rg is red >= green >= blue, Bg is blue >= green >= red, etc. Each set has a value
+    // for lighter and darker hues. Index 0 is for lighter (dominant value greater than one third), index 1 is for middle shades (dominant value in
+    // middle third), and index 2 is for darker (dominant value less than half).
+    std::vector<Triple> Rg = {vectorDefault, vectorDefault, vectorDefault}, Rb = {vectorDefault, vectorDefault, vectorDefault},
+                        Gr = {vectorDefault, vectorDefault, vectorDefault}, Gb = {vectorDefault, vectorDefault, vectorDefault},
+                        Br = {vectorDefault, vectorDefault, vectorDefault}, Bg = {vectorDefault, vectorDefault, vectorDefault},
+                        noColor = {vectorDefault, vectorDefault, vectorDefault};
+    // Flattened copy of the palette in class order, three samples per class. Read by the fast apply kernel.
+    T paletteTable[21 * 3];
+
+public:
+    // Reference classification for the palette statistics, one pixel at a time. Pixels must be fed in raster order, skipping fully transparent
+    // ones.
+    void mergeReference(Value r, Value g, Value b);
+    // Based on the RGB and luminosity alignment of an input color, return the closest color available within the pre-defined palette.
+    Triple getPaletteHue(Value r, Value g, Value b);
+    Triple &entry(int classIndex);
+    const Triple &entry(int classIndex) const;
+    // Clears the statistics so the palette can be rebuilt for another image. Does not allocate.
+    void reset(void);
+    // Same statistics as mergeReference over a whole view, in raster order, which mergeValue's running average depends on. Call repeatedly
+    // with consecutive strips to build a palette from a streamed image.
+    void merge(const BasicImageView<T> &view);
+    // Must be called once the statistics are complete and before applying.
+    void finalize(void);
+    // Same mapping as getPaletteHue, in place over a whole view.
+    void apply(const BasicImageView<T> &view) const;
+    // Writes each pixel's class index (0 to 20, as entry() numbers them) instead of its palette colour, leaving the view untouched: apply
+    // amounts to replacing every pixel with entry(class). classStride is the bytes from one row of classes to the next.
+    void classify(const BasicImageView<T> &view, unsigned char *classes, long classStride) const;
+};
+
+typedef BasicColorPalette<unsigned char> ColorPalette;
+
+// Builds the palette from the image and remaps the image in place with it. Throws std::invalid_argument for a malformed view.
+template <typename T>
+void filterImage(const BasicImageView<T> &view);
+
+}  // namespace ifl
+
+#endif
@@ -0,0 +1,145 @@
+#include "imagefilter_c.h"
+
+#include <new>
+#include <stdexcept>
+
+#include "imagefilter.h"
+
+struct ifl_palette {
+    ifl::ColorPalette palette;
+    bool finalized = false;
+};
+
+namespace {
+
+// Converts the C description to a view, rejecting what ifl::ImageView cannot express. The library re-checks the strides.
+bool toView(const ifl_image *image, ifl::ImageView &view) {
+    const ifl::Layout layouts[] = {ifl::Layout::Planar, ifl::Layout::RGB,  ifl::Layout::BGR,
+                                   ifl::Layout::RGBA,   ifl::Layout::BGRA, ifl::Layout::Gray};
+    if (!image || image->layout < IFL_LAYOUT_PLANAR || image->layout > IFL_LAYOUT_GRAY) {
+        return false;
+    }
+    if (image->layout == IFL_LAYOUT_PLANAR) {
+        view = ifl::planarView(image->data, image->width, image->height, image->channels);
+        view.rowStride = image->row_stride ? image->row_stride : image->width;
+        view.planeStride = image->plane_stride ? image->plane_stride : view.rowStride * image->height;
+    } else {
+        view = ifl::interleavedView(image->data, image->width, image->height, image->channels, image->row_stride, layouts[image->layout]);
+    }
+    return true;
+}
+
+// Runs a library call and turns whatever it throws into a status code, so no exception crosses the C boundary.
+template <typename Call>
+ifl_status guarded(Call call) {
+    try {
+        return call();
+    } catch (const std::invalid_argument &) {
+        return IFL_ERR_INVALID_ARGUMENT;
+    } catch (const std::bad_alloc &) {
+        return IFL_ERR_NO_MEMORY;
+    } catch (...) {
+        return IFL_ERR_INTERNAL;
+    }
+}
+
+}  // namespace
+
+extern "C" {
+
+int ifl_abi_version(void) { return IFL_ABI_VERSION; }
+
+const char *ifl_status_string(ifl_status status) {
+    switch (status) {
+    case IFL_OK:
+        return "ok";
+    case IFL_ERR_INVALID_ARGUMENT:
+        return "invalid argument";
+    case IFL_ERR_NO_MEMORY:
+        return "out of memory";
+    case IFL_ERR_NOT_FINALIZED:
+        return "palette not finalized";
+    case IFL_ERR_INTERNAL:
+        return "internal error";
+    }
+    return "unknown status";
+}
+
+ifl_status ifl_palette_new(ifl_palette **out) {
+    if (!out) {
+        return IFL_ERR_INVALID_ARGUMENT;
+    }
+    *out = new (std::nothrow) ifl_palette;
+    return *out ? IFL_OK : IFL_ERR_NO_MEMORY;
+}
+
+void ifl_palette_free(ifl_palette *palette) { delete palette; }
+
+ifl_status ifl_palette_reset(ifl_palette *palette) {
+    if (!palette) {
+        return IFL_ERR_INVALID_ARGUMENT;
+    }
+    palette->palette.reset();
+    palette->finalized = false;
+    return IFL_OK;
+}
+
+ifl_status ifl_palette_merge(ifl_palette *palette, const ifl_image *strip) {
+    ifl::ImageView view;
+    if (!palette || !toView(strip, view)) {
+        return IFL_ERR_INVALID_ARGUMENT;
+    }
+    return guarded([&] {
+        palette->palette.merge(view);
+        palette->finalized = false;
+        return IFL_OK;
+    });
+}
+
+ifl_status ifl_palette_finalize(ifl_palette *palette) {
+    if (!palette) {
+        return IFL_ERR_INVALID_ARGUMENT;
+    }
+    palette->palette.finalize();
+    palette->finalized = true;
+    return IFL_OK;
+}
+
+ifl_status ifl_palette_build(ifl_palette *palette, const ifl_image *image) {
+    ifl_status status = ifl_palette_reset(palette);
+    if (status == IFL_OK) {
+        status = ifl_palette_merge(palette, image);
+    }
+    return status == IFL_OK ? ifl_palette_finalize(palette) : status;
+}
+
+ifl_status ifl_palette_apply(const ifl_palette *palette, const ifl_image *image) {
+    ifl::ImageView view;
+    if (!palette || !toView(image, view)) {
+        return IFL_ERR_INVALID_ARGUMENT;
+    }
+    if (!palette->finalized) {
+        return IFL_ERR_NOT_FINALIZED;
+    }
+    return guarded([&] {
+        palette->palette.apply(view);
+        return IFL_OK;
+    });
+}
+
+ifl_status ifl_palette_colors(const ifl_palette *palette, uint8_t out_rgb[63]) {
+    if (!palette || !out_rgb) {
+        return IFL_ERR_INVALID_ARGUMENT;
+    }
+    if (!palette->finalized) {
+        return IFL_ERR_NOT_FINALIZED;
+    }
+    const ifl::ColorPalette &colors = palette->palette;
+    for (int i = 0; i < 21; i++) {
+        out_rgb[3 * i] = colors.entry(i).getRed();
+        out_rgb[3 * i + 1] = colors.entry(i).getGreen();
+        out_rgb[3 * i + 2] = colors.entry(i).getBlue();
+    }
+    return IFL_OK;
+}
+}
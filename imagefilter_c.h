@@ -0,0 +1,81 @@
+#ifndef IMAGEFILTER_C_H
+#define IMAGEFILTER_C_H
+
+/* C interface to libimagefilter for FFI callers (Go, Rust, Python ctypes, ...). Every function returns a status code instead of throwing, and
+ * only ifl_palette_new allocates: building and applying a palette work entirely in caller-owned memory, so they can sit in a hot loop. */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define IFL_API __attribute__((visibility("default")))
+#else
+#define IFL_API
+#endif
+
+/* Bumped whenever a struct layout or function signature in this header changes. */
+#define IFL_ABI_VERSION 1
+
+typedef enum {
+    IFL_OK = 0,
+    IFL_ERR_INVALID_ARGUMENT = 1,
+    IFL_ERR_NO_MEMORY = 2,
+    /* ifl_palette_apply or ifl_palette_colors was called before the palette was finalized. */
+    IFL_ERR_NOT_FINALIZED = 3,
+    IFL_ERR_INTERNAL = 4
+} ifl_status;
+
+/* Interleaved layouts take the pixel stride from `channels`, so RGB and BGR also cover padded RGBx/BGRx data. */
+typedef enum {
+    IFL_LAYOUT_PLANAR = 0,
+    /* Interleaved, red first. */
+    IFL_LAYOUT_INTERLEAVED = 1,
+    IFL_LAYOUT_BGR = 2,
+    IFL_LAYOUT_RGBA = 3,
+    IFL_LAYOUT_BGRA = 4,
+    /* One grey sample per pixel, then alpha if channels >= 2. A planar image with one or two channels is greyscale too. */
+    IFL_LAYOUT_GRAY = 5
+} ifl_layout;
+
+/* A caller-owned 8-bit image; see ifl::ImageView. Channels other than the colour ones are left untouched. Alpha, in RGBA/BGRA pixels or the
+ * fourth plane of a planar image, is copied through and fully transparent pixels do not count towards the palette. Strides are in bytes. A
+ * row_stride of 0 means packed rows and a plane_stride of 0 means packed planes. */
+typedef struct {
+    uint8_t *data;
+    int64_t width;
+    int64_t height;
+    int64_t row_stride;
+    int64_t plane_stride;
+    int32_t channels;
+    int32_t layout;
+} ifl_image;
+
+typedef struct ifl_palette ifl_palette;
+
+IFL_API int ifl_abi_version(void);
+IFL_API const char *ifl_status_string(ifl_status status);
+
+/* Allocates an empty palette. Reuse it across images; ifl_palette_build resets it without allocating. */
+IFL_API ifl_status ifl_palette_new(ifl_palette **out);
+IFL_API void ifl_palette_free(ifl_palette *palette);
+
+/* Resets the palette, accumulates the whole image and finalizes it. */
+IFL_API ifl_status ifl_palette_build(ifl_palette *palette, const ifl_image *image);
+/* Streaming alternative to ifl_palette_build: reset, merge consecutive strips in raster order, then finalize. */
+IFL_API ifl_status ifl_palette_reset(ifl_palette *palette);
+IFL_API ifl_status ifl_palette_merge(ifl_palette *palette, const ifl_image *strip);
+IFL_API ifl_status ifl_palette_finalize(ifl_palette *palette);
+
+/* Remaps the image in place. The image does not have to be the one the palette was built from. */
+IFL_API ifl_status ifl_palette_apply(const ifl_palette *palette, const ifl_image *image);
+/* Writes the 21 palette colours as red, green, blue triples in class order. */
+IFL_API ifl_status ifl_palette_colors(const ifl_palette *palette, uint8_t out_rgb[63]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,176 +1,5915 @@
+#include <fcntl.h>
+#include <setjmp.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
 #include <cstdlib>
+#include <deque>
+#include <exception>
+#include <fstream>
 #include <functional>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
-#include "CImg.h"
 #define cimg_use_png
 #define cimg_use_jpeg
-#define cimg_use_tiff
-#define cimg_use_curl
+#include "CImg.h"
+#include "imagefilter.h"
+
+using namespace cimg_library;
+using namespace ifl;
+
+// Heap accounting. Every operator new in the process is routed through here so each stage can report how many allocations it made and how far
+// the heap grew above where it started. CImg allocates pixel buffers with new[], so they are counted, and pool blocks are charged explicitly
+// while a filter holds them; codec libraries allocate with malloc and only show up in the process RSS high-water mark. Each thread charges its
+// own account, except that parallelFor helpers charge the account of the thread that started them, so a job's figures include its helpers.
+struct HeapCounters {
+    std::atomic<long> current;
+    std::atomic<long> peak;
+    std::atomic<long> allocations;
+};
+// Accounts are never freed, since a block can outlive the thread that allocated it and is still credited back to its account when freed.
+static thread_local HeapCounters *heapAccount = nullptr;
+static HeapCounters &heapCounters(void) {
+    static HeapCounters sharedAccount;
+    if (!heapAccount) {
+        void *memory = std::malloc(sizeof(HeapCounters));
+        heapAccount = memory ? new (memory) HeapCounters() : &sharedAccount;
+    }
+    return *heapAccount;
+}
+static void chargeHeap(HeapCounters &account, long bytes) {
+    long current = account.current += bytes;
+    long peak = account.peak;
+    while (current > peak && !account.peak.compare_exchange_weak(peak, current)) {
+    }
+}
+// Header placed in front of every block: its size and the account it was charged to, so a block freed on another thread is credited back
+// to the right one. Sixteen bytes keeps the returned pointer as aligned as malloc's.
+struct HeapHeader {
+    size_t size;
+    HeapCounters *account;
+};
+static const size_t heapHeader = 16;
+static_assert(sizeof(HeapHeader) <= heapHeader, "heap header does not fit");
+
+// Kept out of line so the compiler does not inline the header arithmetic into callers and misread it as an out-of-bounds access.
+__attribute__((noinline)) static void *countedAlloc(size_t size) {
+    void *block = std::malloc(size + heapHeader);
+    if (!block) {
+        return nullptr;
+    }
+    HeapHeader *header = static_cast<HeapHeader *>(block);
+    header->size = size;
+    header->account = &heapCounters();
+    header->account->allocations++;
+    chargeHeap(*header->account, size);
+    return static_cast<char *>(block) + heapHeader;
+}
+__attribute__((noinline)) static void countedFree(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    HeapHeader *header = reinterpret_cast<HeapHeader *>(static_cast<char *>(ptr) - heapHeader);
+    header->account->current -= header->size;
+    std::free(header);
+}
+void *operator new(size_t size) {
+    void *ptr = countedAlloc(size);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return countedAlloc(size); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return countedAlloc(size); }
+void operator delete(void *ptr) noexcept { countedFree(ptr); }
+void operator delete[](void *ptr) noexcept { countedFree(ptr); }
+void operator delete(void *ptr, size_t) noexcept { countedFree(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { countedFree(ptr); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept { countedFree(ptr); }
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept { countedFree(ptr); }
+
+// Process-wide resident set high-water mark in bytes. Covers memory the codecs allocate with malloc as well.
+static long peakResidentBytes(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return usage.ru_maxrss * 1024L;
+#endif
+}
+
+// Heap activity during one stage: allocations made, the highest the heap rose above its level at the start of the stage, and how much of
+// that the stage still holds when it ends.
+struct StageMemory {
+    long allocations = 0;
+    long peakBytes = 0;
+    long retainedBytes = 0;
+};
+
+// Measures the heap activity between start() and stop() on the calling thread's account. Meters must not be nested, since each one resets
+// the account's peak.
+class StageMeter {
+private:
+    long baseBytes = 0;
+    long baseAllocations = 0;
+
+public:
+    void start(void) {
+        HeapCounters &counters = heapCounters();
+        baseBytes = counters.current;
+        baseAllocations = counters.allocations;
+        counters.peak = baseBytes;
+    }
+    StageMemory stop(void) const {
+        HeapCounters &counters = heapCounters();
+        StageMemory memory;
+        memory.allocations = counters.allocations - baseAllocations;
+        memory.peakBytes = counters.peak - baseBytes;
+        memory.retainedBytes = counters.current - baseBytes;
+        return memory;
+    }
+};
+
+// Wall-clock seconds spent in each stage of the most recent run. Read by the benchmark mode.
+struct StageTimes {
+    double load = 0;
+    double palette = 0;
+    double apply = 0;
+    double save = 0;
+};
+
+// Seconds elapsed since a given steady_clock time point.
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Selects between the scalar reference kernels and the optimized kernels. The optimized kernels must stay bit-exact with the reference, which
+// the --verify mode checks.
+enum class Kernel { Reference, Fast };
+
+// Image dimensions read from the file header without decoding any pixels. Used by the scheduler to estimate a job's memory before admitting it.
+struct ImageHeader {
+    bool known = false;
+    bool jpeg = false;
+    bool png = false;
+    bool tiff = false;
+    bool qoi = false;
+    bool ifp = false;
+    // Baseline or extended sequential JPEG, which libjpeg can decode row by row without buffering the whole coefficient image.
+    bool sequential = false;
+    long width = 0;
+    long height = 0;
+    int channels = 0;
+    // Bytes per decoded sample, which picks the kernels: 2 for 16-bit PNGs and TIFFs, 4 for PFM (float) images, 1 for everything else.
+    int bytesPerSample = 1;
+    // TIFF only: the tile grid, with strips counted as tiles as wide as the image.
+    long tileWidth = 0;
+    long tileHeight = 0;
+};
+
+static ImageHeader readJpegHeader(std::FILE *file) {
+    ImageHeader header;
+    int byte;
+    while ((byte = std::fgetc(file)) != EOF) {
+        if (byte != 0xFF) {
+            continue;
+        }
+        int marker;
+        while ((marker = std::fgetc(file)) == 0xFF) {
+        }
+        if (marker == EOF || marker == 0xD9 || marker == 0xDA) {
+            break;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            continue;
+        }
+        unsigned char field[8];
+        if (std::fread(field, 1, 2, file) != 2) {
+            break;
+        }
+        long length = (field[0] << 8) | field[1];
+        bool frame = marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+        if (frame) {
+            if (length < 8 || std::fread(field, 1, 6, file) != 6) {
+                break;
+            }
+            header.known = true;
+            header.jpeg = true;
+            header.sequential = marker == 0xC0 || marker == 0xC1;
+            header.height = (field[1] << 8) | field[2];
+            header.width = (field[3] << 8) | field[4];
+            header.channels = field[5];
+            break;
+        }
+        std::fseek(file, length - 2, SEEK_CUR);
+    }
+    return header;
+}
+
+static ImageHeader readPngHeader(std::FILE *file) {
+    ImageHeader header;
+    unsigned char ihdr[18];
+    if (std::fread(ihdr, 1, 18, file) != 18 || std::memcmp(ihdr + 4, "IHDR", 4)) {
+        return header;
+    }
+    const int channelsByColorType[7] = {1, 0, 3, 3, 2, 0, 4};
+    header.known = ihdr[17] <= 6 && channelsByColorType[ihdr[17]] > 0;
+    header.png = header.known;
+    header.width = ((long)ihdr[8] << 24) | (ihdr[9] << 16) | (ihdr[10] << 8) | ihdr[11];
+    header.height = ((long)ihdr[12] << 24) | (ihdr[13] << 16) | (ihdr[14] << 8) | ihdr[15];
+    header.channels = header.known ? channelsByColorType[ihdr[17]] : 0;
+    header.bytesPerSample = ihdr[16] == 16 ? 2 : 1;
+    return header;
+}
+
+// PFM: "PF" (colour) or "Pf" (greyscale), then the width, height and scale as text. Samples are 32-bit floats.
+static ImageHeader readPfmHeader(std::FILE *file, bool color) {
+    ImageHeader header;
+    if (std::fscanf(file, "%ld %ld", &header.width, &header.height) == 2 && header.width > 0 && header.height > 0) {
+        header.known = true;
+        header.channels = color ? 3 : 1;
+        header.bytesPerSample = 4;
+    }
+    return header;
+}
+
+static bool hostIsBigEndian(void) {
+    const uint16_t one = 1;
+    return *reinterpret_cast<const unsigned char *>(&one) == 0;
+}
+
+// Deflate expands data at most about 1032 times, so a declared size that would take more than this many times the stored bytes is damaged.
+static const uint64_t deflateMaxRatio = 1032;
+
+// TIFF LZW emits at most 4096 bytes for a code of at least 9 bits, so it expands data at most about 2731 times (4096 * 8 / 12).
+static const uint64_t lzwMaxRatio = 2731;
+
+// The first image of a TIFF or BigTIFF file, as far as the filter needs it. Strips are described as tiles as wide as the image.
+struct TiffLayout {
+    bool bigTiff = false;
+    bool tiled = false;
+    long width = 0;
+    long height = 0;
+    long tileWidth = 0;
+    long tileHeight = 0;
+    int channels = 0;
+    int bitsPerSample = 0;
+    int compression = 1;
+    int predictor = 1;
+    int photometric = -1;
+    std::vector<uint64_t> offsets;
+    std::vector<uint64_t> byteCounts;
+    long tilesAcross(void) const { return (width + tileWidth - 1) / tileWidth; }
+    long tilesDown(void) const { return (height + tileHeight - 1) / tileHeight; }
+    // Rows of pixel data stored for a tile: always the full tile height for tiles, which are padded, but only what is left for the last strip.
+    long storedRows(long index) const { return tiled ? tileHeight : std::min(tileHeight, height - index * tileHeight); }
+    size_t tileRowBytes(void) const { return tileWidth * channels * (bitsPerSample / 8); }
+};
+
+// TIFF LZW: MSB-first codes from 9 to 12 bits, 256 clears the table, 257 ends the data, and the code width grows one code early. Fills `out`
+// and returns false on a malformed stream or one that ends before `out` is full.
+static bool lzwDecode(const std::vector<unsigned char> &in, std::vector<unsigned char> &out) {
+    std::vector<uint16_t> prefix(4096), length(4096, 1);
+    std::vector<unsigned char> suffix(4096), first(4096);
+    for (int i = 0; i < 256; i++) {
+        suffix[i] = first[i] = i;
+    }
+    size_t written = 0, bit = 0, bits = in.size() * 8;
+    int width = 9, next = 258, previous = -1;
+    while (written < out.size() && bit + width <= bits) {
+        int code = 0;
+        for (int i = 0; i < width; i++, bit++) {
+            code = (code << 1) | ((in[bit >> 3] >> (7 - (bit & 7))) & 1);
+        }
+        if (code == 257) {
+            break;
+        }
+        if (code == 256) {
+            width = 9;
+            next = 258;
+            previous = -1;
+            continue;
+        }
+        if (previous < 0) {
+            if (code > 255) {
+                return false;
+            }
+            out[written++] = code;
+            previous = code;
+            continue;
+        }
+        if (code > next || (code == next && next == 4096)) {
+            return false;
+        }
+        if (next < 4096) {
+            prefix[next] = previous;
+            suffix[next] = code < next ? first[code] : first[previous];
+            first[next] = first[previous];
+            length[next] = length[previous] + 1;
+            next++;
+        }
+        int entry = code;
+        for (int i = length[code] - 1; i >= 0; i--, entry = prefix[entry]) {
+            if (written + i < out.size()) {
+                out[written + i] = suffix[entry];
+            }
+        }
+        written += length[code];
+        previous = code;
+        if (next >= (1 << width) - 1 && width < 12) {
+            width++;
+        }
+    }
+    return written >= out.size();
+}
+
+// Reads the first image of a TIFF or BigTIFF file in either byte order: tiled or stripped, chunky, 8 or 16 bits per sample, grey or RGB with
+// an optional alpha channel, uncompressed, LZW or Deflate, with or without horizontal differencing. Tiles are read with pread, so several
+// threads can decode at once.
+class TiffReader {
+private:
+    int fd = -1;
+    bool bigEndian = false;
+    uint64_t fileSize = 0;
+    TiffLayout tiff;
+
+    uint64_t get(const unsigned char *bytes, int size) const {
+        uint64_t value = 0;
+        for (int i = 0; i < size; i++) {
+            value |= (uint64_t)bytes[bigEndian ? size - 1 - i : i] << (8 * i);
+        }
+        return value;
+    }
+    bool readAt(uint64_t offset, unsigned char *into, size_t size) const {
+        while (size > 0) {
+            ssize_t got = pread(fd, into, size, offset);
+            if (got <= 0) {
+                return false;
+            }
+            into += got;
+            offset += got;
+            size -= got;
+        }
+        return true;
+    }
+    // The values of one IFD entry, read inline or from the offset it holds. Types the filter has no use for come back empty.
+    bool entryValues(const unsigned char *entry, std::vector<uint64_t> &values) const {
+        int type = get(entry + 2, 2);
+        uint64_t count = get(entry + 4, tiff.bigTiff ? 8 : 4);
+        const unsigned char *field = entry + (tiff.bigTiff ? 12 : 8);
+        int size = type == 1 ? 1 : type == 3 ? 2 : (type == 4 || type == 13) ? 4 : (type == 16 || type == 18) ? 8 : 0;
+        values.clear();
+        if (!size) {
+            return true;
+        }
+        if (count > fileSize / size) {
+            return false;
+        }
+        std::vector<unsigned char> data(count * size);
+        if (data.size() <= (tiff.bigTiff ? 8U : 4U)) {
+            std::memcpy(data.data(), field, data.size());
+        } else if (!readAt(get(field, tiff.bigTiff ? 8 : 4), data.data(), data.size())) {
+            return false;
+        }
+        for (uint64_t i = 0; i < count; i++) {
+            values.push_back(get(&data[i * size], size));
+        }
+        return true;
+    }
+
+    // Every tile must lie inside the file, and its decoded size, like the whole image's, must be reachable by decompressing the bytes stored
+    // for it. Sizes are compared as doubles, since clamped dimensions can still overflow 64 bits when multiplied.
+    bool checkSizes(void) const {
+        double ratio = tiff.compression == 1 ? 1 : tiff.compression == 5 ? lzwMaxRatio : deflateMaxRatio;
+        double sampleBytes = tiff.channels * (tiff.bitsPerSample / 8);
+        if ((double)tiff.width * tiff.height * sampleBytes > (double)fileSize * ratio) {
+            return false;
+        }
+        for (size_t i = 0; i < tiff.offsets.size(); i++) {
+            if (tiff.byteCounts[i] > fileSize || tiff.offsets[i] > fileSize - tiff.byteCounts[i] ||
+                (double)tiff.tileWidth * sampleBytes * tiff.storedRows(i) > (double)tiff.byteCounts[i] * ratio) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    TiffReader() {}
+    TiffReader(const TiffReader &) = delete;
+    TiffReader &operator=(const TiffReader &) = delete;
+    ~TiffReader() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    // Parses the header and first IFD. Returns false and sets error for anything this reader does not handle, checking the sizes and offsets
+    // it declares against the file's before anything is allocated for them.
+    bool open(const std::string &path, std::string &error) {
+        unsigned char head[16];
+        struct stat file;
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0 || fstat(fd, &file) || !readAt(0, head, 16) || (std::memcmp(head, "II", 2) && std::memcmp(head, "MM", 2))) {
+            error = "cannot read a TIFF header from " + path;
+            return false;
+        }
+        fileSize = file.st_size;
+        bigEndian = head[0] == 'M';
+        tiff.bigTiff = get(head + 2, 2) == 43;
+        uint64_t ifd = tiff.bigTiff ? get(head + 8, 8) : get(head + 4, 4);
+        int countSize = tiff.bigTiff ? 8 : 2, entrySize = tiff.bigTiff ? 20 : 12;
+        unsigned char countBytes[8];
+        if (!readAt(ifd, countBytes, countSize)) {
+            error = "truncated TIFF directory";
+            return false;
+        }
+        uint64_t entries = get(countBytes, countSize);
+        if (entries > 4096) {
+            error = "truncated TIFF directory";
+            return false;
+        }
+        std::vector<unsigned char> directory(entries * entrySize);
+        if (!readAt(ifd + countSize, directory.data(), directory.size())) {
+            error = "truncated TIFF directory";
+            return false;
+        }
+        long rowsPerStrip = 0;
+        int planar = 1, sampleFormat = 1;
+        std::vector<uint64_t> values, stripOffsets, stripByteCounts;
+        for (uint64_t i = 0; i < entries; i++) {
+            const unsigned char *entry = &directory[i * entrySize];
+            if (!entryValues(entry, values)) {
+                error = "truncated TIFF tag data";
+                return false;
+            }
+            if (values.empty()) {
+                continue;
+            }
+            // Dimensions beyond 2^31 are clamped there; the size checks below refuse them.
+            uint64_t first = std::min<uint64_t>(values[0], 1L << 31);
+            switch (get(entry, 2)) {
+            case 256: tiff.width = first; break;
+            case 257: tiff.height = first; break;
+            case 258: tiff.bitsPerSample = values[0]; break;
+            case 259: tiff.compression = values[0]; break;
+            case 262: tiff.photometric = values[0]; break;
+            case 273: stripOffsets = values; break;
+            case 277: tiff.channels = values[0]; break;
+            case 278: rowsPerStrip = first; break;
+            case 279: stripByteCounts = values; break;
+            case 284: planar = values[0]; break;
+            case 317: tiff.predictor = values[0]; break;
+            case 322: tiff.tileWidth = first; break;
+            case 323: tiff.tileHeight = first; break;
+            case 324: tiff.offsets = values; break;
+            case 325: tiff.byteCounts = values; break;
+            case 339: sampleFormat = values[0]; break;
+            }
+        }
+        tiff.tiled = tiff.tileWidth > 0 && tiff.tileHeight > 0;
+        if (!tiff.tiled) {
+            tiff.tileWidth = tiff.width;
+            tiff.tileHeight = rowsPerStrip > 0 ? std::min(rowsPerStrip, tiff.height) : tiff.height;
+            tiff.offsets = stripOffsets;
+            tiff.byteCounts = stripByteCounts;
+        }
+        bool grey = tiff.photometric == 1 && (tiff.channels == 1 || tiff.channels == 2);
+        bool rgb = tiff.photometric == 2 && (tiff.channels == 3 || tiff.channels == 4);
+        if (tiff.width <= 0 || tiff.height <= 0 || tiff.tileWidth <= 0 || tiff.tileHeight <= 0 || (!grey && !rgb)) {
+            error = "unsupported TIFF: needs greyscale or RGB pixels, with at most one alpha channel";
+        } else if ((tiff.bitsPerSample != 8 && tiff.bitsPerSample != 16) || sampleFormat != 1 || planar != 1) {
+            error = "unsupported TIFF: needs chunky 8- or 16-bit unsigned samples";
+        } else if (tiff.compression != 1 && tiff.compression != 5 && tiff.compression != 8 && tiff.compression != 32946) {
+            error = "unsupported TIFF compression " + std::to_string(tiff.compression);
+        } else if (tiff.predictor != 1 && tiff.predictor != 2) {
+            error = "unsupported TIFF predictor " + std::to_string(tiff.predictor);
+        } else if ((long)tiff.offsets.size() != tiff.tilesAcross() * tiff.tilesDown() || tiff.byteCounts.size() != tiff.offsets.size()) {
+            error = "TIFF tile or strip tables do not match the image size";
+        } else if (!checkSizes()) {
+            error = "TIFF sizes or offsets do not fit in the file";
+        }
+        return error.empty();
+    }
+    const TiffLayout &layout(void) const { return tiff; }
+    // Decodes one tile (or strip) into pixels, in host byte order. Safe to call from several threads at once.
+    bool readTile(long index, std::vector<unsigned char> &pixels, std::string &error) const {
+        size_t rowBytes = tiff.tileRowBytes();
+        long rows = tiff.storedRows(index);
+        std::vector<unsigned char> packed;
+        try {
+            packed.resize(tiff.byteCounts[index]);
+            pixels.assign(rowBytes * rows, 0);
+        } catch (const std::bad_alloc &) {
+            error = "out of memory for TIFF tile " + std::to_string(index);
+            return false;
+        }
+        if (!readAt(tiff.offsets[index], packed.data(), packed.size())) {
+            error = "truncated TIFF tile " + std::to_string(index);
+            return false;
+        }
+        if (tiff.compression == 1) {
+            if (packed.size() < pixels.size()) {
+                error = "truncated TIFF tile " + std::to_string(index);
+                return false;
+            }
+            std::memcpy(pixels.data(), packed.data(), pixels.size());
+        } else if (tiff.compression == 5) {
+            if (!lzwDecode(packed, pixels)) {
+                error = "corrupt LZW data in TIFF tile " + std::to_string(index);
+                return false;
+            }
+        } else {
+            z_stream stream = z_stream();
+            stream.next_in = packed.data();
+            stream.avail_in = packed.size();
+            stream.next_out = pixels.data();
+            stream.avail_out = pixels.size();
+            int status = inflateInit(&stream) == Z_OK ? inflate(&stream, Z_FINISH) : Z_STREAM_ERROR;
+            inflateEnd(&stream);
+            if (status != Z_STREAM_END || stream.avail_out != 0) {
+                error = "corrupt Deflate data in TIFF tile " + std::to_string(index);
+                return false;
+            }
+        }
+        if (tiff.bitsPerSample == 16) {
+            uint16_t *samples = reinterpret_cast<uint16_t *>(pixels.data());
+            for (size_t i = 0; bigEndian != hostIsBigEndian() && i < pixels.size() / 2; i++) {
+                samples[i] = (samples[i] >> 8) | (samples[i] << 8);
+            }
+            for (long y = 0; tiff.predictor == 2 && y < rows; y++) {
+                uint16_t *row = samples + y * tiff.tileWidth * tiff.channels;
+                for (long i = tiff.channels; i < tiff.tileWidth * tiff.channels; i++) {
+                    row[i] += row[i - tiff.channels];
+                }
+            }
+        } else {
+            for (long y = 0; tiff.predictor == 2 && y < rows; y++) {
+                unsigned char *row = pixels.data() + y * rowBytes;
+                for (long i = tiff.channels; i < tiff.tileWidth * tiff.channels; i++) {
+                    row[i] += row[i - tiff.channels];
+                }
+            }
+        }
+        return true;
+    }
+};
+
+// Sniffs the format from the first bytes rather than the extension, since files are often misnamed.
+static ImageHeader readImageHeader(const std::string &uri) {
+    ImageHeader header;
+    std::FILE *file = std::fopen(uri.c_str(), "rb");
+    if (!file) {
+        return header;
+    }
+    unsigned char magic[8];
+    if (std::fread(magic, 1, 8, file) == 8) {
+        if (magic[0] == 0xFF && magic[1] == 0xD8) {
+            std::fseek(file, 2, SEEK_SET);
+            header = readJpegHeader(file);
+        } else if (!std::memcmp(magic, "\x89PNG\r\n\x1a\n", 8)) {
+            header = readPngHeader(file);
+        } else if (!std::memcmp(magic, "qoif", 4)) {
+            unsigned char rest[6];
+            if (std::fread(rest, 1, 6, file) == 6 && (rest[4] == 3 || rest[4] == 4)) {
+                header.known = true;
+                header.qoi = true;
+                header.width = (long)magic[4] << 24 | magic[5] << 16 | magic[6] << 8 | magic[7];
+                header.height = (long)rest[0] << 24 | rest[1] << 16 | rest[2] << 8 | rest[3];
+                header.channels = rest[4];
+            }
+        } else if (!std::memcmp(magic, "IFP1", 4)) {
+            unsigned char rest[8];
+            if (std::fread(rest, 1, 8, file) == 8) {
+                header.known = magic[4] == 1 || magic[4] == 2 || magic[4] == 4;
+                header.ifp = true;
+                header.bytesPerSample = magic[4];
+                header.channels = magic[5];
+                header.width = rest[0] | rest[1] << 8 | rest[2] << 16 | (long)rest[3] << 24;
+                header.height = rest[4] | rest[5] << 8 | rest[6] << 16 | (long)rest[7] << 24;
+                // Nothing is sized from a header whose pixels' 5-bit classes could not inflate from the file; IfpReader checks the rest.
+                std::fseek(file, 0, SEEK_END);
+                header.known = header.known && (double)header.width * header.height * 5 / 8 <= (double)std::ftell(file) * deflateMaxRatio;
+            }
+        } else if (magic[0] == 'P' && (magic[1] == 'F' || magic[1] == 'f') && std::isspace(magic[2])) {
+            std::fseek(file, 2, SEEK_SET);
+            header = readPfmHeader(file, magic[1] == 'F');
+        } else if (!std::memcmp(magic, "II*\0", 4) || !std::memcmp(magic, "MM\0*", 4) || !std::memcmp(magic, "II+\0", 4) ||
+                   !std::memcmp(magic, "MM\0+", 4)) {
+            header.tiff = true;
+        }
+    }
+    std::fclose(file);
+    TiffReader reader;
+    std::string error;
+    if (header.tiff && reader.open(uri, error)) {
+        const TiffLayout &tiff = reader.layout();
+        header.known = true;
+        header.width = tiff.width;
+        header.height = tiff.height;
+        header.channels = tiff.channels;
+        header.bytesPerSample = tiff.bitsPerSample / 8;
+        header.tileWidth = tiff.tileWidth;
+        header.tileHeight = tiff.tileHeight;
+    }
+    return header;
+}
+
+// Estimated peak bytes for filtering an image in memory: the decoded planes, which the filter decodes into directly and filters in place,
+// plus codec row buffers and slack.
+static long estimateInMemoryBytes(const ImageHeader &header) {
+    return header.width * header.height * header.channels * header.bytesPerSample + header.width * 64 + (1L << 20);
+}
+
+// Estimated peak bytes for the strip-streaming path: libjpeg's row groups and our row buffers, both proportional to the width only.
+static long estimateStripBytes(const ImageHeader &header) { return header.width * header.channels * 64 + (4L << 20); }
+
+// Bytes of raster the tiled path processes at a time, and so roughly how much of its scratch file is resident.
+static const long tiledTileBytes = 16L << 20;
+
+// Estimated peak bytes for the tiled path: one tile (at least one row) of the mapped scratch file, the PNG writer's batch of raw, filtered and
+// deflated rows (under 2 MB per thread) and slack. The rest of the raster lives in the file.
+static long estimateTiledBytes(const ImageHeader &header) {
+    long writerBytes = std::max(1u, std::thread::hardware_concurrency()) * std::max(2L << 20, header.width * 4 * 6);
+    return std::max(tiledTileBytes, header.width * 4) + writerBytes + (4L << 20);
+}
+
+// Decoded bytes the TIFF path aims to hold per batch of tile rows. A batch is never less than one tile row.
+static const long tiffBatchBytes = 16L << 20;
+
+// Estimated peak bytes for a TIFF: one batch of decoded tiles and their compressed copies, plus slack.
+static long estimateTiffBytes(const ImageHeader &header) {
+    long tilesAcross = (header.width + header.tileWidth - 1) / std::max(1L, header.tileWidth);
+    long tileRowBytes = tilesAcross * header.tileWidth * header.tileHeight * header.channels * header.bytesPerSample;
+    return 2 * std::max(tiffBatchBytes, tileRowBytes) + (4L << 20);
+}
+
+static long physicalMemoryBytes(void) { return sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGE_SIZE); }
+
+// Recycles decoded-image buffers between jobs. Large new[] allocations come straight from mmap, so without this every image page-faults (and has
+// the kernel zero) its whole raster again. Blocks are grouped into size classes a quarter octave apart so images of similar but not identical
+// size share them, and can be backed by transparent huge pages to cut the number of faults and TLB misses further.
+class BufferPool {
+private:
+    std::mutex lock;
+    std::multimap<size_t, unsigned char *> idle;
+    size_t idleBytes = 0;
+    size_t maxIdleBytes;
+    bool hugePages;
+    long hits = 0;
+    long misses = 0;
+
+public:
+    static const size_t hugePageBytes = 2UL << 20;
+    BufferPool(size_t maxIdle, bool huge) : maxIdleBytes(maxIdle), hugePages(huge) {}
+    ~BufferPool() {
+        for (std::multimap<size_t, unsigned char *>::value_type &block : idle) {
+            std::free(block.second);
+        }
+    }
+    // Rounds up to the next quarter-octave step, and never below one huge page.
+    static size_t sizeClass(size_t bytes) {
+        size_t octave = hugePageBytes;
+        while (octave * 2 <= bytes) {
+            octave *= 2;
+        }
+        size_t step = std::max(octave / 4, (size_t)4096);
+        return std::max(hugePageBytes, (bytes + step - 1) / step * step);
+    }
+    // Returns a block of at least the given size and sets capacity to its real size, which must be passed back to release().
+    unsigned char *acquire(size_t bytes, size_t &capacity) {
+        capacity = sizeClass(bytes);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            std::multimap<size_t, unsigned char *>::iterator found = idle.find(capacity);
+            if (found != idle.end()) {
+                unsigned char *data = found->second;
+                idle.erase(found);
+                idleBytes -= capacity;
+                hits++;
+                return data;
+            }
+            misses++;
+        }
+        void *data = nullptr;
+        if (posix_memalign(&data, hugePages ? hugePageBytes : 64, capacity)) {
+            throw std::bad_alloc();
+        }
+#ifdef MADV_HUGEPAGE
+        if (hugePages) {
+            madvise(data, capacity, MADV_HUGEPAGE);
+        }
+#endif
+        return static_cast<unsigned char *>(data);
+    }
+    // Keeps the block for reuse unless that would take the pool over its idle limit.
+    void release(unsigned char *data, size_t capacity) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (idleBytes + capacity <= maxIdleBytes) {
+                idle.insert(std::make_pair(capacity, data));
+                idleBytes += capacity;
+                return;
+            }
+        }
+        std::free(data);
+    }
+    std::string summary(void) {
+        std::lock_guard<std::mutex> guard(lock);
+        std::ostringstream text;
+        text << "buffer pool: " << hits << " reused, " << misses << " allocated, " << idleBytes << " bytes idle";
+        return text.str();
+    }
+};
+
+const size_t BufferPool::hugePageBytes;
+
+struct JpegErrorManager {
+    jpeg_error_mgr base;
+    jmp_buf jump;
+    char message[JMSG_LENGTH_MAX];
+};
+
+static void jpegErrorExit(j_common_ptr info) {
+    JpegErrorManager *manager = reinterpret_cast<JpegErrorManager *>(info->err);
+    (*info->err->format_message)(info, manager->message);
+    longjmp(manager->jump, 1);
+}
+
+// Runs body(i) for every i in [0, count) on up to `threads` threads, handing out indices in increasing order. Helpers charge their heap use
+// to the calling thread's account. If body throws, no further indices are handed out, and the first exception is rethrown on the calling
+// thread once every helper has finished. Helpers that cannot be started leave their share to the others.
+static void parallelFor(long count, int threads, const std::function<void(long)> &body) {
+    std::atomic<long> next(0);
+    std::mutex lock;
+    std::exception_ptr failure;
+    std::function<void(void)> work = [&] {
+        for (long i = next++; i < count; i = next++) {
+            try {
+                body(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(lock);
+                if (!failure) {
+                    failure = std::current_exception();
+                }
+                next = count;
+            }
+        }
+    };
+    HeapCounters *account = &heapCounters();
+    std::vector<std::thread> helpers;
+    helpers.reserve(std::max(0L, std::min<long>(threads, count) - 1));
+    for (int i = 1; i < std::min<long>(threads, count); i++) {
+        try {
+            helpers.push_back(std::thread([&work, account] {
+                heapAccount = account;
+                work();
+            }));
+        } catch (const std::system_error &) {
+            break;
+        }
+    }
+    work();
+    for (std::thread &helper : helpers) {
+        helper.join();
+    }
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+}
+
+// Source manager that hands libjpeg a list of byte ranges in turn, so restart segments can be decoded straight out of the file buffer behind a
+// patched copy of its headers.
+struct JpegPieceSource {
+    jpeg_source_mgr base;
+    std::vector<std::pair<const unsigned char *, size_t>> pieces;
+    size_t next;
+};
+
+static const unsigned char jpegRestartMarkers[8][2] = {{0xFF, 0xD0}, {0xFF, 0xD1}, {0xFF, 0xD2}, {0xFF, 0xD3},
+                                                        {0xFF, 0xD4}, {0xFF, 0xD5}, {0xFF, 0xD6}, {0xFF, 0xD7}};
+static const unsigned char jpegEndOfImage[2] = {0xFF, 0xD9};
+
+static void jpegPieceInit(j_decompress_ptr) {}
+
+static boolean jpegPieceFill(j_decompress_ptr info) {
+    JpegPieceSource *source = reinterpret_cast<JpegPieceSource *>(info->src);
+    if (source->next < source->pieces.size()) {
+        source->base.next_input_byte = source->pieces[source->next].first;
+        source->base.bytes_in_buffer = source->pieces[source->next].second;
+        source->next++;
+    } else {
+        // Past the end: keep feeding end-of-image markers, as libjpeg's own sources do.
+        info->err->num_warnings++;
+        source->base.next_input_byte = jpegEndOfImage;
+        source->base.bytes_in_buffer = 2;
+    }
+    return TRUE;
+}
+
+static void jpegPieceSkip(j_decompress_ptr info, long count) {
+    while (count > (long)info->src->bytes_in_buffer) {
+        count -= info->src->bytes_in_buffer;
+        jpegPieceFill(info);
+    }
+    info->src->next_input_byte += count;
+    info->src->bytes_in_buffer -= count;
+}
+
+static void jpegPieceTerm(j_decompress_ptr) {}
+
+// Counts warnings without printing them. A chunk that warns is decoded again serially, which reports them as usual.
+static void jpegQuietMessage(j_common_ptr info, int level) {
+    if (level < 0) {
+        info->err->num_warnings++;
+    }
+}
+
+// The layout of a single-scan baseline JPEG, found by walking its markers: the frame header's height field, where the entropy-coded data
+// starts and the byte range of every restart segment. RestartJpegDecoder uses it to split a file, StripJpegEncoder to stitch strips together.
+struct JpegScan {
+    size_t heightField = 0;
+    size_t scanStart = 0;
+    long width = 0;
+    long height = 0;
+    int components = 0;
+    long restartInterval = 0;
+    int hMax = 1;
+    int vMax = 1;
+    // Some component has fewer rows than the image, so libjpeg's upsampling mixes neighbouring rows.
+    bool verticalSubsampling = false;
+    // Byte range of every restart segment, without its marker.
+    std::vector<std::pair<size_t, size_t>> segments;
+
+    // A single-component scan codes one block per MCU whatever the sampling factors say.
+    long mcuWidth(void) const { return components == 1 ? 8 : 8 * hMax; }
+    long mcuHeight(void) const { return components == 1 ? 8 : 8 * vMax; }
+    long mcusAcross(void) const { return (width + mcuWidth() - 1) / mcuWidth(); }
+    long mcusDown(void) const { return (height + mcuHeight() - 1) / mcuHeight(); }
+    // Returns false for anything that has no independent segments: progressive or lossless frames, multiple scans, no restart interval,
+    // colour spaces other than greyscale and YCbCr/RGB, or segments that do not match the MCU count.
+    bool parse(const std::vector<unsigned char> &file) {
+        int scanComponents = 0;
+        if (file.size() < 4 || file[0] != 0xFF || file[1] != 0xD8) {
+            return false;
+        }
+        for (size_t p = 2; !scanStart;) {
+            if (p + 4 > file.size() || file[p] != 0xFF) {
+                return false;
+            }
+            int marker = file[p + 1];
+            if (marker == 0xFF) {
+                p++;
+                continue;
+            }
+            size_t length = (file[p + 2] << 8) | file[p + 3];
+            if (length < 2 || p + 2 + length > file.size()) {
+                return false;
+            }
+            const unsigned char *field = &file[p + 4];
+            if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+                if ((marker != 0xC0 && marker != 0xC1) || length < 8 || length < 8 + 3 * (size_t)field[5]) {
+                    return false;
+                }
+                heightField = p + 5;
+                height = (field[1] << 8) | field[2];
+                width = (field[3] << 8) | field[4];
+                components = field[5];
+                for (int i = 0; i < components; i++) {
+                    hMax = std::max(hMax, field[7 + 3 * i] >> 4);
+                    vMax = std::max(vMax, field[7 + 3 * i] & 15);
+                }
+                for (int i = 0; i < components; i++) {
+                    verticalSubsampling = verticalSubsampling || (components > 1 && (field[7 + 3 * i] & 15) < vMax);
+                }
+            } else if (marker == 0xDD && length >= 4) {
+                restartInterval = (field[0] << 8) | field[1];
+            } else if (marker == 0xDA && length >= 3) {
+                scanComponents = field[0];
+                scanStart = p + 2 + length;
+            }
+            p += 2 + length;
+        }
+        if (!width || !height || !restartInterval || scanComponents != components || (components != 1 && components != 3)) {
+            return false;
+        }
+        bool ended = false;
+        size_t start = scanStart;
+        for (size_t i = scanStart; i + 1 < file.size() && !ended; i++) {
+            if (file[i] != 0xFF || file[i + 1] == 0x00 || file[i + 1] == 0xFF) {
+                continue;
+            }
+            segments.push_back(std::make_pair(start, i));
+            if (file[i + 1] < 0xD0 || file[i + 1] > 0xD7) {
+                // Anything but the end of the image here is a second scan.
+                if (file[i + 1] != 0xD9) {
+                    return false;
+                }
+                ended = true;
+            }
+            start = ++i + 1;
+        }
+        return ended && (long)segments.size() == (mcusAcross() * mcusDown() + restartInterval - 1) / restartInterval;
+    }
+};
+
+// Decodes a baseline JPEG on several threads when restart markers cut up its entropy-coded data. Every restart resets the DC predictors, so a
+// run of segments that starts at the beginning of an MCU row decodes on its own, given the file's tables and a frame header patched to the run's
+// height. The image is split into chunks at the restart points that fall on MCU-row boundaries, and each chunk is decoded straight into its
+// rows of the planar image. When chroma is subsampled vertically, libjpeg's upsampling reads one chroma row past each edge of a chunk, so each
+// chunk also decodes one group of rows on either side and throws them away. The pixels are then identical to a serial decode.
+class RestartJpegDecoder {
+private:
+    std::vector<unsigned char> file;
+    int threads;
+    JpegScan scan;
+    long width = 0;
+    long height = 0;
+    int components = 0;
+    // Pixel rows and restart segments from one usable cut point to the next.
+    long groupRows = 0;
+    long groupSegments = 0;
+
+    bool readFile(const std::string &uri) {
+        std::ifstream in(uri.c_str(), std::ios::binary | std::ios::ate);
+        std::streamoff size = in ? (std::streamoff)in.tellg() : 0;
+        if (size < 4) {
+            return false;
+        }
+        file.resize(size);
+        in.seekg(0);
+        return (bool)in.read(reinterpret_cast<char *>(file.data()), size);
+    }
+    // Finds the restart points that fall on MCU-row boundaries: every lcm(restart interval, MCUs per row) MCUs.
+    bool parse(void) {
+        if (!scan.parse(file)) {
+            return false;
+        }
+        width = scan.width;
+        height = scan.height;
+        components = scan.components;
+        long a = scan.restartInterval, b = scan.mcusAcross();
+        while (b) {
+            long rest = a % b;
+            a = b;
+            b = rest;
+        }
+        long cutMcus = scan.restartInterval / a * scan.mcusAcross();
+        groupRows = cutMcus / scan.mcusAcross() * scan.mcuHeight();
+        groupSegments = cutMcus / scan.restartInterval;
+        return true;
+    }
+    // Decodes groups [first, last) into the image, plus the context groups around them.
+    bool decodeChunk(CImg<unsigned char> &image, long first, long last) {
+        long groups = (height + groupRows - 1) / groupRows, context = scan.verticalSubsampling ? 1 : 0;
+        long from = std::max(0L, first - context), to = std::min(groups, last + context);
+        long top = from * groupRows, rows = std::min(height, to * groupRows) - top, bottom = std::min(height, last * groupRows);
+        std::vector<unsigned char> headers(file.begin(), file.begin() + scan.scanStart);
+        headers[scan.heightField] = rows >> 8;
+        headers[scan.heightField + 1] = rows & 255;
+        JpegPieceSource source;
+        source.pieces.push_back(std::make_pair(headers.data(), headers.size()));
+        const std::vector<std::pair<size_t, size_t>> &segments = scan.segments;
+        long firstSegment = from * groupSegments, lastSegment = std::min((long)segments.size(), to * groupSegments);
+        for (long k = firstSegment; k < lastSegment; k++) {
+            if (k > firstSegment) {
+                source.pieces.push_back(std::make_pair(jpegRestartMarkers[(k - firstSegment - 1) & 7], (size_t)2));
+            }
+            if (segments[k].second > segments[k].first) {
+                source.pieces.push_back(std::make_pair(&file[segments[k].first], segments[k].second - segments[k].first));
+            }
+        }
+        source.pieces.push_back(std::make_pair(jpegEndOfImage, (size_t)2));
+        source.next = 0;
+        source.base.next_input_byte = nullptr;
+        source.base.bytes_in_buffer = 0;
+        source.base.init_source = jpegPieceInit;
+        source.base.fill_input_buffer = jpegPieceFill;
+        source.base.skip_input_data = jpegPieceSkip;
+        source.base.resync_to_restart = jpeg_resync_to_restart;
+        source.base.term_source = jpegPieceTerm;
+        std::vector<unsigned char> row(width * components);
+        long plane = width * height;
+
+        jpeg_decompress_struct decoder;
+        JpegErrorManager manager;
+        decoder.err = jpeg_std_error(&manager.base);
+        manager.base.error_exit = jpegErrorExit;
+        manager.base.emit_message = jpegQuietMessage;
+        if (setjmp(manager.jump)) {
+            jpeg_destroy_decompress(&decoder);
+            return false;
+        }
+        jpeg_create_decompress(&decoder);
+        decoder.src = &source.base;
+        jpeg_read_header(&decoder, TRUE);
+        jpeg_start_decompress(&decoder);
+        if ((long)decoder.output_width != width || (long)decoder.output_height != rows || decoder.output_components != components) {
+            jpeg_destroy_decompress(&decoder);
+            return false;
+        }
+        for (long y = top; y < bottom; y++) {
+            JSAMPROW rowPointer = row.data();
+            if (jpeg_read_scanlines(&decoder, &rowPointer, 1) != 1) {
+                break;
+            }
+            if (y < first * groupRows) {
+                continue;
+            }
+            unsigned char *out = image.data() + y * width;
+            if (components == 1) {
+                std::memcpy(out, row.data(), width);
+                continue;
+            }
+            for (long x = 0; x < width; x++) {
+                out[x] = row[3 * x];
+                out[x + plane] = row[3 * x + 1];
+                out[x + 2 * plane] = row[3 * x + 2];
+            }
+        }
+        bool clean = (long)decoder.output_scanline == bottom - top && manager.base.num_warnings == 0;
+        jpeg_destroy_decompress(&decoder);
+        return clean;
+    }
+
+public:
+    RestartJpegDecoder(int workers = std::max(1u, std::thread::hardware_concurrency())) : threads(workers) {}
+    // Decodes the file into image, which must already be sized for it with one plane per component, as CImg's load_jpeg would. Returns false
+    // when the file cannot be split or a chunk fails, possibly leaving the image partly written; the caller then decodes it serially.
+    bool decode(const std::string &uri, CImg<unsigned char> &image) {
+        if (threads < 2 || !readFile(uri) || !parse()) {
+            return false;
+        }
+        if (image.width() != width || image.height() != height || image.depth() != 1 || image.spectrum() != components) {
+            return false;
+        }
+        // With context rows every chunk decodes up to two extra groups, so it should be a few groups tall to be worth it.
+        long groups = (height + groupRows - 1) / groupRows;
+        long chunks = std::min<long>(threads, groups / (scan.verticalSubsampling ? 4 : 1));
+        if (chunks < 2) {
+            return false;
+        }
+        std::vector<char> decoded(chunks, 0);
+        parallelFor(chunks, threads, [&](long i) { decoded[i] = decodeChunk(image, groups * i / chunks, groups * (i + 1) / chunks); });
+        return std::find(decoded.begin(), decoded.end(), 0) == decoded.end();
+    }
+};
+
+// Decodes a JPEG into an image already sized for it, on several threads if it has restart markers. JPEGs only ever decode to 8-bit images.
+template <typename T>
+static bool decodeRestartJpeg(const std::string &, CImg<T> &) {
+    return false;
+}
+
+static bool decodeRestartJpeg(const std::string &uri, CImg<unsigned char> &image) {
+    RestartJpegDecoder decoder;
+    return decoder.decode(uri, image);
+}
+
+// Encodes an 8-bit greyscale or RGB image as a baseline JPEG on several threads. The image is cut into strips of whole MCU rows and each strip
+// is encoded on its own, with a restart marker after every MCU row. The strips' segments are then stitched behind the first strip's headers,
+// with the frame height patched and the markers renumbered. Settings match CImg's save_jpeg, and libjpeg codes and downsamples every MCU
+// without looking outside it, so the file decodes to exactly the pixels CImg's would. It is a few bytes per MCU row larger, and
+// RestartJpegDecoder can read it back in parallel.
+class StripJpegEncoder {
+private:
+    int threads;
+    int quality;
+
+    void configure(jpeg_compress_struct &encoder, long width, long height, int components) const {
+        encoder.image_width = width;
+        encoder.image_height = height;
+        encoder.input_components = components;
+        encoder.in_color_space = components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+        jpeg_set_defaults(&encoder);
+        jpeg_set_quality(&encoder, quality, TRUE);
+        // Strips must share the standard Huffman tables to be stitched together.
+        encoder.optimize_coding = FALSE;
+        encoder.restart_in_rows = 1;
+    }
+    // Encodes rows [top, top + rows) of the image as a JPEG of its own.
+    bool encodeStrip(const CImg<unsigned char> &image, long top, long rows, std::vector<unsigned char> &out) const {
+        long width = image.width(), plane = (long)image.width() * image.height();
+        int components = image.spectrum();
+        std::vector<unsigned char> row(width * components);
+        unsigned char *buffer = nullptr;
+        unsigned long size = 0;
+        jpeg_compress_struct encoder;
+        JpegErrorManager manager;
+        encoder.err = jpeg_std_error(&manager.base);
+        manager.base.error_exit = jpegErrorExit;
+        if (setjmp(manager.jump)) {
+            jpeg_destroy_compress(&encoder);
+            std::free(buffer);
+            return false;
+        }
+        jpeg_create_compress(&encoder);
+        jpeg_mem_dest(&encoder, &buffer, &size);
+        configure(encoder, width, rows, components);
+        jpeg_start_compress(&encoder, TRUE);
+        for (long y = top; y < top + rows; y++) {
+            const unsigned char *in = image.data() + y * width;
+            if (components == 1) {
+                std::memcpy(row.data(), in, width);
+            } else {
+                for (long x = 0; x < width; x++) {
+                    row[3 * x] = in[x];
+                    row[3 * x + 1] = in[x + plane];
+                    row[3 * x + 2] = in[x + 2 * plane];
+                }
+            }
+            JSAMPROW rowPointer = row.data();
+            jpeg_write_scanlines(&encoder, &rowPointer, 1);
+        }
+        jpeg_finish_compress(&encoder);
+        out.assign(buffer, buffer + size);
+        jpeg_destroy_compress(&encoder);
+        std::free(buffer);
+        return true;
+    }
+
+public:
+    StripJpegEncoder(int workers = std::max(1u, std::thread::hardware_concurrency()), int q = 100) : threads(workers), quality(q) {}
+    // Writes the image to path. Returns false, without having touched path, for images it does not handle: other channel counts, a single
+    // core or a single MCU row. The caller then saves it serially.
+    bool save(const CImg<unsigned char> &image, const std::string &path) const {
+        if (threads < 2 || image.depth() != 1 || (image.spectrum() != 1 && image.spectrum() != 3) || image.is_empty()) {
+            return false;
+        }
+        jpeg_compress_struct probe;
+        jpeg_error_mgr errors;
+        probe.err = jpeg_std_error(&errors);
+        jpeg_create_compress(&probe);
+        configure(probe, image.width(), image.height(), image.spectrum());
+        long mcuHeight = 8;
+        for (int i = 0; i < probe.num_components; i++) {
+            mcuHeight = std::max(mcuHeight, 8L * probe.comp_info[i].v_samp_factor);
+        }
+        jpeg_destroy_compress(&probe);
+        long mcuRows = (image.height() + mcuHeight - 1) / mcuHeight, strips = std::min<long>(threads, mcuRows);
+        if (strips < 2) {
+            return false;
+        }
+        std::vector<std::vector<unsigned char>> encoded(strips);
+        std::vector<char> done(strips, 0);
+        parallelFor(strips, threads, [&](long i) {
+            long top = mcuRows * i / strips * mcuHeight, bottom = std::min<long>(image.height(), mcuRows * (i + 1) / strips * mcuHeight);
+            done[i] = encodeStrip(image, top, bottom - top, encoded[i]);
+        });
+        if (std::find(done.begin(), done.end(), 0) != done.end()) {
+            return false;
+        }
+
+        std::vector<JpegScan> scans(strips);
+        for (long i = 0; i < strips; i++) {
+            if (!scans[i].parse(encoded[i])) {
+                return false;
+            }
+        }
+        std::vector<unsigned char> headers(encoded[0].begin(), encoded[0].begin() + scans[0].scanStart);
+        headers[scans[0].heightField] = image.height() >> 8;
+        headers[scans[0].heightField + 1] = image.height() & 255;
+        std::FILE *file = std::fopen(path.c_str(), "wb");
+        if (!file) {
+            return false;
+        }
+        bool written = std::fwrite(headers.data(), 1, headers.size(), file) == headers.size();
+        long segment = 0;
+        for (long i = 0; i < strips; i++) {
+            for (const std::pair<size_t, size_t> &range : scans[i].segments) {
+                if (segment > 0) {
+                    written = written && std::fwrite(jpegRestartMarkers[(segment - 1) & 7], 1, 2, file) == 2;
+                }
+                size_t length = range.second - range.first;
+                written = written && std::fwrite(&encoded[i][range.first], 1, length, file) == length;
+                segment++;
+            }
+        }
+        written = written && std::fwrite(jpegEndOfImage, 1, 2, file) == 2;
+        return std::fclose(file) == 0 && written;
+    }
+};
+
+// Saves an image as a JPEG on several threads when StripJpegEncoder handles it. JPEGs are only ever written from 8-bit images.
+template <typename T>
+static bool saveStripJpeg(const CImg<T> &, const std::string &) {
+    return false;
+}
+
+static bool saveStripJpeg(const CImg<unsigned char> &image, const std::string &path) {
+    StripJpegEncoder encoder;
+    return encoder.save(image, path);
+}
+
+// Deflate level for PNG output, from --png-level: 1 is fastest, 9 smallest and 0 stores. Z_DEFAULT_COMPRESSION is zlib's default, 6.
+static int pngCompressionLevel = Z_DEFAULT_COMPRESSION;
+
+// The distinct colours of an image bound for an indexed PNG, at most 256, in the order they were added. A small open-addressing hash maps
+// packed RGBA to the index. Built from the pixels, or by PngTiledFilter straight from the palette, and then read by the writer's threads.
+class PngColorTable {
+private:
+    static const int slots = 1024;
+    // Packed colour plus one, so that zero marks an empty slot, and the index stored there.
+    std::vector<uint64_t> keys;
+    std::vector<unsigned char> indices;
+    std::vector<uint32_t> colors;
+
+    static size_t slotOf(uint32_t color) { return (color * 2654435761u) >> 22; }
+
+public:
+    PngColorTable() : keys(slots, 0), indices(slots, 0) {}
+    static uint32_t pack(int r, int g, int b, int a = 255) { return r | g << 8 | b << 16 | (uint32_t)a << 24; }
+    // Returns the colour's index, or -1 if it is not in the table.
+    int find(uint32_t color) const {
+        for (size_t slot = slotOf(color);; slot = (slot + 1) % slots) {
+            if (keys[slot] == color + 1ULL) {
+                return indices[slot];
+            }
+            if (!keys[slot]) {
+                return -1;
+            }
+        }
+    }
+    // Returns the colour's index, adding it if needed, or -1 once the table holds 256 other colours.
+    int add(uint32_t color) {
+        size_t slot = slotOf(color);
+        for (; keys[slot]; slot = (slot + 1) % slots) {
+            if (keys[slot] == color + 1ULL) {
+                return indices[slot];
+            }
+        }
+        if (colors.size() == 256) {
+            return -1;
+        }
+        keys[slot] = color + 1ULL;
+        indices[slot] = colors.size();
+        colors.push_back(color);
+        return indices[slot];
+    }
+    size_t size(void) const { return colors.size(); }
+    // Fewest bits per index that hold every colour.
+    int bitDepth(void) const { return colors.size() <= 2 ? 1 : colors.size() <= 4 ? 2 : colors.size() <= 16 ? 4 : 8; }
+    uint32_t color(size_t index) const { return colors[index]; }
+    // Packs the indices of one row of pixels, `step` samples apart in each of the given channel pointers, at bitDepth() bits each. alpha may
+    // be null for opaque pixels. Returns false if a colour is missing from the table.
+    bool indexRow(const unsigned char *red, const unsigned char *green, const unsigned char *blue, const unsigned char *alpha, long step,
+                  long width, unsigned char *out) const {
+        int bits = bitDepth(), perByte = 8 / bits, last = -1;
+        uint32_t lastColor = 0;
+        std::memset(out, 0, (width * bits + 7) / 8);
+        for (long x = 0; x < width; x++) {
+            uint32_t color = pack(red[x * step], green[x * step], blue[x * step], alpha ? alpha[x * step] : 255);
+            // Posterized rows are mostly runs, so the previous pixel's colour is the usual hit.
+            if (color != lastColor || last < 0) {
+                lastColor = color;
+                if ((last = find(color)) < 0) {
+                    return false;
+                }
+            }
+            out[x / perByte] |= last << (8 - bits - (x % perByte) * bits);
+        }
+        return true;
+    }
+};
+
+// Writes an 8- or 16-bit greyscale, grey and alpha, RGB or RGBA PNG, or an indexed one, deflating on several threads the way pigz does. Rows
+// come in through writeRows in PNG sample order (16-bit samples big-endian, indices packed). They are filtered in batches that are cut into
+// blocks, and the blocks are deflated independently, each primed with the 32 KB of filtered data before it so the ratio barely suffers. Every
+// block ends on a sync flush, so the raw deflate streams concatenate into one zlib stream whose Adler-32 is combined from the blocks'. Each
+// block becomes one IDAT chunk; the result is a standard PNG.
+//
+// Filtered images are posterized: flat runs, often whole repeated rows. A row equal to the one above is sent as Up, which is all zeros;
+// other indexed rows go unfiltered, as indices do not predict well; the rest use libpng's minimum-sum heuristic. At levels 1 to 3, blocks
+// that are mostly runs are deflated with Z_RLE, which on such data is both faster and smaller than zlib's fast levels.
+class ParallelPngWriter {
+private:
+    static const size_t blockBytes = 256 << 10;
+    static const size_t window = 32 << 10;
+    std::FILE *file = nullptr;
+    int level;
+    int threads;
+    // Where the PNG goes instead of a file, if anywhere, and the open_memstream buffer that collects it until finish().
+    std::vector<unsigned char> *target;
+    char *memoryBuffer = nullptr;
+    size_t memorySize = 0;
+    long width = 0;
+    long height = 0;
+    long rowsWritten = 0;
+    size_t rowBytes = 0;
+    int pixelBytes = 0;
+    bool indexed = false;
+    bool failed = false;
+    // Unfiltered last row of the previous batch (zeros before the first row, as PNG filters assume), and the last window of filtered data,
+    // which primes the next batch's first block.
+    std::vector<unsigned char> previousRow;
+    std::vector<unsigned char> dictionary;
+    uLong adler = 1;
+    // The zlib header still has to go in front of the first IDAT.
+    bool headerPending = true;
+
+    void writeChunk(const char *type, const unsigned char *data, size_t length) {
+        unsigned char field[4] = {(unsigned char)(length >> 24), (unsigned char)(length >> 16), (unsigned char)(length >> 8),
+                                  (unsigned char)length};
+        uLong crc = crc32(crc32(0, nullptr, 0), reinterpret_cast<const Bytef *>(type), 4);
+        crc = length ? crc32(crc, data, length) : crc;
+        unsigned char check[4] = {(unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8), (unsigned char)crc};
+        failed = failed || std::fwrite(field, 1, 4, file) != 4 || std::fwrite(type, 1, 4, file) != 4 ||
+                 (length && std::fwrite(data, 1, length, file) != length) || std::fwrite(check, 1, 4, file) != 4;
+    }
+    // Writes row filtered with the given PNG filter type to out and returns libpng's cost for it: the sum of the residuals as signed bytes.
+    // The first pixel has no left neighbour, so its predictions use zero there.
+    unsigned long filterResiduals(int type, const unsigned char *row, const unsigned char *prior, unsigned char *out) const {
+        size_t n = rowBytes, bpp = std::min(rowBytes, (size_t)pixelBytes);
+        for (size_t i = 0; i < bpp; i++) {
+            const int predicted[5] = {0, 0, prior[i], prior[i] >> 1, prior[i]};
+            out[i] = row[i] - predicted[type];
+        }
+        switch (type) {
+        case 0:
+            std::memcpy(out + bpp, row + bpp, n - bpp);
+            break;
+        case 1:
+            for (size_t i = bpp; i < n; i++) {
+                out[i] = row[i] - row[i - bpp];
+            }
+            break;
+        case 2:
+            for (size_t i = bpp; i < n; i++) {
+                out[i] = row[i] - prior[i];
+            }
+            break;
+        case 3:
+            for (size_t i = bpp; i < n; i++) {
+                out[i] = row[i] - ((row[i - bpp] + prior[i]) >> 1);
+            }
+            break;
+        default:
+            for (size_t i = bpp; i < n; i++) {
+                int left = row[i - bpp], up = prior[i], upLeft = prior[i - bpp];
+                int pa = std::abs(up - upLeft), pb = std::abs(left - upLeft), pc = std::abs(left + up - 2 * upLeft);
+                out[i] = row[i] - (pa <= pb && pa <= pc ? left : pb <= pc ? up : upLeft);
+            }
+        }
+        unsigned long sum = 0;
+        for (size_t i = 0; i < n; i++) {
+            sum += (unsigned char)std::abs((signed char)out[i]);
+        }
+        return sum;
+    }
+    // Filters one row as described above and writes the filter byte and the filtered row to out. candidate is scratch space of rowBytes.
+    void filterRow(const unsigned char *row, const unsigned char *prior, unsigned char *out, unsigned char *candidate) const {
+        if (!std::memcmp(row, prior, rowBytes)) {
+            out[0] = 2;
+            std::memset(out + 1, 0, rowBytes);
+            return;
+        }
+        if (indexed) {
+            out[0] = 0;
+            std::memcpy(out + 1, row, rowBytes);
+            return;
+        }
+        unsigned long best = ~0UL;
+        for (int type = 0; type < 5; type++) {
+            unsigned long sum = filterResiduals(type, row, prior, candidate);
+            if (sum < best) {
+                best = sum;
+                out[0] = type;
+                std::memcpy(out + 1, candidate, rowBytes);
+            }
+        }
+    }
+    // Z_RLE for mostly-run data at the fast levels, zlib's default strategy otherwise.
+    int strategyFor(const unsigned char *data, size_t length) const {
+        if (level < 1 || level > 3) {
+            return Z_DEFAULT_STRATEGY;
+        }
+        size_t repeats = 0;
+        for (size_t i = 1; i < length; i++) {
+            repeats += data[i] == data[i - 1];
+        }
+        return repeats * 4 >= length * 3 ? Z_RLE : Z_DEFAULT_STRATEGY;
+    }
+    // Deflates data as a run of raw deflate blocks ending on a sync flush, primed with the window before it.
+    bool deflateBlock(const unsigned char *primer, size_t primerLength, const unsigned char *data, size_t length,
+                      std::vector<unsigned char> &out) const {
+        z_stream stream;
+        std::memset(&stream, 0, sizeof(stream));
+        if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, strategyFor(data, length)) != Z_OK) {
+            return false;
+        }
+        if (primerLength && deflateSetDictionary(&stream, primer, primerLength) != Z_OK) {
+            deflateEnd(&stream);
+            return false;
+        }
+        out.resize(deflateBound(&stream, length) + 16);
+        stream.next_in = const_cast<Bytef *>(data);
+        stream.avail_in = length;
+        stream.next_out = out.data();
+        stream.avail_out = out.size();
+        int status = deflate(&stream, Z_SYNC_FLUSH);
+        out.resize(stream.total_out);
+        deflateEnd(&stream);
+        return status == Z_OK && stream.avail_in == 0;
+    }
+
+    // Opens the file and writes the signature and IHDR. pixelStep is the filter's byte distance between corresponding samples.
+    bool start(const std::string &path, long imageWidth, long imageHeight, int colorType, int bitDepth, int pixelStep, size_t bytesPerRow) {
+        if (imageWidth <= 0 || imageHeight <= 0 || imageWidth > 0x7FFFFFFF || imageHeight > 0x7FFFFFFF ||
+            !(file = target ? open_memstream(&memoryBuffer, &memorySize) : std::fopen(path.c_str(), "wb"))) {
+            return false;
+        }
+        width = imageWidth;
+        height = imageHeight;
+        pixelBytes = pixelStep;
+        rowBytes = bytesPerRow;
+        previousRow.assign(rowBytes, 0);
+        unsigned char header[13] = {(unsigned char)(width >> 24),  (unsigned char)(width >> 16),  (unsigned char)(width >> 8),
+                                    (unsigned char)width,          (unsigned char)(height >> 24), (unsigned char)(height >> 16),
+                                    (unsigned char)(height >> 8),  (unsigned char)height,         (unsigned char)bitDepth,
+                                    (unsigned char)colorType,      0,                             0,
+                                    0};
+        failed = std::fwrite("\x89PNG\r\n\x1a\n", 1, 8, file) != 8;
+        writeChunk("IHDR", header, sizeof(header));
+        return !failed;
+    }
+
+public:
+    // With a target, the PNG is written into it by finish() and open's path is ignored.
+    ParallelPngWriter(int compressionLevel = pngCompressionLevel, int workers = std::max(1u, std::thread::hardware_concurrency()),
+                      std::vector<unsigned char> *memory = nullptr)
+        : level(compressionLevel), threads(workers), target(memory) {}
+    ParallelPngWriter(const ParallelPngWriter &) = delete;
+    ParallelPngWriter &operator=(const ParallelPngWriter &) = delete;
+    ~ParallelPngWriter() {
+        if (file) {
+            std::fclose(file);
+        }
+        std::free(memoryBuffer);
+    }
+    // Writes the signature and header. channels is 1 to 4, bitDepth 8 or 16.
+    bool open(const std::string &path, long imageWidth, long imageHeight, int channels, int bitDepth) {
+        const unsigned char colorTypes[] = {0, 4, 2, 6};
+        if (channels < 1 || channels > 4 || (bitDepth != 8 && bitDepth != 16)) {
+            return false;
+        }
+        int pixelStep = channels * bitDepth / 8;
+        return start(path, imageWidth, imageHeight, colorTypes[channels - 1], bitDepth, pixelStep, imageWidth * pixelStep);
+    }
+    // Writes the signature, header and palette of an indexed PNG, at table.bitDepth() bits per pixel. With alpha, a tRNS chunk is written
+    // even if every colour is opaque, so that decoders which expand palettes hand back an alpha channel like the source's.
+    bool openIndexed(const std::string &path, long imageWidth, long imageHeight, const PngColorTable &table, bool alpha) {
+        int bits = table.bitDepth();
+        if (!table.size() || !start(path, imageWidth, imageHeight, 3, bits, 1, (imageWidth * bits + 7) / 8)) {
+            return false;
+        }
+        indexed = true;
+        std::vector<unsigned char> colors, opacity;
+        for (size_t i = 0; i < table.size(); i++) {
+            uint32_t color = table.color(i);
+            colors.push_back(color & 255);
+            colors.push_back((color >> 8) & 255);
+            colors.push_back((color >> 16) & 255);
+            opacity.push_back(color >> 24);
+        }
+        // Trailing opaque entries can be left out of tRNS, but keep at least one.
+        while (opacity.size() > 1 && opacity.back() == 255) {
+            opacity.pop_back();
+        }
+        writeChunk("PLTE", colors.data(), colors.size());
+        if (alpha) {
+            writeChunk("tRNS", opacity.data(), opacity.size());
+        }
+        return !failed;
+    }
+    // Appends `count` rows. fill(y, row) must write row y, for y from the next row on; it is called from several threads at once.
+    bool writeRows(long count, const std::function<void(long, unsigned char *)> &fill) {
+        long blockRows = std::max(1L, (long)(blockBytes / rowBytes)), batchRows = blockRows * threads * 2;
+        std::vector<unsigned char> raw, filtered;
+        for (long done = 0; done < count && !failed; done += batchRows) {
+            long rows = std::min(batchRows, count - done), first = rowsWritten, blocks = (rows + blockRows - 1) / blockRows;
+            size_t stride = rowBytes + 1;
+            raw.resize(rows * rowBytes);
+            filtered.resize(rows * stride);
+            parallelFor(rows, threads, [&](long i) { fill(first + i, raw.data() + i * rowBytes); });
+            parallelFor(blocks, threads, [&](long b) {
+                std::vector<unsigned char> candidate(rowBytes);
+                for (long i = b * blockRows; i < std::min(rows, (b + 1) * blockRows); i++) {
+                    const unsigned char *prior = i ? raw.data() + (i - 1) * rowBytes : previousRow.data();
+                    filterRow(raw.data() + i * rowBytes, prior, filtered.data() + i * stride, candidate.data());
+                }
+            });
+            std::vector<std::vector<unsigned char>> compressed(blocks);
+            std::vector<uLong> checks(blocks);
+            std::vector<char> deflated(blocks, 0);
+            parallelFor(blocks, threads, [&](long b) {
+                size_t start = b * blockRows * stride, end = std::min(rows, (b + 1) * blockRows) * stride;
+                size_t primerLength = b ? std::min(window, start) : dictionary.size();
+                const unsigned char *primer = b ? filtered.data() + start - primerLength : dictionary.data();
+                checks[b] = adler32(adler32(0, nullptr, 0), filtered.data() + start, end - start);
+                deflated[b] = deflateBlock(primer, primerLength, filtered.data() + start, end - start, compressed[b]);
+            });
+            for (long b = 0; b < blocks && !failed; b++) {
+                size_t start = b * blockRows * stride, end = std::min(rows, (b + 1) * blockRows) * stride;
+                if (!deflated[b]) {
+                    failed = true;
+                    break;
+                }
+                if (headerPending) {
+                    // CMF 0x78 is deflate with a 32 KB window; FLG only has to make the pair a multiple of 31.
+                    const unsigned char zlibHeader[2] = {0x78, 0x9C};
+                    compressed[b].insert(compressed[b].begin(), zlibHeader, zlibHeader + 2);
+                    headerPending = false;
+                }
+                writeChunk("IDAT", compressed[b].data(), compressed[b].size());
+                adler = adler32_combine(adler, checks[b], end - start);
+            }
+            size_t keep = std::min(window, filtered.size());
+            if (keep < window) {
+                dictionary.insert(dictionary.end(), filtered.begin(), filtered.end());
+                dictionary.erase(dictionary.begin(), dictionary.end() - std::min(window, dictionary.size()));
+            } else {
+                dictionary.assign(filtered.end() - keep, filtered.end());
+            }
+            previousRow.assign(raw.end() - rowBytes, raw.end());
+            rowsWritten += rows;
+        }
+        return !failed;
+    }
+    // Ends the deflate stream with an empty final block, appends the checksum and IEND, and closes the file. Every row must be written.
+    bool finish(void) {
+        if (!file) {
+            return false;
+        }
+        unsigned char tail[8] = {0x78, 0x9C, 0x03, 0x00, (unsigned char)(adler >> 24), (unsigned char)(adler >> 16), (unsigned char)(adler >> 8),
+                                 (unsigned char)adler};
+        writeChunk("IDAT", headerPending ? tail : tail + 2, headerPending ? 8 : 6);
+        writeChunk("IEND", nullptr, 0);
+        bool closed = std::fclose(file) == 0;
+        file = nullptr;
+        if (target && closed) {
+            target->assign(memoryBuffer, memoryBuffer + memorySize);
+        }
+        return closed && !failed && rowsWritten == height;
+    }
+};
+
+const size_t ParallelPngWriter::blockBytes;
+const size_t ParallelPngWriter::window;
+
+// Saves an 8-bit or 16-bit image with one to four channels through ParallelPngWriter, at the depth of its samples as saveImageFile always
+// has, and 8-bit colour images with at most 256 colours (all filtered opaque images) as indexed PNGs. Other sample types are left to CImg.
+// With a target the PNG goes there instead of to the path.
+template <typename T>
+static bool saveParallelPng(const CImg<T> &, const std::string &, int = 0, std::vector<unsigned char> * = nullptr) {
+    return false;
+}
+
+// Collects the colours of an 8-bit RGB or RGBA image. Returns false as soon as there are more than 256.
+static bool collectColors(const CImg<unsigned char> &image, PngColorTable &table) {
+    long plane = (long)image.width() * image.height();
+    const unsigned char *red = image.data(), *green = red + plane, *blue = green + plane, *alpha = image.spectrum() == 4 ? blue + plane : nullptr;
+    uint32_t last = 0;
+    for (long i = 0; i < plane; i++) {
+        uint32_t color = PngColorTable::pack(red[i], green[i], blue[i], alpha ? alpha[i] : 255);
+        if ((color != last || !i) && table.add(color) < 0) {
+            return false;
+        }
+        last = color;
+    }
+    return true;
+}
+
+static bool writeIndexedPng(const CImg<unsigned char> &image, const PngColorTable &table, const std::string &path, int threads,
+                            std::vector<unsigned char> *target) {
+    long width = image.width(), plane = (long)image.width() * image.height();
+    bool alpha = image.spectrum() == 4;
+    ParallelPngWriter writer(pngCompressionLevel, threads, target);
+    if (!writer.openIndexed(path, width, image.height(), table, alpha)) {
+        return false;
+    }
+    bool written = writer.writeRows(image.height(), [&](long y, unsigned char *row) {
+        const unsigned char *red = image.data() + y * width;
+        table.indexRow(red, red + plane, red + 2 * plane, alpha ? red + 3 * plane : nullptr, 1, width, row);
+    });
+    return writer.finish() && written;
+}
+
+template <typename T>
+static bool writeParallelPng(const CImg<T> &image, const std::string &path, int threads = std::max(1u, std::thread::hardware_concurrency()),
+                             std::vector<unsigned char> *target = nullptr) {
+    long width = image.width(), plane = (long)image.width() * image.height();
+    int channels = image.spectrum();
+    ParallelPngWriter writer(pngCompressionLevel, threads, target);
+    if (image.depth() != 1 || channels > 4 || !writer.open(path, width, image.height(), channels, 8 * sizeof(T))) {
+        return false;
+    }
+    bool written = writer.writeRows(image.height(), [&](long y, unsigned char *row) {
+        for (int c = 0; c < channels; c++) {
+            const T *in = image.data() + y * width + c * plane;
+            for (long x = 0; x < width; x++) {
+                if (sizeof(T) == 2) {
+                    row[(x * channels + c) * 2] = in[x] >> 8;
+                    row[(x * channels + c) * 2 + 1] = in[x] & 255;
+                } else {
+                    row[x * channels + c] = in[x];
+                }
+            }
+        }
+    });
+    return writer.finish() && written;
+}
+
+static bool saveParallelPng(const CImg<unsigned char> &image, const std::string &path,
+                            int threads = std::max(1u, std::thread::hardware_concurrency()), std::vector<unsigned char> *target = nullptr) {
+    PngColorTable table;
+    if (image.depth() == 1 && (image.spectrum() == 3 || image.spectrum() == 4) && collectColors(image, table)) {
+        return writeIndexedPng(image, table, path, threads, target);
+    }
+    return writeParallelPng(image, path, threads, target);
+}
+
+static bool saveParallelPng(const CImg<unsigned short> &image, const std::string &path,
+                            int threads = std::max(1u, std::thread::hardware_concurrency()), std::vector<unsigned char> *target = nullptr) {
+    return writeParallelPng(image, path, threads, target);
+}
+
+// QOI ("Quite OK Image"), a lossless format that encodes and decodes in one cheap pass, for intermediate files between pipeline steps.
+// Pixels are coded as runs of the previous pixel, references into a 64-entry table of recently seen pixels hashed by value, small deltas
+// from the previous pixel, or literals. Filtered images are mostly runs, so they shrink far below their raw size.
+struct QoiPixel {
+    unsigned char r, g, b, a;
+    bool operator==(const QoiPixel &other) const { return r == other.r && g == other.g && b == other.b && a == other.a; }
+    int hash(void) const { return (r * 3 + g * 5 + b * 7 + a * 11) % 64; }
+};
+
+static const unsigned char qoiEndMarker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+// Writes a QOI file row by row, so the rows can be produced just before they are encoded. Output is buffered and written in large blocks.
+class QoiEncoder {
+private:
+    std::FILE *file = nullptr;
+    std::vector<unsigned char> buffer;
+    QoiPixel table[64];
+    QoiPixel previous;
+    int run = 0;
+    long remaining = 0;
+    bool failed = false;
+
+    void flush(void) {
+        failed = failed || std::fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size();
+        buffer.clear();
+    }
+    void encode(const QoiPixel &pixel) {
+        remaining--;
+        if (pixel == previous) {
+            if (++run == 62 || !remaining) {
+                buffer.push_back(0xC0 | (run - 1));
+                run = 0;
+            }
+            return;
+        }
+        if (run) {
+            buffer.push_back(0xC0 | (run - 1));
+            run = 0;
+        }
+        int slot = pixel.hash();
+        if (table[slot] == pixel) {
+            buffer.push_back(slot);
+        } else if (pixel.a != previous.a) {
+            table[slot] = pixel;
+            unsigned char literal[5] = {0xFF, pixel.r, pixel.g, pixel.b, pixel.a};
+            buffer.insert(buffer.end(), literal, literal + 5);
+        } else {
+            table[slot] = pixel;
+            signed char dr = pixel.r - previous.r, dg = pixel.g - previous.g, db = pixel.b - previous.b;
+            signed char drg = dr - dg, dbg = db - dg;
+            if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2) {
+                buffer.push_back(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+            } else if (drg > -9 && drg < 8 && dg > -33 && dg < 32 && dbg > -9 && dbg < 8) {
+                buffer.push_back(0x80 | (dg + 32));
+                buffer.push_back((drg + 8) << 4 | (dbg + 8));
+            } else {
+                unsigned char literal[4] = {0xFE, pixel.r, pixel.g, pixel.b};
+                buffer.insert(buffer.end(), literal, literal + 4);
+            }
+        }
+        previous = pixel;
+    }
+
+public:
+    QoiEncoder() {}
+    QoiEncoder(const QoiEncoder &) = delete;
+    QoiEncoder &operator=(const QoiEncoder &) = delete;
+    ~QoiEncoder() {
+        if (file) {
+            std::fclose(file);
+        }
+    }
+    // Writes the header. channels is 3 or 4; QOI has no greyscale.
+    bool open(const std::string &path, long width, long height, int channels) {
+        if (width <= 0 || height <= 0 || width > 0xFFFFFFFFL || height > 0xFFFFFFFFL || (channels != 3 && channels != 4) ||
+            !(file = std::fopen(path.c_str(), "wb"))) {
+            return false;
+        }
+        unsigned char header[14] = {'q', 'o', 'i', 'f'};
+        for (int i = 0; i < 4; i++) {
+            header[4 + i] = width >> (24 - 8 * i);
+            header[8 + i] = height >> (24 - 8 * i);
+        }
+        header[12] = channels;
+        // Colour space 0: sRGB colour with linear alpha.
+        header[13] = 0;
+        buffer.assign(header, header + 14);
+        std::memset(table, 0, sizeof(table));
+        previous = {0, 0, 0, 255};
+        remaining = width * height;
+        return true;
+    }
+    // Encodes the next `count` pixels, given as one pointer per channel. alpha may be null for opaque pixels.
+    void encodeRow(const unsigned char *red, const unsigned char *green, const unsigned char *blue, const unsigned char *alpha, long count) {
+        for (long x = 0; x < count; x++) {
+            QoiPixel pixel = {red[x], green[x], blue[x], alpha ? alpha[x] : (unsigned char)255};
+            encode(pixel);
+        }
+        if (buffer.size() >= (1 << 20)) {
+            flush();
+        }
+    }
+    // Writes the end marker and closes the file. Every pixel must have been encoded.
+    bool finish(void) {
+        buffer.insert(buffer.end(), qoiEndMarker, qoiEndMarker + 8);
+        flush();
+        bool closed = std::fclose(file) == 0;
+        file = nullptr;
+        return closed && !failed && !remaining;
+    }
+};
+
+// Scales a 16-bit or float image to 8-bit samples, rounding, for outputs that only hold 8 bits.
+template <typename T>
+static CImg<unsigned char> narrowToBytes(const CImg<T> &image) {
+    double scale = sizeof(T) == 2 ? 255.0 / 65535 : 255.0;
+    CImg<unsigned char> narrowed(image.width(), image.height(), image.depth(), image.spectrum());
+    cimg_foroff(image, i) { narrowed[i] = std::max(0.0, std::min(255.0, image[i] * scale + 0.5)); }
+    return narrowed;
+}
+
+// Encodes an 8-bit image with one to four channels to a QOI file. QOI only holds RGB and RGBA, so greyscale is written as RGB and grey and
+// alpha as RGBA, by handing the encoder the grey plane for all three colours. beforeRow(y), if given, runs just before row y is encoded; the
+// filter remaps the row there, so the encoder reads it while it is still in cache instead of making a second pass over the image. Returns
+// false for other channel counts.
+static bool saveQoi(const CImg<unsigned char> &image, const std::string &path, const std::function<void(long)> &beforeRow = nullptr) {
+    long width = image.width(), plane = (long)image.width() * image.height();
+    int channels = image.spectrum(), colors = channels < 3 ? 1 : 3;
+    bool alpha = channels == 2 || channels == 4;
+    QoiEncoder encoder;
+    if (image.depth() != 1 || channels < 1 || channels > 4 || !encoder.open(path, width, image.height(), alpha ? 4 : 3)) {
+        return false;
+    }
+    for (long y = 0; y < image.height(); y++) {
+        if (beforeRow) {
+            beforeRow(y);
+        }
+        const unsigned char *red = image.data() + y * width, *green = colors == 3 ? red + plane : red, *blue = colors == 3 ? red + 2 * plane : red;
+        encoder.encodeRow(red, green, blue, alpha ? red + colors * plane : nullptr, width);
+    }
+    return encoder.finish();
+}
+
+// QOI samples are 8 bits, so 16-bit and float images are narrowed to 8 bits, after every row has been through beforeRow.
+template <typename T>
+static bool saveQoi(const CImg<T> &image, const std::string &path, const std::function<void(long)> &beforeRow = nullptr) {
+    for (long y = 0; beforeRow && y < image.height(); y++) {
+        beforeRow(y);
+    }
+    return saveQoi(narrowToBytes(image), path);
+}
+
+// Decodes a QOI file into an image already sized for it, one plane per channel as CImg stores it. Returns false for a damaged file.
+template <typename T>
+static bool loadQoi(const std::string &, CImg<T> &) {
+    return false;
+}
+
+static bool loadQoi(const std::string &uri, CImg<unsigned char> &image) {
+    std::ifstream in(uri.c_str(), std::ios::binary | std::ios::ate);
+    std::streamoff size = in ? (std::streamoff)in.tellg() : 0;
+    std::vector<unsigned char> file(std::max<std::streamoff>(size, 0));
+    in.seekg(0);
+    if (size < 22 || !in.read(reinterpret_cast<char *>(file.data()), size) || std::memcmp(file.data(), "qoif", 4)) {
+        return false;
+    }
+    long width = (long)file[4] << 24 | file[5] << 16 | file[6] << 8 | file[7];
+    long height = (long)file[8] << 24 | file[9] << 16 | file[10] << 8 | file[11];
+    int channels = file[12];
+    if (image.width() != width || image.height() != height || image.depth() != 1 || image.spectrum() != channels) {
+        return false;
+    }
+    long plane = width * height;
+    unsigned char *red = image.data(), *green = red + plane, *blue = green + plane, *alpha = channels == 4 ? blue + plane : nullptr;
+    QoiPixel table[64], pixel = {0, 0, 0, 255};
+    std::memset(table, 0, sizeof(table));
+    size_t p = 14, end = file.size() - 8;
+    int run = 0;
+    for (long i = 0; i < plane; i++) {
+        if (run) {
+            run--;
+        } else if (p < end) {
+            int op = file[p++];
+            if (op == 0xFE || op == 0xFF) {
+                if (p + 3 + (op == 0xFF) > end) {
+                    return false;
+                }
+                pixel.r = file[p++];
+                pixel.g = file[p++];
+                pixel.b = file[p++];
+                pixel.a = op == 0xFF ? file[p++] : pixel.a;
+            } else if ((op & 0xC0) == 0x00) {
+                pixel = table[op];
+            } else if ((op & 0xC0) == 0x40) {
+                pixel.r += ((op >> 4) & 3) - 2;
+                pixel.g += ((op >> 2) & 3) - 2;
+                pixel.b += (op & 3) - 2;
+            } else if ((op & 0xC0) == 0x80) {
+                int dg = (op & 0x3F) - 32, next = p < end ? file[p++] : 0;
+                pixel.r += dg - 8 + (next >> 4);
+                pixel.g += dg;
+                pixel.b += dg - 8 + (next & 15);
+            } else {
+                run = op & 0x3F;
+            }
+            table[pixel.hash()] = pixel;
+        } else {
+            return false;
+        }
+        red[i] = pixel.r;
+        green[i] = pixel.g;
+        blue[i] = pixel.b;
+        if (alpha) {
+            alpha[i] = pixel.a;
+        }
+    }
+    return true;
+}
+
+// Effort for WebP output, from --webp-method, on cwebp's -m scale: 0 is fastest and 6 smallest. It sets how far around each pixel the LZ77
+// search looks and how many searches are tried.
+static int webpMethod = 4;
+
+// Accumulates bits least significant first, the order VP8L reads them in.
+class WebpBitWriter {
+private:
+    std::vector<unsigned char> bytes;
+    uint64_t pending = 0;
+    int used = 0;
+
+public:
+    void put(uint32_t value, int count) {
+        pending |= (uint64_t)value << used;
+        for (used += count; used >= 8; used -= 8) {
+            bytes.push_back(pending & 255);
+            pending >>= 8;
+        }
+    }
+    // Pads the last byte with zeros and returns the stream.
+    const std::vector<unsigned char> &finish(void) {
+        if (used) {
+            bytes.push_back(pending & 255);
+            pending = 0;
+            used = 0;
+        }
+        return bytes;
+    }
+};
+
+// A canonical prefix (Huffman) code over one VP8L alphabet, built from symbol counts with no code longer than maxLength bits. A code with a
+// single symbol is sent in its header and then costs no bits at all per symbol.
+class WebpPrefixCode {
+private:
+    std::vector<unsigned char> lengths;
+    // Codes bit-reversed, ready for WebpBitWriter.
+    std::vector<uint16_t> codes;
+    // Used symbols in ascending order; only the first two are kept, which is all the short header form needs.
+    int symbols[2] = {0, 0};
+    int used = 0;
+
+public:
+    void build(const std::vector<uint32_t> &counts, int maxLength) {
+        lengths.assign(counts.size(), 0);
+        codes.assign(counts.size(), 0);
+        std::vector<int> leaves;
+        for (size_t s = 0; s < counts.size(); s++) {
+            if (counts[s]) {
+                if (leaves.size() < 2) {
+                    symbols[leaves.size()] = s;
+                }
+                leaves.push_back(s);
+            }
+        }
+        used = leaves.size();
+        if (used == 1) {
+            lengths[leaves[0]] = 1;
+        }
+        if (used < 2) {
+            return;
+        }
+        // Huffman's construction with two queues over the leaves sorted by weight. Rare symbols are raised to a floor that doubles until the
+        // deepest leaf fits in maxLength, as libwebp does.
+        for (uint32_t floor = 1;; floor *= 2) {
+            std::vector<uint64_t> weight(2 * used - 1);
+            std::vector<int> parent(2 * used - 1, -1), order(leaves.size());
+            for (int i = 0; i < used; i++) {
+                order[i] = i;
+                weight[i] = std::max(counts[leaves[i]], floor);
+            }
+            std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return weight[a] < weight[b]; });
+            size_t leaf = 0, merged = used, next = used;
+            auto smallest = [&](void) {
+                if (leaf < order.size() && (merged == next || weight[order[leaf]] <= weight[merged])) {
+                    return order[leaf++];
+                }
+                return (int)merged++;
+            };
+            while (next < weight.size()) {
+                int a = smallest(), b = smallest();
+                weight[next] = weight[a] + weight[b];
+                parent[a] = parent[b] = next++;
+            }
+            int deepest = 0;
+            for (int i = 0; i < used; i++) {
+                int depth = 0;
+                for (int node = i; parent[node] >= 0; node = parent[node]) {
+                    depth++;
+                }
+                lengths[leaves[i]] = depth;
+                deepest = std::max(deepest, depth);
+            }
+            if (deepest <= maxLength) {
+                break;
+            }
+        }
+        // Canonical assignment as in Deflate: shorter codes first, ties in symbol order.
+        int counted[16] = {0}, nextCode[16] = {0};
+        for (unsigned char length : lengths) {
+            counted[length]++;
+        }
+        counted[0] = 0;
+        for (int length = 1, code = 0; length < 16; length++) {
+            code = (code + counted[length - 1]) << 1;
+            nextCode[length] = code;
+        }
+        for (size_t s = 0; s < lengths.size(); s++) {
+            if (lengths[s]) {
+                int code = nextCode[lengths[s]]++, reversed = 0;
+                for (int bit = 0; bit < lengths[s]; bit++) {
+                    reversed |= ((code >> bit) & 1) << (lengths[s] - 1 - bit);
+                }
+                codes[s] = reversed;
+            }
+        }
+    }
+    void put(WebpBitWriter &out, int symbol) const {
+        if (used > 1) {
+            out.put(codes[symbol], lengths[symbol]);
+        }
+    }
+    // Writes the code's header: the short form for one or two symbols below 256, otherwise the code lengths, themselves run-length coded
+    // with a second prefix code.
+    void write(WebpBitWriter &out) const {
+        if (used <= 2 && symbols[used > 1] < 256) {
+            out.put(1, 1);
+            out.put(used == 2, 1);
+            out.put(symbols[0] >= 2, 1);
+            out.put(symbols[0], symbols[0] >= 2 ? 8 : 1);
+            if (used == 2) {
+                out.put(symbols[1], 8);
+            }
+            return;
+        }
+        // Runs of zeros go out as 17 (3 to 10) or 18 (11 to 138), repeats of the previous non-zero length as 16 (3 to 6).
+        std::vector<std::pair<int, int>> tokens;
+        int previous = 8;
+        for (size_t i = 0; i < lengths.size();) {
+            int length = lengths[i];
+            size_t run = 1;
+            while (i + run < lengths.size() && lengths[i + run] == length) {
+                run++;
+            }
+            i += run;
+            if (length && length != previous) {
+                tokens.push_back(std::make_pair(length, 0));
+                previous = length;
+                run--;
+            }
+            while (run) {
+                if (run < 3) {
+                    tokens.push_back(std::make_pair(length, 0));
+                    run--;
+                } else if (length) {
+                    size_t repeat = std::min<size_t>(run, 6);
+                    tokens.push_back(std::make_pair(16, repeat - 3));
+                    run -= repeat;
+                } else {
+                    size_t repeat = std::min<size_t>(run, 138);
+                    tokens.push_back(repeat < 11 ? std::make_pair(17, (int)repeat - 3) : std::make_pair(18, (int)repeat - 11));
+                    run -= repeat;
+                }
+            }
+        }
+        std::vector<uint32_t> counts(19, 0);
+        for (const std::pair<int, int> &token : tokens) {
+            counts[token.first]++;
+        }
+        WebpPrefixCode lengthCode;
+        lengthCode.build(counts, 7);
+        const int order[19] = {17, 18, 0, 1, 2, 3, 4, 5, 16, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+        int sent = 19;
+        while (sent > 4 && !lengthCode.lengths[order[sent - 1]]) {
+            sent--;
+        }
+        out.put(0, 1);
+        out.put(sent - 4, 4);
+        for (int i = 0; i < sent; i++) {
+            out.put(lengthCode.lengths[order[i]], 3);
+        }
+        // Every length is sent, up to the end of the alphabet.
+        out.put(0, 1);
+        const int extraBits[3] = {2, 3, 7};
+        for (const std::pair<int, int> &token : tokens) {
+            lengthCode.put(out, token.first);
+            if (token.first >= 16) {
+                out.put(token.second, extraBits[token.first - 16]);
+            }
+        }
+    }
+};
+
+// Splits an LZ77 length or distance code (from 1) into its prefix symbol and the extra bits that follow it.
+static void webpPrefix(uint32_t value, int &symbol, int &extraBits, uint32_t &extra) {
+    uint32_t offset = value - 1;
+    if (offset < 4) {
+        symbol = offset;
+        extraBits = 0;
+        extra = 0;
+        return;
+    }
+    int high = 0;
+    while (offset >> (high + 1)) {
+        high++;
+    }
+    extraBits = high - 1;
+    symbol = 2 * high + ((offset >> extraBits) & 1);
+    extra = offset & ((1u << extraBits) - 1);
+}
+
+// VP8L's short distance codes: code n + 1 is the pixel xi to the left of and yi rows above the current one.
+static const signed char webpNeighbours[120][2] = {
+    {0, 1},  {1, 0},  {1, 1},  {-1, 1}, {0, 2},  {2, 0},  {1, 2},  {-1, 2}, {2, 1},  {-2, 1}, {2, 2},  {-2, 2}, {0, 3},  {3, 0},
+    {1, 3},  {-1, 3}, {3, 1},  {-3, 1}, {2, 3},  {-2, 3}, {3, 2},  {-3, 2}, {0, 4},  {4, 0},  {1, 4},  {-1, 4}, {4, 1},  {-4, 1},
+    {3, 3},  {-3, 3}, {2, 4},  {-2, 4}, {4, 2},  {-4, 2}, {0, 5},  {3, 4},  {-3, 4}, {4, 3},  {-4, 3}, {5, 0},  {1, 5},  {-1, 5},
+    {5, 1},  {-5, 1}, {2, 5},  {-2, 5}, {5, 2},  {-5, 2}, {4, 4},  {-4, 4}, {3, 5},  {-3, 5}, {5, 3},  {-5, 3}, {0, 6},  {6, 0},
+    {1, 6},  {-1, 6}, {6, 1},  {-6, 1}, {2, 6},  {-2, 6}, {6, 2},  {-6, 2}, {4, 5},  {-4, 5}, {5, 4},  {-5, 4}, {3, 6},  {-3, 6},
+    {6, 3},  {-6, 3}, {0, 7},  {7, 0},  {1, 7},  {-1, 7}, {5, 5},  {-5, 5}, {7, 1},  {-7, 1}, {4, 6},  {-4, 6}, {6, 4},  {-6, 4},
+    {2, 7},  {-2, 7}, {7, 2},  {-7, 2}, {3, 7},  {-3, 7}, {7, 3},  {-7, 3}, {5, 6},  {-5, 6}, {6, 5},  {-6, 5}, {8, 0},  {4, 7},
+    {-4, 7}, {7, 4},  {-7, 4}, {8, 1},  {8, 2},  {6, 6},  {-6, 6}, {8, 3},  {5, 7},  {-5, 7}, {7, 5},  {-7, 5}, {8, 4},  {6, 7},
+    {-6, 7}, {7, 6},  {-7, 6}, {8, 5},  {7, 7},  {-7, 7}, {8, 6},  {8, 7}};
+
+// Writes lossless WebP (VP8L) files. Filtered images have at most 21 colours (a few more with translucent alpha), so they are sent through
+// VP8L's colour-indexing transform: a palette, then each pixel's index, packed several to a byte when the palette is small enough. Images with
+// more than 256 colours go out as ARGB with the subtract-green transform. The pixels are then LZ77-coded, which on posterized images is mostly
+// copies from nearby pixels in this row and the few above, and entropy-coded with one set of prefix codes for the whole image. There is no predictor
+// or colour-cache stage: they earn little on images this flat.
+class WebpLosslessEncoder {
+private:
+    // One LZ77 token: a literal ARGB pixel when length is 0, otherwise a copy of `length` pixels, with `value` the VP8L distance code.
+    struct Token {
+        uint32_t value;
+        uint32_t length;
+    };
+    static const uint32_t maxLength = 4096;
+    int method;
+
+    // Rough cost in bits of sending a distance code.
+    static int distanceBits(uint32_t code) {
+        int bits = 0;
+        while (code >>= 1) {
+            bits++;
+        }
+        return bits;
+    }
+
+    // Finds the best match at i among the first `reach` of VP8L's short-coded neighbours, nearest first: the pixel above, the previous
+    // pixel, then the diagonals and further out, up to 8 pixels across and 7 rows up. Posterized images are flat regions whose edges shift
+    // a little from row to row, so nearly all their repeats are found here; a general match search finds little more, and its long
+    // distances cost more bits than they save. Farther codes cost a few extra bits, so matches are scored on length and code together.
+    class Matcher {
+    private:
+        const std::vector<uint32_t> &pixels;
+        // Distances of the neighbours searched, and the short code of each.
+        std::vector<long> distances;
+        std::vector<uint32_t> codes;
+
+        uint32_t length(long i, long distance) const {
+            uint32_t limit = std::min<long>(maxLength, pixels.size() - i), length = 0;
+            while (length < limit && pixels[i + length] == pixels[i + length - distance]) {
+                length++;
+            }
+            return length;
+        }
+
+    public:
+        Matcher(const std::vector<uint32_t> &p, long width, int reach) : pixels(p) {
+            for (int n = 0; n < reach; n++) {
+                long distance = std::max(1L, webpNeighbours[n][0] + webpNeighbours[n][1] * width);
+                if (std::find(distances.begin(), distances.end(), distance) == distances.end()) {
+                    distances.push_back(distance);
+                    codes.push_back(n + 1);
+                }
+            }
+        }
+        // Returns the match length (0 if none is worth a copy) and its distance code.
+        uint32_t find(long i, uint32_t &code) const {
+            uint32_t best = 0;
+            long bestScore = 0;
+            auto consider = [&](uint32_t found, uint32_t candidateCode) {
+                long score = 4L * found - distanceBits(candidateCode);
+                if (found >= 3 && score > bestScore) {
+                    best = found;
+                    bestScore = score;
+                    code = candidateCode;
+                }
+            };
+            for (size_t n = 0; n < distances.size() && best < maxLength; n++) {
+                if (distances[n] <= i) {
+                    consider(length(i, distances[n]), codes[n]);
+                }
+            }
+            return best;
+        }
+    };
+
+    // LZ77 over the coded pixels. With lazy matching, a match is put off by one pixel when the next pixel starts a longer one.
+    static std::vector<Token> tokenize(const std::vector<uint32_t> &pixels, long width, int reach, bool lazy) {
+        std::vector<Token> tokens;
+        Matcher matcher(pixels, width, reach);
+        long count = pixels.size();
+        uint32_t code = 0, nextCode = 0;
+        for (long i = 0; i < count;) {
+            uint32_t length = matcher.find(i, code);
+            if (length && lazy && length < maxLength && i + 1 < count && matcher.find(i + 1, nextCode) > length + 1) {
+                length = 0;
+            }
+            if (length) {
+                Token copy = {code, length};
+                tokens.push_back(copy);
+                i += length;
+            } else {
+                Token literal = {pixels[i++], 0};
+                tokens.push_back(literal);
+            }
+        }
+        return tokens;
+    }
+
+    // Writes an entropy-coded image: no colour cache, no meta prefix codes (which only the top level may have), the five prefix codes, then
+    // the tokens.
+    static void writeImage(WebpBitWriter &out, const std::vector<Token> &tokens, bool topLevel) {
+        std::vector<uint32_t> green(256 + 24, 0), red(256, 0), blue(256, 0), alpha(256, 0), distance(40, 0);
+        int symbol, extraBits;
+        uint32_t extra;
+        for (const Token &token : tokens) {
+            if (token.length) {
+                webpPrefix(token.length, symbol, extraBits, extra);
+                green[256 + symbol]++;
+                webpPrefix(token.value, symbol, extraBits, extra);
+                distance[symbol]++;
+            } else {
+                green[(token.value >> 8) & 255]++;
+                red[(token.value >> 16) & 255]++;
+                blue[token.value & 255]++;
+                alpha[token.value >> 24]++;
+            }
+        }
+        WebpPrefixCode codes[5];
+        const std::vector<uint32_t> *counts[5] = {&green, &red, &blue, &alpha, &distance};
+        out.put(0, 1);
+        if (topLevel) {
+            out.put(0, 1);
+        }
+        for (int i = 0; i < 5; i++) {
+            codes[i].build(*counts[i], 15);
+            codes[i].write(out);
+        }
+        for (const Token &token : tokens) {
+            if (token.length) {
+                webpPrefix(token.length, symbol, extraBits, extra);
+                codes[0].put(out, 256 + symbol);
+                out.put(extra, extraBits);
+                webpPrefix(token.value, symbol, extraBits, extra);
+                codes[4].put(out, symbol);
+                out.put(extra, extraBits);
+            } else {
+                codes[0].put(out, (token.value >> 8) & 255);
+                codes[1].put(out, (token.value >> 16) & 255);
+                codes[2].put(out, token.value & 255);
+                codes[3].put(out, token.value >> 24);
+            }
+        }
+    }
+
+public:
+    explicit WebpLosslessEncoder(int effort = webpMethod) : method(std::max(0, std::min(6, effort))) {}
+    // Encodes an 8-bit greyscale, grey and alpha, RGB or RGBA image. Returns false for anything else, for images larger than VP8L's 16384
+    // pixels a side, and if the file cannot be written.
+    bool save(const CImg<unsigned char> &image, const std::string &path) const {
+        long width = image.width(), height = image.height(), plane = width * height;
+        int channels = image.spectrum();
+        if (image.depth() != 1 || channels < 1 || channels > 4 || width < 1 || height < 1 || width > 16384 || height > 16384) {
+            return false;
+        }
+        const unsigned char *red = image.data(), *green = channels >= 3 ? red + plane : red, *blue = channels >= 3 ? red + 2 * plane : red;
+        const unsigned char *alpha = channels == 2 ? red + plane : channels == 4 ? red + 3 * plane : nullptr;
+        std::vector<uint32_t> pixels(plane);
+        bool translucent = false;
+        for (long i = 0; i < plane; i++) {
+            uint32_t a = alpha ? alpha[i] : 255;
+            translucent |= a != 255;
+            pixels[i] = a << 24 | (uint32_t)red[i] << 16 | (uint32_t)green[i] << 8 | blue[i];
+        }
+
+        WebpBitWriter out;
+        out.put(0x2F, 8);
+        out.put(width - 1, 14);
+        out.put(height - 1, 14);
+        out.put(translucent, 1);
+        out.put(0, 3);
+        PngColorTable table;
+        bool indexed = true;
+        for (long i = 0; i < plane && indexed; i++) {
+            indexed = (i && pixels[i] == pixels[i - 1]) || table.add(pixels[i]) >= 0;
+        }
+        long codedWidth = width;
+        if (indexed) {
+            // Colour-indexing transform: the palette as a one-row image, each entry sent as its difference from the one before.
+            int bundling = table.size() <= 2 ? 3 : table.size() <= 4 ? 2 : table.size() <= 16 ? 1 : 0, bits = 8 >> bundling;
+            std::vector<Token> entries(table.size());
+            for (size_t i = 0; i < table.size(); i++) {
+                uint32_t color = table.color(i), before = i ? table.color(i - 1) : 0, delta = 0;
+                for (int shift = 0; shift < 32; shift += 8) {
+                    delta |= (((color >> shift) - (before >> shift)) & 255) << shift;
+                }
+                entries[i].value = delta;
+                entries[i].length = 0;
+            }
+            out.put(1, 1);
+            out.put(3, 2);
+            out.put(table.size() - 1, 8);
+            writeImage(out, entries, false);
+            // Indices go in the green channel, 8 >> bundling bits each, the leftmost pixel in the lowest bits.
+            codedWidth = (width + (1 << bundling) - 1) >> bundling;
+            std::vector<uint32_t> packed(codedWidth * height, 0xFF000000u);
+            uint32_t lastColor = 0;
+            int last = -1;
+            for (long y = 0; y < height; y++) {
+                for (long x = 0; x < width; x++) {
+                    uint32_t color = pixels[y * width + x];
+                    if (last < 0 || color != lastColor) {
+                        lastColor = color;
+                        last = table.find(color);
+                    }
+                    packed[y * codedWidth + (x >> bundling)] |= (uint32_t)last << (8 + bits * (x & ((1 << bundling) - 1)));
+                }
+            }
+            pixels.swap(packed);
+        } else {
+            // Subtract-green transform: red and blue are sent as their difference from green, which is smaller where channels move together.
+            out.put(1, 1);
+            out.put(2, 2);
+            for (uint32_t &pixel : pixels) {
+                uint32_t g = (pixel >> 8) & 255;
+                pixel = (pixel & 0xFF00FF00u) | ((((pixel >> 16) - g) & 255) << 16) | (((pixel & 255) - g) & 255);
+            }
+        }
+        out.put(0, 1);
+        // Higher methods search further and try more variants, keeping whichever codes smallest.
+        const int reach[4] = {2, 4, 12, 120};
+        const bool lazy[4] = {false, true, true, true};
+        std::vector<Token> best;
+        size_t bestBytes = 0;
+        for (int variant = method ? 1 : 0; variant <= (method + 1) / 2; variant++) {
+            std::vector<Token> tokens = tokenize(pixels, codedWidth, reach[variant], lazy[variant]);
+            WebpBitWriter trial;
+            writeImage(trial, tokens, true);
+            size_t bytes = trial.finish().size();
+            if (best.empty() || bytes < bestBytes) {
+                best.swap(tokens);
+                bestBytes = bytes;
+            }
+        }
+        writeImage(out, best, true);
+
+        const std::vector<unsigned char> &data = out.finish();
+        uint32_t chunkSize = data.size(), riffSize = 4 + 8 + chunkSize + (chunkSize & 1);
+        unsigned char header[20] = {'R', 'I', 'F', 'F', 0, 0, 0, 0, 'W', 'E', 'B', 'P', 'V', 'P', '8', 'L', 0, 0, 0, 0};
+        for (int i = 0; i < 4; i++) {
+            header[4 + i] = riffSize >> (8 * i);
+            header[16 + i] = chunkSize >> (8 * i);
+        }
+        std::FILE *file = std::fopen(path.c_str(), "wb");
+        if (!file) {
+            return false;
+        }
+        bool written = std::fwrite(header, 1, 20, file) == 20 && std::fwrite(data.data(), 1, data.size(), file) == data.size();
+        written = written && (!(chunkSize & 1) || std::fputc(0, file) != EOF);
+        return std::fclose(file) == 0 && written;
+    }
+};
+
+// Saves an image as lossless WebP. WebP samples are 8 bits, so 16-bit and float images are narrowed to 8 bits first.
+template <typename T>
+static bool saveWebp(const CImg<T> &image, const std::string &path) {
+    return WebpLosslessEncoder().save(narrowToBytes(image), path);
+}
+
+static bool saveWebp(const CImg<unsigned char> &image, const std::string &path) { return WebpLosslessEncoder().save(image, path); }
+
+// Encodes a rendered tile as PNG in memory, on one thread since tiles are small. 8-bit and 16-bit tiles keep their depth, as saveImageFile
+// does; float tiles are narrowed to 8 bits.
+template <typename T>
+static bool encodeTilePng(const CImg<T> &tile, std::vector<unsigned char> &png) {
+    return saveParallelPng(narrowToBytes(tile), "", 1, &png);
+}
+
+static bool encodeTilePng(const CImg<unsigned char> &tile, std::vector<unsigned char> &png) { return saveParallelPng(tile, "", 1, &png); }
+
+static bool encodeTilePng(const CImg<unsigned short> &tile, std::vector<unsigned char> &png) { return saveParallelPng(tile, "", 1, &png); }
+
+// IFP, the native archival format for filtered images. A filtered image is fully described by its palette and each pixel's class, so that is
+// all IFP stores, with the class indices cut into tiles that are compressed independently. A viewer decodes any region from the tiles it
+// overlaps and never touches the rest of the file. Layout, all integers little-endian:
+//   "IFP1", bytes per sample (1, 2, or 4 for float), channels (1 to 4), two zero bytes
+//   width, height, tile width, tile height, as u32
+//   the 21 palette colours in class order, red, green and blue each, as samples of the stated size (floats by their bits)
+//   a u64 file offset for every tile, in raster order of the tile grid, then one for the end of the last tile
+//   the tiles, each a zlib stream of the tile's class indices at 5 bits each, first pixel in the lowest bits, raster order within the tile,
+//   followed by its alpha samples if the image has alpha (2 or 4 channels)
+// Tiles on the right and bottom edges hold only the pixels inside the image. Greyscale images use only the three noColor classes, and
+// decode to their palette red.
+static const long ifpHeaderBytes = 24;
+
+// Sample bits as IFP stores them.
+static uint32_t ifpSampleBits(unsigned char value) { return value; }
+static uint32_t ifpSampleBits(unsigned short value) { return value; }
+static uint32_t ifpSampleBits(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, 4);
+    return bits;
+}
+static void ifpSampleFromBits(uint32_t bits, unsigned char &value) { value = bits; }
+static void ifpSampleFromBits(uint32_t bits, unsigned short &value) { value = bits; }
+static void ifpSampleFromBits(uint32_t bits, float &value) { std::memcpy(&value, &bits, 4); }
+
+static void putLittleEndian(unsigned char *out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out[i] = value >> (8 * i);
+    }
+}
+
+static uint64_t getLittleEndian(const unsigned char *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint64_t)in[i] << (8 * i);
+    }
+    return value;
+}
+
+// Writes an image as IFP straight from its unfiltered pixels and the finalized palette: each tile is classified with the palette's kernel,
+// packed and deflated on its own, on several threads. The palette is never applied, so this replaces the apply pass rather than following
+// it. Returns false if the file cannot be written.
+template <typename T>
+static bool saveIfp(const CImg<T> &image, BasicColorPalette<T> &palette, const std::string &path, long tileSize = 256,
+                    int threads = std::max(1u, std::thread::hardware_concurrency())) {
+    long width = image.width(), height = image.height(), plane = width * height;
+    int channels = image.spectrum();
+    if (image.depth() != 1 || channels < 1 || channels > 4 || width < 1 || height < 1 || width > 0xFFFFFFFFL || height > 0xFFFFFFFFL) {
+        return false;
+    }
+    bool alpha = channels == 2 || channels == 4;
+    long columns = (width + tileSize - 1) / tileSize, rows = (height + tileSize - 1) / tileSize;
+    std::vector<std::vector<unsigned char>> tiles(columns * rows);
+    std::atomic<bool> failed(false);
+    parallelFor(tiles.size(), threads, [&](long t) {
+        long x0 = t % columns * tileSize, y0 = t / columns * tileSize;
+        long w = std::min(tileSize, width - x0), h = std::min(tileSize, height - y0), count = w * h;
+        BasicImageView<T> view = planarView(const_cast<T *>(image.data(x0, y0)), w, h, channels);
+        view.rowStride = width * (long)sizeof(T);
+        view.planeStride = plane * (long)sizeof(T);
+        std::vector<unsigned char> classes(count), raw((count * 5 + 7) / 8 + (alpha ? count * sizeof(T) : 0), 0);
+        palette.classify(view, classes.data(), w);
+        uint64_t pending = 0;
+        int used = 0;
+        unsigned char *out = raw.data();
+        for (long i = 0; i < count; i++) {
+            pending |= (uint64_t)classes[i] << used;
+            for (used += 5; used >= 8; used -= 8) {
+                *out++ = pending & 255;
+                pending >>= 8;
+            }
+        }
+        if (used) {
+            *out++ = pending & 255;
+        }
+        for (long y = 0; alpha && y < h; y++) {
+            const T *samples = image.data(x0, y0 + y, 0, channels - 1);
+            for (long x = 0; x < w; x++, out += sizeof(T)) {
+                putLittleEndian(out, ifpSampleBits(samples[x]), sizeof(T));
+            }
+        }
+        uLongf size = compressBound(raw.size());
+        tiles[t].resize(size);
+        if (compress2(tiles[t].data(), &size, raw.data(), raw.size(), Z_DEFAULT_COMPRESSION) != Z_OK) {
+            failed = true;
+        }
+        tiles[t].resize(size);
+    });
+    std::vector<unsigned char> header(ifpHeaderBytes + 63 * sizeof(T) + (tiles.size() + 1) * 8);
+    std::memcpy(header.data(), "IFP1", 4);
+    header[4] = sizeof(T);
+    header[5] = channels;
+    putLittleEndian(&header[8], width, 4);
+    putLittleEndian(&header[12], height, 4);
+    putLittleEndian(&header[16], tileSize, 4);
+    putLittleEndian(&header[20], tileSize, 4);
+    for (int i = 0; i < 21; i++) {
+        typename BasicColorPalette<T>::Triple &color = palette.entry(i);
+        T samples[3] = {(T)color.getRed(), (T)color.getGreen(), (T)color.getBlue()};
+        for (int c = 0; c < 3; c++) {
+            putLittleEndian(&header[ifpHeaderBytes + (3 * i + c) * sizeof(T)], ifpSampleBits(samples[c]), sizeof(T));
+        }
+    }
+    uint64_t offset = header.size();
+    for (size_t t = 0; t <= tiles.size(); t++) {
+        putLittleEndian(&header[ifpHeaderBytes + 63 * sizeof(T) + t * 8], offset, 8);
+        offset += t < tiles.size() ? tiles[t].size() : 0;
+    }
+    std::FILE *file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    bool written = !failed && std::fwrite(header.data(), 1, header.size(), file) == header.size();
+    for (size_t t = 0; t < tiles.size() && written; t++) {
+        written = std::fwrite(tiles[t].data(), 1, tiles[t].size(), file) == tiles[t].size();
+    }
+    return std::fclose(file) == 0 && written;
+}
+
+// Reads IFP files a region at a time, touching only the tiles the region overlaps. Reads go through pread, so one open reader can serve
+// several threads at once.
+class IfpReader {
+private:
+    int descriptor = -1;
+    long width = 0, height = 0, tileWidth = 0, tileHeight = 0, columns = 0;
+    int channels = 0, bytesPerSample = 0;
+    uint32_t palette[63];
+    std::vector<uint64_t> offsets;
+
+    bool readAt(uint64_t offset, unsigned char *out, size_t size) const {
+        while (size) {
+            ssize_t got = pread(descriptor, out, size, offset);
+            if (got <= 0) {
+                return false;
+            }
+            out += got;
+            offset += got;
+            size -= got;
+        }
+        return true;
+    }
+
+public:
+    IfpReader() {}
+    IfpReader(const IfpReader &) = delete;
+    IfpReader &operator=(const IfpReader &) = delete;
+    ~IfpReader() {
+        if (descriptor >= 0) {
+            close(descriptor);
+        }
+    }
+    // Reads the header, palette and tile offsets. Returns false if the file is not a well-formed IFP file, checking the sizes it declares
+    // against the file's before allocating anything for them.
+    bool open(const std::string &path) {
+        descriptor = ::open(path.c_str(), O_RDONLY);
+        unsigned char header[ifpHeaderBytes];
+        struct stat file;
+        if (descriptor < 0 || fstat(descriptor, &file) || !readAt(0, header, ifpHeaderBytes) || std::memcmp(header, "IFP1", 4)) {
+            return false;
+        }
+        uint64_t fileSize = file.st_size;
+        bytesPerSample = header[4];
+        channels = header[5];
+        width = getLittleEndian(&header[8], 4);
+        height = getLittleEndian(&header[12], 4);
+        tileWidth = getLittleEndian(&header[16], 4);
+        tileHeight = getLittleEndian(&header[20], 4);
+        if ((bytesPerSample != 1 && bytesPerSample != 2 && bytesPerSample != 4) || channels < 1 || channels > 4 || width < 1 || height < 1 ||
+            tileWidth < 1 || tileHeight < 1) {
+            return false;
+        }
+        columns = (width + tileWidth - 1) / tileWidth;
+        long rows = (height + tileHeight - 1) / tileHeight;
+        // Every pixel's class takes 5 bits before compression, so the whole image must inflate from what the file holds.
+        if ((uint64_t)rows > fileSize / 8 / columns || (double)width * height * 5 / 8 > (double)fileSize * deflateMaxRatio) {
+            return false;
+        }
+        long tiles = columns * rows;
+        uint64_t tablesEnd = ifpHeaderBytes + 63 * bytesPerSample + (tiles + 1) * 8;
+        if (tablesEnd > fileSize) {
+            return false;
+        }
+        std::vector<unsigned char> tables(tablesEnd - ifpHeaderBytes);
+        if (!readAt(ifpHeaderBytes, tables.data(), tables.size())) {
+            return false;
+        }
+        for (int i = 0; i < 63; i++) {
+            palette[i] = getLittleEndian(&tables[i * bytesPerSample], bytesPerSample);
+        }
+        offsets.resize(tiles + 1);
+        for (long t = 0; t <= tiles; t++) {
+            offsets[t] = getLittleEndian(&tables[63 * bytesPerSample + t * 8], 8);
+            if (t ? offsets[t] < offsets[t - 1] : offsets[t] < tablesEnd) {
+                return false;
+            }
+        }
+        return offsets[tiles] <= fileSize;
+    }
+    long getWidth(void) const { return width; }
+    long getHeight(void) const { return height; }
+    int getChannels(void) const { return channels; }
+    int getBytesPerSample(void) const { return bytesPerSample; }
+    // Decodes the region of `out`'s size whose top left corner is (x, y) into `out`, which must already have the file's channel count and
+    // sample size and lie inside the image. Returns false for a damaged tile.
+    template <typename T>
+    bool read(long x, long y, CImg<T> &out) const {
+        long w = out.width(), h = out.height();
+        if ((int)sizeof(T) != bytesPerSample || out.spectrum() != channels || out.depth() != 1 || x < 0 || y < 0 || x + w > width ||
+            y + h > height) {
+            return false;
+        }
+        T colors[63];
+        for (int i = 0; i < 63; i++) {
+            ifpSampleFromBits(palette[i], colors[i]);
+        }
+        bool alpha = channels == 2 || channels == 4;
+        std::vector<unsigned char> packed, raw;
+        for (long row = y / tileHeight; row * tileHeight < y + h; row++) {
+            for (long column = x / tileWidth; column * tileWidth < x + w; column++) {
+                long t = row * columns + column, x0 = column * tileWidth, y0 = row * tileHeight;
+                long tw = std::min(tileWidth, width - x0), th = std::min(tileHeight, height - y0), count = tw * th;
+                uLongf size = (count * 5 + 7) / 8 + (alpha ? count * bytesPerSample : 0);
+                if (size > (offsets[t + 1] - offsets[t]) * deflateMaxRatio) {
+                    return false;
+                }
+                packed.resize(offsets[t + 1] - offsets[t]);
+                raw.resize(size);
+                if (!readAt(offsets[t], packed.data(), packed.size()) || uncompress(raw.data(), &size, packed.data(), packed.size()) != Z_OK ||
+                    size != raw.size()) {
+                    return false;
+                }
+                // Only the part of the tile inside the region is unpacked.
+                long left = std::max(x, x0), right = std::min(x + w, x0 + tw), top = std::max(y, y0), bottom = std::min(y + h, y0 + th);
+                const unsigned char *alphaSamples = raw.data() + (count * 5 + 7) / 8;
+                for (long py = top; py < bottom; py++) {
+                    for (long px = left; px < right; px++) {
+                        long i = (py - y0) * tw + (px - x0), bit = i * 5;
+                        int index = ((raw[bit / 8] | (bit / 8 + 1 < (long)raw.size() ? raw[bit / 8 + 1] << 8 : 0)) >> (bit % 8)) & 31;
+                        if (index > 20) {
+                            return false;
+                        }
+                        if (channels >= 3) {
+                            out(px - x, py - y, 0) = colors[3 * index];
+                            out(px - x, py - y, 1) = colors[3 * index + 1];
+                            out(px - x, py - y, 2) = colors[3 * index + 2];
+                        } else {
+                            out(px - x, py - y, 0) = colors[3 * index];
+                        }
+                        if (alpha) {
+                            ifpSampleFromBits(getLittleEndian(alphaSamples + i * bytesPerSample, bytesPerSample), out(px - x, py - y, channels - 1));
+                        }
+                    }
+                }
+            }
+        }
+        return true;
+    }
+};
+
+// Decodes a whole IFP file into an image already sized for it.
+template <typename T>
+static bool loadIfp(const std::string &uri, CImg<T> &image) {
+    IfpReader reader;
+    return reader.open(uri) && reader.read(0, 0, image);
+}
+
+// Whether an output format is a tile pyramid rather than a single file (see PyramidWriter).
+static bool isPyramidFormat(const std::string &format) { return format == "dzi" || format == "xyz"; }
+
+// Writes a filtered image as a deep-zoom tile pyramid instead of one file, from the rows of the unfiltered image fed top to bottom in a
+// single pass. Rows are classified rather than remapped, and each level is built from the class map of the level above as its rows arrive,
+// taking the most common class of every 2x2 block (the first of them on a tie), so lower levels keep to the palette's colours instead of
+// blurring into new ones; alpha is averaged. A level only holds the band of rows for its current row of tiles, which is encoded as PNG, in
+// parallel, as soon as it is complete. Layouts, PATH being the output path:
+//   dzi   PATH, the Deep Zoom descriptor, and PATH_files/LEVEL/COLUMN_ROW.png with PATH's extension dropped; levels run from 0, a single
+//         pixel, up to the full size
+//   xyz   PATH/Z/X/Y.png, zoom 0 being the largest level that fits in one tile
+// Tiles do not overlap, and those on the right and bottom edges are cut to the level.
+template <typename T>
+class PyramidWriter {
+private:
+    struct Level {
+        long width;
+        long height;
+        // Classes and alpha of the rows of the current band of tiles, and how many rows the level has had so far.
+        std::vector<unsigned char> classes;
+        std::vector<T> alpha;
+        long rows;
+        // An even row waiting for the row below it to be downsampled with.
+        std::vector<unsigned char> pendingClasses;
+        std::vector<T> pendingAlpha;
+    };
+    const BasicColorPalette<T> &palette;
+    T colors[63];
+    std::string path;
+    std::string directory;
+    bool xyz;
+    long tileSize;
+    int threads;
+    long width = 0;
+    long height = 0;
+    int channels = 0;
+    bool hasAlpha = false;
+    int lowest = 0;
+    std::vector<Level> levels;
+    std::string error;
+
+    std::string tilePath(int level, long column, long row) const {
+        if (xyz) {
+            return directory + "/" + std::to_string(level - lowest) + "/" + std::to_string(column) + "/" + std::to_string(row) + ".png";
+        }
+        return directory + "/" + std::to_string(level) + "/" + std::to_string(column) + "_" + std::to_string(row) + ".png";
+    }
+    // Renders and writes the level's current band of tiles, which holds `rows` rows.
+    bool writeBand(int index, long rows) {
+        const Level &level = levels[index];
+        long row = (level.rows - 1) / tileSize, columns = (level.width + tileSize - 1) / tileSize;
+        std::vector<char> failed(columns, 0);
+        parallelFor(columns, threads, [&](long column) {
+            long x0 = column * tileSize, w = std::min(tileSize, level.width - x0);
+            CImg<T> tile(w, rows, 1, channels);
+            for (long y = 0; y < rows; y++) {
+                for (long x = 0; x < w; x++) {
+                    const T *color = colors + 3 * level.classes[y * level.width + x0 + x];
+                    for (int c = 0; c < std::min(channels, 3); c++) {
+                        tile(x, y, c) = color[c];
+                    }
+                    if (hasAlpha) {
+                        tile(x, y, channels - 1) = level.alpha[y * level.width + x0 + x];
+                    }
+                }
+            }
+            std::vector<unsigned char> png;
+            std::string name = tilePath(index, column, row);
+            std::FILE *file = encodeTilePng(tile, png) ? std::fopen(name.c_str(), "wb") : nullptr;
+            bool written = file && std::fwrite(png.data(), 1, png.size(), file) == png.size();
+            failed[column] = !file || std::fclose(file) != 0 || !written;
+        });
+        for (long column = 0; column < columns; column++) {
+            if (failed[column]) {
+                error = "cannot write " + tilePath(index, column, row);
+                return false;
+            }
+        }
+        return true;
+    }
+    // Halves a pair of rows of the level into a row of the level below. lower is null for the odd last row of the level.
+    bool downsample(int index, const unsigned char *upperClasses, const T *upperAlpha, const unsigned char *lowerClasses, const T *lowerAlpha) {
+        long from = levels[index].width, to = levels[index - 1].width;
+        std::vector<unsigned char> classes(to);
+        std::vector<T> alpha(hasAlpha ? to : 0);
+        for (long x = 0; x < to; x++) {
+            unsigned char votes[4];
+            double opacity = 0;
+            int count = 0;
+            for (int i = 0; i < 4; i++) {
+                long column = 2 * x + (i & 1);
+                const unsigned char *row = i < 2 ? upperClasses : lowerClasses;
+                if (row && column < from) {
+                    votes[count++] = row[column];
+                    opacity += hasAlpha ? (i < 2 ? upperAlpha : lowerAlpha)[column] : 0;
+                }
+            }
+            int best = 0, bestCount = 0;
+            for (int i = 0; i < count; i++) {
+                int same = 0;
+                for (int j = 0; j < count; j++) {
+                    same += votes[j] == votes[i];
+                }
+                if (same > bestCount) {
+                    best = i;
+                    bestCount = same;
+                }
+            }
+            classes[x] = votes[best];
+            if (hasAlpha) {
+                alpha[x] = opacity / count + (std::numeric_limits<T>::is_integer ? 0.5 : 0);
+            }
+        }
+        return addRow(index - 1, classes.data(), alpha.data());
+    }
+    bool addRow(int index, const unsigned char *classes, const T *alpha) {
+        Level &level = levels[index];
+        long inBand = level.rows % tileSize;
+        std::memcpy(level.classes.data() + inBand * level.width, classes, level.width);
+        if (hasAlpha) {
+            std::memcpy(level.alpha.data() + inBand * level.width, alpha, level.width * sizeof(T));
+        }
+        level.rows++;
+        if ((inBand + 1 == tileSize || level.rows == level.height) && !writeBand(index, inBand + 1)) {
+            return false;
+        }
+        if (index == lowest) {
+            return true;
+        }
+        if (level.rows % 2 == 0) {
+            return downsample(index, level.pendingClasses.data(), level.pendingAlpha.data(), classes, alpha);
+        }
+        if (level.rows == level.height) {
+            return downsample(index, classes, alpha, nullptr, nullptr);
+        }
+        level.pendingClasses.assign(classes, classes + level.width);
+        if (hasAlpha) {
+            level.pendingAlpha.assign(alpha, alpha + level.width);
+        }
+        return true;
+    }
+    bool makeDirectory(const std::string &name) {
+        if (mkdir(name.c_str(), 0777) != 0 && errno != EEXIST) {
+            error = "cannot create " + name + ": " + std::strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+public:
+    // The palette must be finalized. xyz picks the XYZ layout over DZI.
+    PyramidWriter(BasicColorPalette<T> &finalized, bool xyzLayout, long size = 256, int workers = std::max(1u, std::thread::hardware_concurrency()))
+        : palette(finalized), xyz(xyzLayout), tileSize(std::max(1L, size)), threads(workers) {
+        for (int i = 0; i < 21; i++) {
+            colors[3 * i] = finalized.entry(i).getRed();
+            colors[3 * i + 1] = finalized.entry(i).getGreen();
+            colors[3 * i + 2] = finalized.entry(i).getBlue();
+        }
+    }
+    // Plans the levels and creates their directories. channels is 1 to 4, with alpha last for 2 and 4.
+    bool open(const std::string &outputPath, long imageWidth, long imageHeight, int imageChannels) {
+        path = outputPath;
+        width = imageWidth;
+        height = imageHeight;
+        channels = imageChannels;
+        hasAlpha = channels == 2 || channels == 4;
+        directory = xyz ? path : path.substr(0, path.rfind('.')) + "_files";
+        int top = 0;
+        while ((1L << top) < std::max(width, height)) {
+            top++;
+        }
+        levels.resize(top + 1);
+        for (int i = top; i >= 0; i--) {
+            Level &level = levels[i];
+            level.width = i == top ? width : (levels[i + 1].width + 1) / 2;
+            level.height = i == top ? height : (levels[i + 1].height + 1) / 2;
+            level.rows = 0;
+        }
+        for (lowest = xyz ? top : 0; xyz && lowest > 0 && (levels[lowest].width > tileSize || levels[lowest].height > tileSize); lowest--) {
+        }
+        if (!makeDirectory(directory)) {
+            return false;
+        }
+        for (int i = lowest; i <= top; i++) {
+            levels[i].classes.resize(std::min(tileSize, levels[i].height) * levels[i].width);
+            levels[i].alpha.resize(hasAlpha ? levels[i].classes.size() : 0);
+            if (!makeDirectory(directory + "/" + std::to_string(i - (xyz ? lowest : 0)))) {
+                return false;
+            }
+            for (long column = 0; xyz && column * tileSize < levels[i].width; column++) {
+                if (!makeDirectory(directory + "/" + std::to_string(i - lowest) + "/" + std::to_string(column))) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    // Adds the next rows of the unfiltered image, in any layout, with open's width and channel count.
+    bool writeRows(const BasicImageView<T> &rows) {
+        std::vector<unsigned char> classes;
+        std::vector<T> alpha;
+        for (long first = 0; first < rows.height; first += tileSize) {
+            long count = std::min(tileSize, rows.height - first);
+            BasicImageView<T> band = rows;
+            band.data = reinterpret_cast<T *>(reinterpret_cast<unsigned char *>(rows.data) + first * rows.rowStride);
+            band.height = count;
+            classes.resize(count * width);
+            alpha.resize(hasAlpha ? count * width : 0);
+            parallelFor(count, threads, [&](long y) {
+                BasicImageView<T> row = band;
+                row.data = reinterpret_cast<T *>(reinterpret_cast<unsigned char *>(band.data) + y * band.rowStride);
+                row.height = 1;
+                palette.classify(row, classes.data() + y * width, width);
+                for (long x = 0; hasAlpha && x < width; x++) {
+                    const unsigned char *sample = reinterpret_cast<const unsigned char *>(row.data);
+                    if (row.layout == Layout::Planar) {
+                        sample += (channels - 1) * row.planeStride + x * sizeof(T);
+                    } else {
+                        sample += (x * channels + channels - 1) * sizeof(T);
+                    }
+                    alpha[y * width + x] = *reinterpret_cast<const T *>(sample);
+                }
+            });
+            for (long y = 0; y < count; y++) {
+                if (!addRow((int)levels.size() - 1, classes.data() + y * width, hasAlpha ? alpha.data() + y * width : nullptr)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    // Checks that every row arrived and writes the DZI descriptor.
+    bool finish(void) {
+        if (levels.empty() || levels.back().rows != height) {
+            error = "pyramid is missing rows";
+            return false;
+        }
+        if (xyz) {
+            return true;
+        }
+        std::ofstream descriptor(path.c_str());
+        descriptor << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"png\" "
+                   << "Overlap=\"0\" TileSize=\"" << tileSize << "\">\n  <Size Width=\"" << width << "\" Height=\"" << height << "\"/>\n</Image>\n";
+        descriptor.close();
+        if (!descriptor) {
+            error = "cannot write " + path;
+            return false;
+        }
+        return true;
+    }
+    const std::string &getError(void) const { return error; }
+};
+
+// Source pixels under each of `to` output pixels when `from` pixels are shrunk to `to`, with the fraction of the output pixel each covers:
+// output o takes weights[offsets[o]] to weights[offsets[o + 1] - 1], for consecutive source pixels from first[o] on.
+static void areaWeights(long from, long to, std::vector<long> &first, std::vector<long> &offsets, std::vector<double> &weights) {
+    double scale = (double)from / to;
+    first.resize(to);
+    offsets.assign(1, 0);
+    weights.clear();
+    for (long o = 0; o < to; o++) {
+        double left = o * scale, right = (o + 1) * scale;
+        first[o] = (long)left;
+        for (long i = first[o]; i < from && i < right; i++) {
+            weights.push_back((std::min(right, i + 1.0) - std::max(left, (double)i)) / scale);
+        }
+        offsets.push_back(weights.size());
+    }
+}
+
+// Shrinks an image by area averaging: each output pixel is the mean of the source area it covers, with the source pixels on its edges counted
+// by the fraction they cover. Separable, over precomputed weights, and in parallel over output rows. Each output row first sums its source
+// rows into one full-width row, a flat loop over contiguous samples, and only then narrows that row.
+template <typename T>
+static CImg<T> downscaleArea(const CImg<T> &source, long width, long height, int threads = std::max(1u, std::thread::hardware_concurrency())) {
+    std::vector<long> firstX, offsetsX, firstY, offsetsY;
+    std::vector<double> weightsX, weightsY;
+    areaWeights(source.width(), width, firstX, offsetsX, weightsX);
+    areaWeights(source.height(), height, firstY, offsetsY, weightsY);
+    CImg<T> out(width, height, 1, source.spectrum());
+    double rounding = std::numeric_limits<T>::is_integer ? 0.5 : 0;
+    parallelFor(height, threads, [&](long y) {
+        long sourceWidth = source.width();
+        std::vector<float> row(sourceWidth);
+        for (int c = 0; c < source.spectrum(); c++) {
+            std::fill(row.begin(), row.end(), 0.0f);
+            for (long k = offsetsY[y]; k < offsetsY[y + 1]; k++) {
+                const T *in = source.data(0, firstY[y] + k - offsetsY[y], 0, c);
+                float weight = weightsY[k], *sums = row.data();
+                for (long x = 0; x < sourceWidth; x++) {
+                    sums[x] += in[x] * weight;
+                }
+            }
+            for (long x = 0; x < width; x++) {
+                double sum = 0;
+                for (long j = offsetsX[x]; j < offsetsX[x + 1]; j++) {
+                    sum += row[firstX[x] + j - offsetsX[x]] * weightsX[j];
+                }
+                out(x, y, 0, c) = sum + rounding;
+            }
+        }
+    });
+    return out;
+}
+
+// Extension of the output format, from --format ("webp", "png", "qoi", ...). Empty keeps the input's format.
+static std::string outputFormat;
+// Tile size of pyramid output and of the daemon's tile server, from --tile-size.
+static long outputTileSize = 256;
+// Thumbnail sizes from --thumbnails. When there are any, they are written instead of the full-size output.
+static std::vector<int> thumbnailSizes;
+
+// Loads, filters and saves one image with samples of type T: unsigned char for ordinary images, unsigned short for 16-bit PNGs and float for
+// PFM files. Each type runs its own instantiation of the library kernels, so wide images keep their full precision end to end.
+template <typename T>
+class BasicImageFilter {
+private:
+    long width;
+    long height;
+    CImg<T> image;
+    Kernel kernel;
+    BasicColorPalette<T> palette;
+    // Pool block the image was decoded into, if any. The image is then a shared view over it, and the block goes back to the pool when the
+    // filter is destroyed.
+    BufferPool *pool = nullptr;
+    unsigned char *pooledBlock = nullptr;
+    size_t pooledCapacity = 0;
+    HeapCounters *pooledAccount = nullptr;
+    StageTimes times;
+    StageMemory loadMemory, paletteMemory, applyMemory, saveMemory;
+    // Heap charged to this thread's account before the image was loaded, and the highest it has been since. Used for the per-job peak.
+    long jobBaseBytes = heapCounters().current;
+    long jobPeakBytes = 0;
+    void recordStage(StageMemory &target, const StageMeter &meter) {
+        target = meter.stop();
+        jobPeakBytes = std::max(jobPeakBytes, heapCounters().peak - jobBaseBytes);
+    }
+    // Pool blocks come from posix_memalign rather than operator new, so they are charged here for as long as the filter holds one.
+    void releasePooled(void) {
+        chargeHeap(*pooledAccount, -(long)pooledCapacity);
+        pool->release(pooledBlock, pooledCapacity);
+        pooledBlock = nullptr;
+    }
+
+    // Greyscale images have one channel (two with alpha), and their pixels are read as r == g == b.
+    bool isGray(void) const { return image.spectrum() < 3; }
+    int alphaChannel(void) const { return image.spectrum() == 2 ? 1 : image.spectrum() >= 4 ? 3 : -1; }
+    void getColorPalette(void) {
+        int alpha = alphaChannel();
+        int green = isGray() ? 0 : 1, blue = isGray() ? 0 : 2;
+        for (long y = 0; y < height; y++) {
+            for (long x = 0; x < width; x++) {
+                if (alpha >= 0 && image(x, y, alpha) == 0) {
+                    continue;
+                }
+                palette.mergeReference(image(x, y, 0), image(x, y, green), image(x, y, blue));
+            }
+        }
+    }
+    void applyFilterReference(void) {
+        typename BasicColorPalette<T>::Triple newColor;
+        if (isGray()) {
+            for (long y = 0; y < height; y++) {
+                for (long x = 0; x < width; x++) {
+                    image(x, y, 0) = palette.getPaletteHue(image(x, y, 0), image(x, y, 0), image(x, y, 0)).getRed();
+                }
+            }
+            return;
+        }
+        for (long y = 0; y < height; y++) {
+            for (long x = 0; x < width; x++) {
+                newColor = palette.getPaletteHue(image(x, y, 0), image(x, y, 1), image(x, y, 2));
+                image(x, y, 0) = newColor.getRed();
+                image(x, y, 1) = newColor.getGreen();
+                image(x, y, 2) = newColor.getBlue();
+            }
+        }
+    }
+    // Decodes straight into a pool block. Only possible when the header predicts the decoded size exactly, since CImg will not resize a shared
+    // image; anything unexpected returns the block and falls back to a normal load.
+    bool loadPooled(const std::string &uri, const ImageHeader &header) {
+        if (!pool || !header.known) {
+            return false;
+        }
+        if (header.bytesPerSample != (int)sizeof(T)) {
+            return false;
+        }
+        pooledBlock = pool->acquire(header.width * header.height * header.channels * sizeof(T), pooledCapacity);
+        pooledAccount = &heapCounters();
+        pooledAccount->allocations++;
+        chargeHeap(*pooledAccount, pooledCapacity);
+        try {
+            image.assign(reinterpret_cast<T *>(pooledBlock), header.width, header.height, 1, header.channels, true);
+            decode(uri, header);
+            return true;
+        } catch (const CImgException &) {
+            image.assign();
+            releasePooled();
+            return false;
+        }
+    }
+    // Decodes into the image as already sized, spreading JPEGs with restart markers over several threads and decoding QOI and IFP, which
+    // CImg does not know. CImg decodes everything else, and anything the parallel decoder gives up on.
+    void decode(const std::string &uri, const ImageHeader &header) {
+        if (header.qoi) {
+            if (!loadQoi(uri, image)) {
+                throw CImgIOException("cannot decode QOI file '%s'", uri.c_str());
+            }
+        } else if (header.ifp) {
+            if (!loadIfp(uri, image)) {
+                throw CImgIOException("cannot decode IFP file '%s'", uri.c_str());
+            }
+        } else if (!header.jpeg || !header.sequential || !decodeRestartJpeg(uri, image)) {
+            image.load(uri.c_str());
+        }
+    }
+    void buildPalette(void) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        StageMeter meter;
+        meter.start();
+        if (kernel == Kernel::Reference) {
+            getColorPalette();
+        } else {
+            palette.merge(planarView(image.data(), width, height, image.spectrum()));
+        }
+        palette.finalize();
+        times.palette = secondsSince(start);
+        recordStage(paletteMemory, meter);
+    }
+public:
+    // Renames filtered files and places them in an output folder. The extension becomes --format's, unless the caller always writes the
+    // input's own format (keepExtension).
+    static std::string getFileName(std::string uri, bool keepExtension = false) {
+        int searcher, slash = 0;
+        for (searcher = 0; searcher < uri.size(); searcher++) {
+            if (uri[searcher] == '/') {
+                slash = searcher;
+                slash++;
+            }
+        }
+        std::string name = "output/filtered-" + uri.substr(slash, searcher);
+        if (keepExtension || outputFormat.empty()) {
+            return name;
+        }
+        size_t dot = name.rfind('.');
+        return (dot == std::string::npos ? name : name.substr(0, dot)) + "." + outputFormat;
+    }
+    BasicImageFilter(std::string uri, Kernel k = Kernel::Fast, BufferPool *bufferPool = nullptr) : kernel(k), pool(bufferPool) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        StageMeter meter;
+        meter.start();
+        ImageHeader header = readImageHeader(uri);
+        if (!loadPooled(uri, header)) {
+            if (header.known && ((header.jpeg && header.sequential) || header.qoi || header.ifp)) {
+                image.assign(header.width, header.height, 1, header.channels);
+            }
+            decode(uri, header);
+        }
+        width = image.width();
+        height = image.height();
+        times.load = secondsSince(start);
+        recordStage(loadMemory, meter);
+        buildPalette();
+    }
+    // Filters a copy of an image that is already in memory.
+    BasicImageFilter(const CImg<T> &source, Kernel k = Kernel::Fast) : image(source), kernel(k) {
+        width = image.width();
+        height = image.height();
+        buildPalette();
+    }
+    // Takes over the pixels of an image that is already in memory without copying them: pass std::move(image). A shared image stays shared,
+    // so a caller can filter its own buffer in place through CImg<T>(data, width, height, 1, channels, true) as long as it outlives the filter.
+    BasicImageFilter(CImg<T> &&source, Kernel k = Kernel::Fast) : image(std::move(source)), kernel(k) {
+        width = image.width();
+        height = image.height();
+        buildPalette();
+    }
+    BasicImageFilter(const BasicImageFilter &) = delete;
+    BasicImageFilter &operator=(const BasicImageFilter &) = delete;
+    ~BasicImageFilter() {
+        if (pooledBlock) {
+            image.assign();
+            releasePooled();
+        }
+    }
+    const CImg<T> &getImage(void) const { return image; }
+    // Hands the image over to the caller and leaves the filter empty. A pooled image is copied out, since its block goes back to the pool.
+    CImg<T> takeImage(void) {
+        CImg<T> taken;
+        if (pooledBlock) {
+            taken.assign(image, false);
+        } else {
+            taken.swap(image);
+        }
+        width = height = 0;
+        return taken;
+    }
+    // The 21 palette entries in class order (see ClassTables).
+    std::vector<typename BasicColorPalette<T>::Triple> getPalette(void) {
+        std::vector<typename BasicColorPalette<T>::Triple> colors;
+        for (int i = 0; i < 21; i++) {
+            colors.push_back(palette.entry(i));
+        }
+        return colors;
+    }
+    const StageTimes &getStageTimes(void) const { return times; }
+    long pixelCount(void) const { return width * height; }
+    // Copies the region of `out`'s size whose top left corner is (x, y) into `out`, which must have the image's channel count, and remaps
+    // only that copy. The image itself stays unfiltered, so regions can be rendered on demand from the one palette the constructor built.
+    bool filterRegion(long x, long y, CImg<T> &out) const {
+        long w = out.width(), h = out.height();
+        if (out.spectrum() != image.spectrum() || out.depth() != 1 || x < 0 || y < 0 || x + w > width || y + h > height) {
+            return false;
+        }
+        for (int c = 0; c < out.spectrum(); c++) {
+            for (long row = 0; row < h; row++) {
+                std::memcpy(out.data(0, row, 0, c), image.data(x, y + row, 0, c), w * sizeof(T));
+            }
+        }
+        palette.apply(planarView(out.data(), w, h, out.spectrum()));
+        return true;
+    }
+    void saveImageFile(std::string uri) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        StageMeter meter;
+        meter.start();
+        saveAs(image, getFileName(uri));
+        times.save = secondsSince(start);
+        recordStage(saveMemory, meter);
+    }
+    // Encodes a filtered image to the path, in the format its extension names.
+    static void saveAs(const CImg<T> &image, const std::string &path) {
+        const char *extension = cimg::split_filename(path.c_str());
+        bool jpeg = !cimg::strcasecmp(extension, "jpg") || !cimg::strcasecmp(extension, "jpeg"), png = !cimg::strcasecmp(extension, "png");
+        bool qoi = !cimg::strcasecmp(extension, "qoi"), webp = !cimg::strcasecmp(extension, "webp");
+        if (!cimg::strcasecmp(extension, "ifp") || isPyramidFormat(extension)) {
+            // Two classes can share a colour, so the classes cannot be recovered once the palette is applied; applyFilterAndSave writes IFP
+            // and pyramids before applying.
+            throw CImgIOException("'%s' must be written from the unfiltered image", path.c_str());
+        }
+        bool encoded = (jpeg && saveStripJpeg(image, path)) || (png && saveParallelPng(image, path)) || (qoi && saveQoi(image, path)) ||
+                       (webp && saveWebp(image, path));
+        if (!encoded && webp) {
+            throw CImgIOException("cannot write WebP file '%s': one to four channels and up to 16384 pixels a side only", path.c_str());
+        } else if (!encoded && qoi) {
+            throw CImgIOException("cannot write QOI file '%s': one to four channels only", path.c_str());
+        } else if (!encoded && sizeof(T) == 2 && png) {
+            // CImg picks 8 bits whenever the values fit, which a dark palette can; keep the output as deep as the input.
+            image.save_png(path.c_str(), 2);
+        } else if (!encoded) {
+            image.save(path.c_str());
+        }
+    }
+    void applyFilter(void) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        StageMeter meter;
+        meter.start();
+        if (kernel == Kernel::Reference) {
+            applyFilterReference();
+        } else {
+            palette.apply(planarView(image.data(), width, height, image.spectrum()));
+        }
+        times.apply = secondsSince(start);
+        recordStage(applyMemory, meter);
+    }
+    // applyFilter then saveImageFile, except for outputs that need no separate apply pass. QOI output is filtered and encoded in one pass:
+    // each row is remapped and then encoded while it is still in cache. IFP output and tile pyramids are built from each pixel's class, taken
+    // from the unfiltered image, so the palette is never applied at all. Either way the work is timed as the save stage, leaving apply at
+    // zero.
+    void applyFilterAndSave(std::string uri) {
+        std::string path = getFileName(uri);
+        const char *extension = cimg::split_filename(path.c_str());
+        bool ifp = !cimg::strcasecmp(extension, "ifp"), pyramid = isPyramidFormat(extension);
+        bool qoi = sizeof(T) == 1 && kernel != Kernel::Reference && !cimg::strcasecmp(extension, "qoi");
+        if (!ifp && !qoi && !pyramid) {
+            applyFilter();
+            saveImageFile(uri);
+            return;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        StageMeter meter;
+        meter.start();
+        bool saved;
+        if (ifp) {
+            saved = saveIfp(image, palette, path);
+        } else if (pyramid) {
+            PyramidWriter<T> writer(palette, !cimg::strcasecmp(extension, "xyz"), outputTileSize);
+            saved = writer.open(path, width, height, image.spectrum()) &&
+                    writer.writeRows(planarView(image.data(), width, height, image.spectrum())) && writer.finish();
+            if (!saved) {
+                throw CImgIOException("cannot write pyramid '%s': %s", path.c_str(), writer.getError().c_str());
+            }
+        } else {
+            BasicImageView<T> row = planarView(image.data(), width, 1, image.spectrum());
+            row.planeStride = width * height * (long)sizeof(T);
+            saved = saveQoi(image, path, [&](long y) {
+                BasicImageView<T> view = row;
+                view.data = image.data() + y * width;
+                palette.apply(view);
+            });
+        }
+        if (!saved) {
+            throw CImgIOException("cannot write %s file '%s'", ifp ? "IFP" : "QOI", path.c_str());
+        }
+        times.save = secondsSince(start);
+        recordStage(saveMemory, meter);
+    }
+    // Output path of the thumbnail of the given size: getFileName's, with "-SIZE" before the extension.
+    static std::string getThumbnailName(std::string uri, int size) {
+        std::string name = getFileName(uri);
+        size_t dot = name.rfind('.'), slash = name.rfind('/');
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+            dot = name.size();
+        }
+        return name.substr(0, dot) + "-" + std::to_string(size) + name.substr(dot);
+    }
+    // The image downscaled to fit within each size x size square, keeping its aspect ratio and never enlarging it, in the order of `sizes`.
+    // Each is area-averaged from the full image, so rounding never compounds from one size to the next, and then remapped with the full
+    // image's palette if `filtered` is set.
+    std::vector<CImg<T>> getThumbnails(const std::vector<int> &sizes, bool filtered) const {
+        std::vector<CImg<T>> thumbnails(sizes.size());
+        for (size_t i = 0; i < sizes.size(); i++) {
+            double scale = std::min(1.0, (double)std::max(1, sizes[i]) / std::max(width, height));
+            long w = std::max(1L, std::lround(width * scale)), h = std::max(1L, std::lround(height * scale));
+            thumbnails[i] = w == width && h == height ? image : downscaleArea(image, w, h);
+            if (filtered) {
+                palette.apply(planarView(thumbnails[i].data(), w, h, thumbnails[i].spectrum()));
+            }
+        }
+        return thumbnails;
+    }
+    // Writes a thumbnail for each size, to getThumbnailName, instead of the full-size image: one decode and one palette build for all of them.
+    // The palette is the full image's, as always, but it is only applied to the downscaled planes (see getThumbnails), so thumbnails hold
+    // nothing but palette colours and nothing is remapped at full size. IFP thumbnails are written from their classes, unfiltered. Timed as
+    // the save stage, leaving apply at zero.
+    void saveThumbnails(std::string uri, const std::vector<int> &sizes) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        StageMeter meter;
+        meter.start();
+        bool ifp = !cimg::strcasecmp(cimg::split_filename(getFileName(uri).c_str()), "ifp");
+        std::vector<CImg<T>> thumbnails = getThumbnails(sizes, !ifp);
+        for (size_t i = 0; i < sizes.size(); i++) {
+            std::string path = getThumbnailName(uri, sizes[i]);
+            if (ifp && !saveIfp(thumbnails[i], palette, path)) {
+                throw CImgIOException("cannot write IFP file '%s'", path.c_str());
+            } else if (!ifp) {
+                saveAs(thumbnails[i], path);
+            }
+        }
+        times.save = secondsSince(start);
+        recordStage(saveMemory, meter);
+    }
+    // Highest heap use on this thread above the level before the image was loaded, across all stages run so far.
+    long getPeakBytes(void) const { return jobPeakBytes; }
+    void printStats(std::ostream &out) const {
+        const char *names[] = {"load", "getColorPalette", "applyFilter", "save"};
+        const double seconds[] = {times.load, times.palette, times.apply, times.save};
+        const StageMemory *memory[] = {&loadMemory, &paletteMemory, &applyMemory, &saveMemory};
+        out << std::left << std::setw(18) << "stage" << std::right << std::setw(10) << "ms" << std::setw(10) << "allocs" << std::setw(14)
+            << "peak heap" << std::setw(14) << "retained" << std::endl;
+        for (int i = 0; i < 4; i++) {
+            out << std::left << std::setw(18) << names[i] << std::right << std::fixed << std::setprecision(1) << std::setw(10)
+                << seconds[i] * 1000 << std::setw(10) << memory[i]->allocations << std::setw(14) << memory[i]->peakBytes << std::setw(14)
+                << memory[i]->retainedBytes << std::endl;
+        }
+        out << "pixels " << pixelCount() << ", job peak heap " << jobPeakBytes << " bytes, process peak RSS " << peakResidentBytes() << " bytes"
+            << std::endl;
+    }
+};
+
+typedef BasicImageFilter<unsigned char> ImageFilter;
+
+template <typename T>
+static void filterFile(const std::string &uri, BufferPool *pool, std::ostream *stats) {
+    BasicImageFilter<T> newImage(uri, Kernel::Fast, pool);
+
+    if (thumbnailSizes.empty()) {
+        newImage.applyFilterAndSave(uri);
+    } else {
+        newImage.saveThumbnails(uri, thumbnailSizes);
+    }
+    if (stats) {
+        newImage.printStats(*stats);
+    }
+}
+
+// Filters one file with the kernels for its sample size, as reported by readImageHeader. Optionally prints the per-stage statistics.
+static void filterFile(const std::string &uri, int bytesPerSample, BufferPool *pool = nullptr, std::ostream *stats = nullptr) {
+    if (bytesPerSample == 4) {
+        filterFile<float>(uri, pool, stats);
+    } else if (bytesPerSample == 2) {
+        filterFile<unsigned short>(uri, pool, stats);
+    } else {
+        filterFile<unsigned char>(uri, pool, stats);
+    }
+}
+
+// Filters a sequential RGB JPEG in two streaming passes so the full raster is never held. The first decode feeds rows to the palette in raster
+// order; the second decode remaps each row and hands it straight to the encoder. Decoder and encoder settings match CImg's load_jpeg and
+// save_jpeg, so the output decodes to the same pixels as the in-memory path's (and is byte-identical to it on a single core, where the
+// in-memory path does not use StripJpegEncoder).
+class JpegStripFilter {
+private:
+    std::string uri;
+    ColorPalette palette;
+    std::string error;
+
+    // Merges every row into the palette, or with `applying` remaps every row and writes the output. A failed pass removes what it wrote, and
+    // so does a file whose rows end early, which libjpeg would otherwise let through short.
+    bool runPass(bool applying) {
+        std::string path = ImageFilter::getFileName(uri, true);
+        // Volatile, so the error path after libjpeg's longjmp reads the files from memory rather than from registers setjmp did not save.
+        std::FILE *volatile in = std::fopen(uri.c_str(), "rb");
+        std::FILE *volatile out = applying ? std::fopen(path.c_str(), "wb") : nullptr;
+        if (!in || (applying && !out)) {
+            error = "cannot open " + (in ? path : uri);
+            if (in) {
+                std::fclose(in);
+            }
+            if (out) {
+                std::fclose(out);
+            }
+            return false;
+        }
+        jpeg_decompress_struct decoder;
+        jpeg_compress_struct encoder;
+        JpegErrorManager manager;
+        decoder.err = jpeg_std_error(&manager.base);
+        encoder.err = &manager.base;
+        manager.base.error_exit = jpegErrorExit;
+        std::vector<unsigned char> row;
+        if (setjmp(manager.jump)) {
+            error = manager.message;
+            jpeg_destroy_decompress(&decoder);
+            if (applying) {
+                jpeg_destroy_compress(&encoder);
+                std::fclose(out);
+                std::remove(path.c_str());
+            }
+            std::fclose(in);
+            return false;
+        }
+        jpeg_create_decompress(&decoder);
+        if (applying) {
+            jpeg_create_compress(&encoder);
+        }
+        jpeg_stdio_src(&decoder, in);
+        jpeg_read_header(&decoder, TRUE);
+        jpeg_start_decompress(&decoder);
+        long width = decoder.output_width;
+        int components = decoder.output_components;
+        if (components != 3 && components != 1) {
+            std::snprintf(manager.message, sizeof(manager.message), "strip path needs 1 or 3 components, found %d", components);
+            longjmp(manager.jump, 1);
+        }
+        if (applying) {
+            jpeg_stdio_dest(&encoder, out);
+            encoder.image_width = decoder.output_width;
+            encoder.image_height = decoder.output_height;
+            encoder.input_components = components;
+            encoder.in_color_space = components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+            jpeg_set_defaults(&encoder);
+            jpeg_set_quality(&encoder, 100, TRUE);
+            jpeg_start_compress(&encoder, TRUE);
+        }
+        row.resize(width * components);
+        while (decoder.output_scanline < decoder.output_height) {
+            JSAMPROW rowPointer = row.data();
+            if (jpeg_read_scanlines(&decoder, &rowPointer, 1) != 1) {
+                std::snprintf(manager.message, sizeof(manager.message), "JPEG data ends at row %u of %u", decoder.output_scanline,
+                              decoder.output_height);
+                longjmp(manager.jump, 1);
+            }
+            ImageView view = interleavedView(row.data(), width, 1, components, 0, components == 1 ? Layout::Gray : Layout::RGB);
+            if (!applying) {
+                palette.merge(view);
+                continue;
+            }
+            palette.apply(view);
+            jpeg_write_scanlines(&encoder, &rowPointer, 1);
+        }
+        if (applying) {
+            jpeg_finish_compress(&encoder);
+            jpeg_destroy_compress(&encoder);
+        }
+        jpeg_finish_decompress(&decoder);
+        jpeg_destroy_decompress(&decoder);
+        std::fclose(in);
+        if (applying && std::fclose(out) != 0) {
+            error = "cannot write " + path;
+            std::remove(path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+public:
+    JpegStripFilter(std::string u) : uri(u) {}
+    // Writes the filtered image to the same output path as ImageFilter::saveImageFile. Returns false and sets getError() on failure.
+    bool run(void) {
+        if (!runPass(false)) {
+            return false;
+        }
+        palette.finalize();
+        return runPass(true);
+    }
+    const std::string &getError(void) const { return error; }
+};
+
+// A scratch file mapped into memory, for rasters too large for the heap. The file is unlinked as soon as it is created, so it goes away with
+// the mapping even if the process dies, and the kernel pages it in and out as the filter walks over it. TMPDIR picks the directory.
+class MappedScratch {
+private:
+    unsigned char *data = nullptr;
+    size_t size = 0;
+
+public:
+    MappedScratch() {}
+    MappedScratch(const MappedScratch &) = delete;
+    MappedScratch &operator=(const MappedScratch &) = delete;
+    ~MappedScratch() {
+        if (data) {
+            munmap(data, size);
+        }
+    }
+    // Returns false, with errno set, if the file cannot be created, sized or mapped.
+    bool map(size_t bytes) {
+        const char *directory = std::getenv("TMPDIR");
+        std::string pattern = std::string(directory && *directory ? directory : "/tmp") + "/imagefilter-XXXXXX";
+        std::vector<char> path(pattern.begin(), pattern.end());
+        path.push_back(0);
+        int fd = mkstemp(path.data());
+        if (fd < 0) {
+            return false;
+        }
+        unlink(path.data());
+        void *mapped = MAP_FAILED;
+        if (ftruncate(fd, bytes) == 0) {
+            mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        data = static_cast<unsigned char *>(mapped);
+        size = bytes;
+        madvise(data, size, MADV_SEQUENTIAL);
+        return true;
+    }
+    unsigned char *bytes(void) const { return data; }
+    // Drops the resident pages of a range that has been dealt with. Their contents stay in the file and are paged back in if touched again.
+    void evict(size_t offset, size_t length) {
+        size_t page = sysconf(_SC_PAGE_SIZE), start = offset / page * page;
+        madvise(data + start, offset + length - start, MADV_DONTNEED);
+    }
+};
+
+static void pngErrorExit(png_structp png, png_const_charp message) {
+    std::string *error = static_cast<std::string *>(png_get_error_ptr(png));
+    *error = message;
+    longjmp(png_jmpbuf(png), 1);
+}
+
+static void pngWarning(png_structp, png_const_charp) {}
+
+// Filters an 8-bit PNG too large for memory. The rows are decoded once into a mapped scratch file; the palette is then built over it and
+// applied to it in tiles of whole rows, since the palette has to see pixels in raster order, and each tile is encoded as soon as it is
+// filtered. Only about one tile of the raster is resident at a time, whatever the image size, and every offset is 64-bit.
+class PngTiledFilter {
+private:
+    std::string uri;
+    std::string error;
+    long width = 0;
+    long height = 0;
+    int channels = 0;
+    size_t rowBytes = 0;
+    MappedScratch scratch;
+    ColorPalette palette;
+
+    ImageView tileView(long firstRow, long rows) const {
+        const Layout layouts[] = {Layout::Gray, Layout::Gray, Layout::RGB, Layout::RGBA};
+        return interleavedView(scratch.bytes() + firstRow * rowBytes, width, rows, channels, rowBytes, layouts[channels - 1]);
+    }
+    bool decode(void) {
+        std::FILE *in = std::fopen(uri.c_str(), "rb");
+        png_structp png = in ? png_create_read_struct(PNG_LIBPNG_VER_STRING, &error, pngErrorExit, pngWarning) : nullptr;
+        png_infop info = png ? png_create_info_struct(png) : nullptr;
+        if (!info) {
+            error = in ? "cannot initialise libpng" : "cannot open " + uri;
+            png_destroy_read_struct(png ? &png : nullptr, nullptr, nullptr);
+            if (in) {
+                std::fclose(in);
+            }
+            return false;
+        }
+        if (setjmp(png_jmpbuf(png))) {
+            png_destroy_read_struct(&png, &info, nullptr);
+            std::fclose(in);
+            return false;
+        }
+        png_init_io(png, in);
+        png_read_info(png, info);
+        if (png_get_bit_depth(png, info) > 8) {
+            png_error(png, "tiled path handles 8-bit PNGs only");
+        }
+        // Same expansions as CImg's load_png: palette to RGB, low bit depths to 8, and a tRNS chunk to an alpha channel.
+        png_set_expand(png);
+        int passes = png_set_interlace_handling(png);
+        png_read_update_info(png, info);
+        width = png_get_image_width(png, info);
+        height = png_get_image_height(png, info);
+        channels = png_get_channels(png, info);
+        rowBytes = png_get_rowbytes(png, info);
+        if (!scratch.map(rowBytes * height)) {
+            error = "cannot map scratch file: " + std::string(std::strerror(errno));
+            png_destroy_read_struct(&png, &info, nullptr);
+            std::fclose(in);
+            return false;
+        }
+        for (int pass = 0; pass < passes; pass++) {
+            for (long y = 0; y < height; y++) {
+                png_read_row(png, scratch.bytes() + y * rowBytes, nullptr);
+            }
+        }
+        png_read_end(png, nullptr);
+        png_destroy_read_struct(&png, &info, nullptr);
+        std::fclose(in);
+        return true;
+    }
+    // Applies the palette row by row as the writer asks for rows, on its threads, and drops each tile from memory once it is written. Opaque
+    // colour images come out of the filter with only the palette's colours, so they are written indexed without scanning the raster first.
+    bool encode(long tileRows) {
+        std::string path = ImageFilter::getFileName(uri, true);
+        ParallelPngWriter writer;
+        PngColorTable table;
+        for (int i = 0; i < 21 && channels == 3; i++) {
+            table.add(PngColorTable::pack(palette.entry(i).getRed(), palette.entry(i).getGreen(), palette.entry(i).getBlue()));
+        }
+        bool indexed = channels == 3;
+        if (!(indexed ? writer.openIndexed(path, width, height, table, false) : writer.open(path, width, height, channels, 8))) {
+            error = "cannot open " + path;
+            return false;
+        }
+        std::atomic<bool> unindexed(false);
+        for (long firstRow = 0; firstRow < height; firstRow += tileRows) {
+            long rows = std::min(tileRows, height - firstRow);
+            bool written = writer.writeRows(rows, [&](long y, unsigned char *row) {
+                const unsigned char *pixels = scratch.bytes() + y * rowBytes;
+                palette.apply(tileView(y, 1));
+                if (!indexed) {
+                    std::memcpy(row, pixels, rowBytes);
+                } else if (!table.indexRow(pixels, pixels + 1, pixels + 2, nullptr, 3, width, row)) {
+                    unindexed = true;
+                }
+            });
+            if (unindexed) {
+                error = "filtered pixel outside the palette in " + uri;
+                return false;
+            }
+            if (!written) {
+                error = "cannot write " + path;
+                return false;
+            }
+            scratch.evict(firstRow * rowBytes, rows * rowBytes);
+        }
+        if (!writer.finish()) {
+            error = "cannot finish " + path;
+            return false;
+        }
+        return true;
+    }
+    // Feeds the scratch file to a PyramidWriter a tile of rows at a time, dropping each tile from memory once it is classified.
+    bool encodePyramid(long tileRows) {
+        std::string path = ImageFilter::getFileName(uri);
+        PyramidWriter<unsigned char> writer(palette, outputFormat == "xyz", outputTileSize);
+        if (!writer.open(path, width, height, channels)) {
+            error = writer.getError();
+            return false;
+        }
+        for (long firstRow = 0; firstRow < height; firstRow += tileRows) {
+            long rows = std::min(tileRows, height - firstRow);
+            if (!writer.writeRows(tileView(firstRow, rows))) {
+                error = writer.getError();
+                return false;
+            }
+            scratch.evict(firstRow * rowBytes, rows * rowBytes);
+        }
+        if (!writer.finish()) {
+            error = writer.getError();
+            return false;
+        }
+        return true;
+    }
+
+public:
+    PngTiledFilter(std::string u) : uri(u) {}
+    // Writes the filtered image to the same output path as ImageFilter::saveImageFile, as a PNG or, with --format dzi or xyz, a tile
+    // pyramid. Returns false and sets getError() on failure.
+    bool run(void) {
+        if (!decode()) {
+            return false;
+        }
+        long tileRows = std::max(1L, tiledTileBytes / (long)rowBytes);
+        for (long firstRow = 0; firstRow < height; firstRow += tileRows) {
+            long rows = std::min(tileRows, height - firstRow);
+            palette.merge(tileView(firstRow, rows));
+            scratch.evict(firstRow * rowBytes, rows * rowBytes);
+        }
+        palette.finalize();
+        return isPyramidFormat(outputFormat) ? encodePyramid(tileRows) : encode(tileRows);
+    }
+    const std::string &getError(void) const { return error; }
+};
+
+// Writes a single-image TIFF, or BigTIFF, with tiles (or strips) on the grid, and with the compression and predictor, of a layout. Tiles are
+// appended in index order as they are finished, already compressed and with their samples in the file's byte order, and the directory and
+// offset tables go at the end once every position is known, so nothing but the tile being written needs to be in memory.
+class TiffWriter {
+private:
+    std::FILE *file = nullptr;
+    bool bigEndian = false;
+    TiffLayout tiff;
+    uint64_t position = 0;
+
+    struct Entry {
+        uint16_t tag;
+        uint16_t type;
+        uint64_t count;
+        std::vector<unsigned char> data;
+    };
+    void append(std::vector<unsigned char> &bytes, uint64_t value, int size) const {
+        for (int i = 0; i < size; i++) {
+            bytes.push_back(value >> (8 * (bigEndian ? size - 1 - i : i)));
+        }
+    }
+    void addEntry(std::vector<Entry> &entries, uint16_t tag, uint16_t type, const std::vector<uint64_t> &values) {
+        Entry entry = {tag, type, values.size(), std::vector<unsigned char>()};
+        for (uint64_t value : values) {
+            append(entry.data, value, type == 3 ? 2 : type == 4 ? 4 : 8);
+        }
+        entries.push_back(entry);
+    }
+    bool put(const std::vector<unsigned char> &bytes) {
+        if (std::fwrite(bytes.data(), 1, bytes.size(), file) != bytes.size()) {
+            return false;
+        }
+        position += bytes.size();
+        return true;
+    }
+
+public:
+    TiffWriter() {}
+    TiffWriter(const TiffWriter &) = delete;
+    TiffWriter &operator=(const TiffWriter &) = delete;
+    ~TiffWriter() {
+        if (file) {
+            std::fclose(file);
+        }
+    }
+    // The filter writes Deflate tiles of host-order samples; the other compressions, predictors and byte orders are for --verify.
+    bool open(const std::string &path, const TiffLayout &layout, bool bigEndianFile = hostIsBigEndian()) {
+        tiff = layout;
+        tiff.offsets.clear();
+        tiff.byteCounts.clear();
+        bigEndian = bigEndianFile;
+        file = std::fopen(path.c_str(), "wb");
+        std::vector<unsigned char> header;
+        header.push_back(bigEndian ? 'M' : 'I');
+        header.push_back(header[0]);
+        append(header, tiff.bigTiff ? 43 : 42, 2);
+        if (tiff.bigTiff) {
+            append(header, 8, 2);
+            append(header, 0, 2);
+        }
+        // The directory offset is patched in by finish().
+        append(header, 0, tiff.bigTiff ? 8 : 4);
+        return file && put(header);
+    }
+    bool writeTile(const std::vector<unsigned char> &compressed) {
+        tiff.offsets.push_back(position);
+        tiff.byteCounts.push_back(compressed.size());
+        return put(compressed);
+    }
+    // Writes the directory and closes the file. Fails if a classic TIFF has grown past 4 GB.
+    bool finish(void) {
+        uint16_t offsetType = tiff.bigTiff ? 16 : 4;
+        std::vector<uint64_t> bits(tiff.channels, tiff.bitsPerSample);
+        std::vector<Entry> entries;
+        addEntry(entries, 256, 4, {(uint64_t)tiff.width});
+        addEntry(entries, 257, 4, {(uint64_t)tiff.height});
+        addEntry(entries, 258, 3, bits);
+        addEntry(entries, 259, 3, {(uint64_t)tiff.compression});
+        addEntry(entries, 262, 3, {tiff.channels < 3 ? 1UL : 2UL});
+        if (!tiff.tiled) {
+            addEntry(entries, 273, offsetType, tiff.offsets);
+        }
+        addEntry(entries, 277, 3, {(uint64_t)tiff.channels});
+        if (!tiff.tiled) {
+            addEntry(entries, 278, 4, {(uint64_t)tiff.tileHeight});
+            addEntry(entries, 279, offsetType, tiff.byteCounts);
+        }
+        addEntry(entries, 284, 3, {1});
+        if (tiff.predictor != 1) {
+            addEntry(entries, 317, 3, {(uint64_t)tiff.predictor});
+        }
+        if (tiff.tiled) {
+            addEntry(entries, 322, 4, {(uint64_t)tiff.tileWidth});
+            addEntry(entries, 323, 4, {(uint64_t)tiff.tileHeight});
+            addEntry(entries, 324, offsetType, tiff.offsets);
+            addEntry(entries, 325, offsetType, tiff.byteCounts);
+        }
+        if (tiff.channels == 2 || tiff.channels == 4) {
+            // Unassociated alpha.
+            addEntry(entries, 338, 3, {2});
+        }
+        int countSize = tiff.bigTiff ? 8 : 2, entrySize = tiff.bigTiff ? 20 : 12, inlineSize = tiff.bigTiff ? 8 : 4;
+        std::vector<unsigned char> padding((8 - position % 8) % 8, 0), directory, overflow;
+        uint64_t directoryOffset = position + padding.size();
+        uint64_t overflowOffset = directoryOffset + countSize + entries.size() * entrySize + inlineSize;
+        append(directory, entries.size(), countSize);
+        for (const Entry &entry : entries) {
+            append(directory, entry.tag, 2);
+            append(directory, entry.type, 2);
+            append(directory, entry.count, inlineSize);
+            if (entry.data.size() <= (size_t)inlineSize) {
+                directory.insert(directory.end(), entry.data.begin(), entry.data.end());
+                directory.resize(directory.size() + inlineSize - entry.data.size(), 0);
+            } else {
+                append(directory, overflowOffset + overflow.size(), inlineSize);
+                overflow.insert(overflow.end(), entry.data.begin(), entry.data.end());
+                overflow.resize((overflow.size() + 1) / 2 * 2, 0);
+            }
+        }
+        append(directory, 0, inlineSize);
+        if (!tiff.bigTiff && overflowOffset + overflow.size() > 0xFFFFFFFFUL) {
+            return false;
+        }
+        std::vector<unsigned char> patch;
+        append(patch, directoryOffset, inlineSize);
+        bool written = put(padding) && put(directory) && put(overflow) && std::fseek(file, tiff.bigTiff ? 8 : 4, SEEK_SET) == 0 &&
+                       std::fwrite(patch.data(), 1, patch.size(), file) == patch.size();
+        bool closed = std::fclose(file) == 0;
+        file = nullptr;
+        return written && closed;
+    }
+};
+
+// Filters a tiled (or stripped) TIFF without ever holding the full raster, writing a Deflate TIFF on the same tile grid. Tiles are decoded in
+// batches of whole tile rows, in parallel. The palette still sees pixels in raster order, which its running averages depend on: each row of
+// a batch is merged as one segment per tile, left to right. Applying and compressing are independent per tile and run in parallel too.
+template <typename T>
+class TiffTiledFilter {
+private:
+    std::string uri;
+    std::string error;
+    int threads;
+    TiffReader reader;
+    BasicColorPalette<T> palette;
+
+    BasicImageView<T> tileView(std::vector<unsigned char> &pixels, long rows, long columns) const {
+        const TiffLayout &tiff = reader.layout();
+        const Layout layouts[] = {Layout::Gray, Layout::Gray, Layout::RGB, Layout::RGBA};
+        return interleavedView(reinterpret_cast<T *>(pixels.data()), columns, rows, tiff.channels, tiff.tileRowBytes(),
+                               layouts[tiff.channels - 1]);
+    }
+    // Decodes tiles [first, first + count) in parallel. Returns false and sets error if any of them fails.
+    bool readBatch(long first, long count, std::vector<std::vector<unsigned char>> &tiles) {
+        std::vector<std::string> errors(count);
+        tiles.resize(count);
+        parallelFor(count, threads, [&](long i) { reader.readTile(first + i, tiles[i], errors[i]); });
+        for (const std::string &message : errors) {
+            if (!message.empty()) {
+                error = message;
+                return false;
+            }
+        }
+        return true;
+    }
+    // Tile rows per batch: enough tiles to keep every thread busy, within tiffBatchBytes unless a single tile row is larger.
+    long batchRows(void) const {
+        const TiffLayout &tiff = reader.layout();
+        long tileRowBytes = tiff.tilesAcross() * tiff.tileRowBytes() * tiff.tileHeight;
+        long wanted = (threads + tiff.tilesAcross() - 1) / tiff.tilesAcross();
+        return std::max(1L, std::min(wanted, tiffBatchBytes / std::max(1L, tileRowBytes)));
+    }
+
+    // Decodes the tiles a batch at a time, as run does, and hands each tile row to a PyramidWriter as whole image rows.
+    bool writePyramid(void) {
+        const TiffLayout &tiff = reader.layout();
+        const Layout layouts[] = {Layout::Gray, Layout::Gray, Layout::RGB, Layout::RGBA};
+        std::string path = ImageFilter::getFileName(uri);
+        PyramidWriter<T> writer(palette, outputFormat == "xyz", outputTileSize, threads);
+        if (!writer.open(path, tiff.width, tiff.height, tiff.channels)) {
+            error = writer.getError();
+            return false;
+        }
+        long across = tiff.tilesAcross(), down = tiff.tilesDown(), step = batchRows();
+        std::vector<std::vector<unsigned char>> tiles;
+        std::vector<T> band;
+        for (long tileRow = 0; tileRow < down; tileRow += step) {
+            long rows = std::min(step, down - tileRow);
+            if (!readBatch(tileRow * across, rows * across, tiles)) {
+                return false;
+            }
+            for (long r = 0; r < rows; r++) {
+                long top = (tileRow + r) * tiff.tileHeight, height = std::min(tiff.tileHeight, tiff.height - top);
+                band.resize(height * tiff.width * tiff.channels);
+                for (long x = 0; x < across; x++) {
+                    long columns = std::min(tiff.tileWidth, tiff.width - x * tiff.tileWidth);
+                    for (long y = 0; y < height; y++) {
+                        const unsigned char *in = tiles[r * across + x].data() + y * tiff.tileRowBytes();
+                        std::memcpy(&band[(y * tiff.width + x * tiff.tileWidth) * tiff.channels], in, columns * tiff.channels * sizeof(T));
+                    }
+                }
+                if (!writer.writeRows(interleavedView(band.data(), tiff.width, height, tiff.channels, 0, layouts[tiff.channels - 1]))) {
+                    error = writer.getError();
+                    return false;
+                }
+            }
+        }
+        if (!writer.finish()) {
+            error = writer.getError();
+            return false;
+        }
+        return true;
+    }
+
+public:
+    TiffTiledFilter(std::string u, int workers = std::max(1u, std::thread::hardware_concurrency())) : uri(u), threads(workers) {}
+    // Opens the file and builds the palette in one pass over it, without applying it. run() starts with this; the tile server calls it alone
+    // and then renders regions with filterRegion.
+    bool buildPalette(void) {
+        if (!reader.open(uri, error)) {
+            return false;
+        }
+        const TiffLayout &tiff = reader.layout();
+        long across = tiff.tilesAcross(), down = tiff.tilesDown(), step = batchRows();
+        std::vector<std::vector<unsigned char>> tiles;
+        for (long tileRow = 0; tileRow < down; tileRow += step) {
+            long rows = std::min(step, down - tileRow);
+            if (!readBatch(tileRow * across, rows * across, tiles)) {
+                return false;
+            }
+            for (long r = 0; r < rows; r++) {
+                long top = (tileRow + r) * tiff.tileHeight, height = std::min(tiff.tileHeight, tiff.height - top);
+                for (long y = 0; y < height; y++) {
+                    for (long x = 0; x < across; x++) {
+                        BasicImageView<T> row = tileView(tiles[r * across + x], 1, std::min(tiff.tileWidth, tiff.width - x * tiff.tileWidth));
+                        row.data = reinterpret_cast<T *>(reinterpret_cast<unsigned char *>(row.data) + y * row.rowStride);
+                        palette.merge(row);
+                    }
+                }
+            }
+        }
+        palette.finalize();
+        return true;
+    }
+    long getWidth(void) const { return reader.layout().width; }
+    long getHeight(void) const { return reader.layout().height; }
+    int getChannels(void) const { return reader.layout().channels; }
+    // Decodes only the tiles the region of `out`'s size at (x, y) overlaps and writes the region into `out`, filtered. `out` must have the
+    // file's channel count and lie inside the image. Call after buildPalette.
+    bool filterRegion(long x, long y, CImg<T> &out) {
+        const TiffLayout &tiff = reader.layout();
+        long w = out.width(), h = out.height();
+        if (out.spectrum() != tiff.channels || out.depth() != 1 || x < 0 || y < 0 || x + w > tiff.width || y + h > tiff.height) {
+            error = "region outside the image";
+            return false;
+        }
+        std::vector<unsigned char> pixels;
+        for (long row = y / tiff.tileHeight; row * tiff.tileHeight < y + h; row++) {
+            for (long column = x / tiff.tileWidth; column * tiff.tileWidth < x + w; column++) {
+                if (!reader.readTile(row * tiff.tilesAcross() + column, pixels, error)) {
+                    return false;
+                }
+                long x0 = column * tiff.tileWidth, y0 = row * tiff.tileHeight;
+                long left = std::max(x, x0), right = std::min(x + w, x0 + tiff.tileWidth), bottom = std::min(y + h, y0 + tiff.tileHeight);
+                for (long py = std::max(y, y0); py < bottom; py++) {
+                    const T *in = reinterpret_cast<const T *>(pixels.data() + (py - y0) * tiff.tileRowBytes());
+                    for (long px = left; px < right; px++) {
+                        for (int c = 0; c < tiff.channels; c++) {
+                            out(px - x, py - y, c) = in[(px - x0) * tiff.channels + c];
+                        }
+                    }
+                }
+            }
+        }
+        palette.apply(planarView(out.data(), w, h, out.spectrum()));
+        return true;
+    }
+    // Writes the filtered image to the same output path as ImageFilter::saveImageFile: a TIFF, or a tile pyramid with --format dzi or xyz.
+    // Returns false and sets getError() on failure.
+    bool run(void) {
+        if (!buildPalette()) {
+            return false;
+        }
+        if (isPyramidFormat(outputFormat)) {
+            return writePyramid();
+        }
+        const TiffLayout &tiff = reader.layout();
+        long across = tiff.tilesAcross(), down = tiff.tilesDown(), step = batchRows();
+        std::vector<std::vector<unsigned char>> tiles;
+        TiffLayout output = tiff;
+        output.compression = 8;
+        output.predictor = 1;
+        output.bigTiff = tiff.bigTiff || (long)tiff.tileRowBytes() * tiff.tileHeight * across * down > (3L << 30);
+        TiffWriter writer;
+        if (!writer.open(ImageFilter::getFileName(uri, true), output)) {
+            error = "cannot write " + ImageFilter::getFileName(uri, true);
+            return false;
+        }
+        std::vector<std::vector<unsigned char>> compressed;
+        for (long tileRow = 0; tileRow < down; tileRow += step) {
+            long count = std::min(step, down - tileRow) * across, first = tileRow * across;
+            if (!readBatch(first, count, tiles)) {
+                return false;
+            }
+            compressed.assign(count, std::vector<unsigned char>());
+            std::vector<char> deflated(count, 0);
+            parallelFor(count, threads, [&](long i) {
+                palette.apply(tileView(tiles[i], tiff.storedRows(first + i), tiff.tileWidth));
+                uLongf size = compressBound(tiles[i].size());
+                compressed[i].resize(size);
+                deflated[i] = compress2(compressed[i].data(), &size, tiles[i].data(), tiles[i].size(), Z_DEFAULT_COMPRESSION) == Z_OK;
+                compressed[i].resize(size);
+                std::vector<unsigned char>().swap(tiles[i]);
+            });
+            for (long i = 0; i < count; i++) {
+                if (!deflated[i]) {
+                    error = "cannot compress TIFF tile " + std::to_string(first + i);
+                    return false;
+                }
+                if (!writer.writeTile(compressed[i])) {
+                    error = "cannot write " + ImageFilter::getFileName(uri, true);
+                    return false;
+                }
+            }
+        }
+        if (!writer.finish()) {
+            error = "cannot finish " + ImageFilter::getFileName(uri, true);
+            return false;
+        }
+        return true;
+    }
+    const std::string &getError(void) const { return error; }
+};
+
+// Filters a TIFF with the kernels for its sample size. Returns false and sets error on failure.
+static bool filterTiff(const std::string &uri, int bytesPerSample, std::string &error) {
+    if (bytesPerSample == 2) {
+        TiffTiledFilter<unsigned short> filter(uri);
+        bool done = filter.run();
+        error = filter.getError();
+        return done;
+    }
+    TiffTiledFilter<unsigned char> filter(uri);
+    bool done = filter.run();
+    error = filter.getError();
+    return done;
+}
+
+// How the scheduler runs a job. Jobs that would not fit in the budget stream through JpegStripFilter or PngTiledFilter when the format allows
+// it, and otherwise run alone once everything else has drained. Those two write their input's format, so with --format such jobs run alone
+// too, except that PngTiledFilter also writes tile pyramids; with --thumbnails they always run in memory. TIFFs are always filtered tile by
+// tile, into a TIFF or a pyramid, as Tiled or Exclusive jobs, and cannot be thumbnailed.
+enum class JobMode { InMemory, Strip, Tiled, Exclusive };
+
+struct FilterJob {
+    std::string uri;
+    JobMode mode;
+    long reservedBytes;
+    int bytesPerSample;
+    // TIFFs always go through TiffTiledFilter, whatever the mode; the mode only decides whether they run alongside other jobs.
+    bool tiff;
+};
+
+// Runs filter jobs on a fixed pool of worker threads, admitting them in submission order only while the sum of their estimated memory stays
+// under the budget. A job that does not fit holds back everything behind it, so a large image cannot be starved by a stream of small ones.
+class JobScheduler {
+private:
+    long budget;
+    long reservedBytes = 0;
+    // The part of reservedBytes held outside jobs, through reserve().
+    long heldBytes = 0;
+    int running = 0;
+    bool closing = false;
+    std::deque<FilterJob> queue;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::vector<std::thread> workers;
+    std::ostream &report;
+    BufferPool *pool;
+
+    bool admissible(const FilterJob &job) const {
+        if (job.mode == JobMode::Exclusive) {
+            return running == 0;
+        }
+        return reservedBytes + job.reservedBytes <= budget;
+    }
+    void runJob(const FilterJob &job, std::string &outcome) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        try {
+            std::string error;
+            if (job.tiff && !thumbnailSizes.empty()) {
+                outcome = "failed " + job.uri + ": thumbnails are made from images decoded into memory, and TIFFs are filtered tile by tile";
+                return;
+            } else if (job.tiff) {
+                if (!filterTiff(job.uri, job.bytesPerSample, error)) {
+                    outcome = "failed " + job.uri + ": " + error;
+                    return;
+                }
+            } else if (job.mode == JobMode::Strip) {
+                JpegStripFilter filter(job.uri);
+                if (!filter.run()) {
+                    outcome = "failed " + job.uri + ": " + filter.getError();
+                    return;
+                }
+            } else if (job.mode == JobMode::Tiled) {
+                PngTiledFilter filter(job.uri);
+                if (!filter.run()) {
+                    outcome = "failed " + job.uri + ": " + filter.getError();
+                    return;
+                }
+            } else {
+                filterFile(job.uri, job.bytesPerSample, pool);
+            }
+        } catch (const std::exception &e) {
+            outcome = "failed " + job.uri + ": " + e.what();
+            return;
+        }
+        const char *modes[] = {"in-memory", "strip", "tiled", "exclusive"};
+        std::ostringstream line;
+        line << "done " << job.uri << " " << modes[(int)job.mode] << " " << std::fixed << std::setprecision(1) << secondsSince(start) * 1000
+             << " ms";
+        outcome = line.str();
+    }
+    void work(void) {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            changed.wait(guard, [this] { return (closing && queue.empty()) || (!queue.empty() && admissible(queue.front())); });
+            if (queue.empty()) {
+                return;
+            }
+            FilterJob job = queue.front();
+            queue.pop_front();
+            reservedBytes += job.reservedBytes;
+            running++;
+            guard.unlock();
+            std::string outcome;
+            runJob(job, outcome);
+            guard.lock();
+            report << outcome << std::endl;
+            reservedBytes -= job.reservedBytes;
+            running--;
+            changed.notify_all();
+        }
+    }
+
+public:
+    JobScheduler(int threads, long budgetBytes, std::ostream &out, BufferPool *bufferPool) : budget(budgetBytes), report(out), pool(bufferPool) {
+        for (int i = 0; i < threads; i++) {
+            workers.push_back(std::thread(&JobScheduler::work, this));
+        }
+    }
+    ~JobScheduler() { finish(); }
+    // Prints a line to the report without interleaving it with the workers' lines.
+    void print(const std::string &line) {
+        std::lock_guard<std::mutex> guard(lock);
+        report << line << std::endl;
+    }
+    // Plans the job from its header, against the budget that memory held through reserve() leaves, and queues it. Never blocks on
+    // admission.
+    void submit(const std::string &uri) {
+        ImageHeader header = readImageHeader(uri);
+        long available;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            available = budget - heldBytes;
+        }
+        FilterJob job = {uri, JobMode::Exclusive, budget, header.bytesPerSample, header.tiff};
+        if (header.tiff) {
+            if (header.known && estimateTiffBytes(header) <= available) {
+                job.mode = JobMode::Tiled;
+                job.reservedBytes = estimateTiffBytes(header);
+            }
+        } else if (header.known && estimateInMemoryBytes(header) <= available) {
+            job.mode = JobMode::InMemory;
+            job.reservedBytes = estimateInMemoryBytes(header);
+        } else if (outputFormat.empty() && thumbnailSizes.empty() && header.jpeg && header.sequential &&
+                   (header.channels == 3 || header.channels == 1) && estimateStripBytes(header) <= available) {
+            job.mode = JobMode::Strip;
+            job.reservedBytes = estimateStripBytes(header);
+        } else if ((outputFormat.empty() || isPyramidFormat(outputFormat)) && thumbnailSizes.empty() && header.png &&
+                   header.bytesPerSample == 1 && estimateTiledBytes(header) <= available) {
+            job.mode = JobMode::Tiled;
+            job.reservedBytes = estimateTiledBytes(header);
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(job);
+        changed.notify_all();
+    }
+    // Holds bytes of the budget for memory that outlives any one job, such as an image the tile server keeps decoded, waiting for running jobs
+    // to free enough of it. Returns false at once if the bytes could never fit beside what is already held this way.
+    bool reserve(long bytes) {
+        std::unique_lock<std::mutex> guard(lock);
+        if (heldBytes + bytes > budget) {
+            return false;
+        }
+        heldBytes += bytes;
+        changed.wait(guard, [&] { return reservedBytes + bytes <= budget; });
+        reservedBytes += bytes;
+        return true;
+    }
+    void release(long bytes) {
+        std::lock_guard<std::mutex> guard(lock);
+        heldBytes -= bytes;
+        reservedBytes -= bytes;
+        changed.notify_all();
+    }
+    // Waits for every queued job to complete and stops the workers.
+    void finish(void) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            closing = true;
+            changed.notify_all();
+        }
+        for (std::thread &worker : workers) {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+    }
+};
+
+// Serves square tiles of filtered images on demand, for zoomable previews. Opening an image builds its palette once and remaps nothing:
+// each tile is filtered from the unfiltered source when it is first asked for, encoded as PNG and kept in an LRU cache whose size in bytes is
+// bounded across all open images. TIFFs are read through TiffTiledFilter, which decodes only the source tiles a request overlaps, and IFP
+// files, stored already filtered, need no palette pass at all; other formats are decoded into memory once, and in the daemon that memory
+// counts against --memory-budget until the image is closed. Not thread-safe.
+class TileServer {
+private:
+    // Filters the region (x, y, width, height) of an open image and encodes it as PNG.
+    typedef std::function<bool(long, long, long, long, std::vector<unsigned char> &)> Renderer;
+    struct Session {
+        long width;
+        long height;
+        Renderer render;
+        // Bytes of the scheduler's budget held while the image stays open.
+        long heldBytes;
+    };
+    typedef std::list<std::pair<std::string, std::vector<unsigned char>>> TileList;
+    long tileSize;
+    long cacheLimit;
+    long cachedBytes = 0;
+    JobScheduler *scheduler;
+    std::map<std::string, Session> sessions;
+    // Cached tiles, most recently used first, and each key's place in the list. Keys are the URI, a newline, then the tile's column and row.
+    TileList recent;
+    std::unordered_map<std::string, TileList::iterator> cached;
+
+    template <typename T, typename Source>
+    static Renderer regionRenderer(std::shared_ptr<Source> source, int channels) {
+        return [source, channels](long x, long y, long w, long h, std::vector<unsigned char> &png) {
+            CImg<T> tile(w, h, 1, channels);
+            return source->filterRegion(x, y, tile) && encodeTilePng(tile, png);
+        };
+    }
+    template <typename T>
+    bool openAs(const std::string &uri, const ImageHeader &header, Session &session, std::string &error) {
+        if (header.ifp) {
+            std::shared_ptr<IfpReader> reader = std::make_shared<IfpReader>();
+            if (!reader->open(uri)) {
+                error = "cannot read IFP file " + uri;
+                return false;
+            }
+            int channels = reader->getChannels();
+            // The file is stored filtered, so tiles are decoded as they are.
+            Renderer render = [reader, channels](long x, long y, long w, long h, std::vector<unsigned char> &png) {
+                CImg<T> tile(w, h, 1, channels);
+                return reader->read(x, y, tile) && encodeTilePng(tile, png);
+            };
+            session = {reader->getWidth(), reader->getHeight(), render, 0};
+        } else if (header.tiff) {
+            std::shared_ptr<TiffTiledFilter<T>> filter = std::make_shared<TiffTiledFilter<T>>(uri);
+            if (!filter->buildPalette()) {
+                error = filter->getError();
+                return false;
+            }
+            session = {filter->getWidth(), filter->getHeight(), regionRenderer<T>(filter, filter->getChannels()), 0};
+        } else {
+            // Decoded whole and kept for the session, so held against the budget like a job. Formats the header does not describe are charged
+            // once decoded.
+            long held = header.known ? estimateInMemoryBytes(header) : 0;
+            if (!hold(uri, held, error)) {
+                return false;
+            }
+            std::shared_ptr<BasicImageFilter<T>> filter;
+            try {
+                filter = std::make_shared<BasicImageFilter<T>>(uri);
+            } catch (...) {
+                unhold(held);
+                throw;
+            }
+            const CImg<T> &image = filter->getImage();
+            long decoded = image.size() * sizeof(T);
+            if (decoded > held && !hold(uri, decoded - held, error)) {
+                unhold(held);
+                return false;
+            }
+            session = {image.width(), image.height(), regionRenderer<T>(filter, image.spectrum()), std::max(held, decoded)};
+        }
+        return true;
+    }
+    bool hold(const std::string &uri, long bytes, std::string &error) {
+        if (scheduler && !scheduler->reserve(bytes)) {
+            error = uri + " would stay decoded in memory while open, and needs more than the memory budget leaves free";
+            return false;
+        }
+        return true;
+    }
+    void unhold(long bytes) {
+        if (scheduler) {
+            scheduler->release(bytes);
+        }
+    }
+    void remember(const std::string &key, const std::vector<unsigned char> &png) {
+        if ((long)png.size() > cacheLimit) {
+            return;
+        }
+        recent.emplace_front(key, png);
+        cached[key] = recent.begin();
+        cachedBytes += png.size();
+        while (cachedBytes > cacheLimit) {
+            cachedBytes -= recent.back().second.size();
+            cached.erase(recent.back().first);
+            recent.pop_back();
+        }
+    }
+
+public:
+    // Images decoded into memory hold their size against the scheduler's budget, if given, while they stay open.
+    TileServer(long size = 256, long cacheBytes = 64L << 20, JobScheduler *jobs = nullptr)
+        : tileSize(std::max(1L, size)), cacheLimit(cacheBytes), scheduler(jobs) {}
+    TileServer(const TileServer &) = delete;
+    TileServer &operator=(const TileServer &) = delete;
+    ~TileServer() {
+        for (std::map<std::string, Session>::value_type &session : sessions) {
+            unhold(session.second.heldBytes);
+        }
+    }
+    long getTileSize(void) const { return tileSize; }
+    // Builds the image's palette, unless it is already open. This is the one pass over the whole source; tiles only ever touch their own
+    // region. Returns false and sets error if the image cannot be read.
+    bool open(const std::string &uri, std::string &error) {
+        if (sessions.count(uri)) {
+            return true;
+        }
+        Session session;
+        try {
+            ImageHeader header = readImageHeader(uri);
+            bool opened = header.bytesPerSample == 4   ? openAs<float>(uri, header, session, error)
+                          : header.bytesPerSample == 2 ? openAs<unsigned short>(uri, header, session, error)
+                                                       : openAs<unsigned char>(uri, header, session, error);
+            if (!opened) {
+                return false;
+            }
+        } catch (const std::exception &e) {
+            error = e.what();
+            return false;
+        }
+        sessions[uri] = session;
+        return true;
+    }
+    // The image's size, once open.
+    bool size(const std::string &uri, long &width, long &height) const {
+        std::map<std::string, Session>::const_iterator found = sessions.find(uri);
+        if (found == sessions.end()) {
+            return false;
+        }
+        width = found->second.width;
+        height = found->second.height;
+        return true;
+    }
+    // Drops the image and its cached tiles.
+    void close(const std::string &uri) {
+        std::map<std::string, Session>::iterator found = sessions.find(uri);
+        if (found != sessions.end()) {
+            unhold(found->second.heldBytes);
+            sessions.erase(found);
+        }
+        for (TileList::iterator entry = recent.begin(); entry != recent.end();) {
+            if (entry->first.compare(0, uri.size() + 1, uri + '\n') == 0) {
+                cachedBytes -= entry->second.size();
+                cached.erase(entry->first);
+                entry = recent.erase(entry);
+            } else {
+                entry++;
+            }
+        }
+    }
+    // Sets png to the PNG of the filtered tile at (column, row) of the tile grid, opening the image first if need be. Tiles on the right and
+    // bottom edges are cut to the image. hit says whether the tile came from the cache. Returns false and sets error on failure.
+    bool tile(const std::string &uri, long column, long row, std::vector<unsigned char> &png, bool &hit, std::string &error) {
+        std::string key = uri + '\n' + std::to_string(column) + ' ' + std::to_string(row);
+        std::unordered_map<std::string, TileList::iterator>::iterator found = cached.find(key);
+        hit = found != cached.end();
+        if (hit) {
+            recent.splice(recent.begin(), recent, found->second);
+            png = found->second->second;
+            return true;
+        }
+        if (!open(uri, error)) {
+            return false;
+        }
+        const Session &session = sessions[uri];
+        long x = column * tileSize, y = row * tileSize;
+        if (column < 0 || row < 0 || x >= session.width || y >= session.height) {
+            error = "tile outside the image";
+            return false;
+        }
+        try {
+            if (!session.render(x, y, std::min(tileSize, session.width - x), std::min(tileSize, session.height - y), png)) {
+                error = "cannot render tile";
+                return false;
+            }
+        } catch (const std::exception &e) {
+            error = e.what();
+            return false;
+        }
+        remember(key, png);
+        return true;
+    }
+};
+
+// Parses a comma-separated list of thumbnail sizes, such as "256,512,1024". Returns false, with sizes unchanged, unless every entry is a
+// positive number.
+static bool parseSizes(const std::string &text, std::vector<int> &sizes) {
+    std::vector<int> parsed;
+    std::istringstream words(text);
+    std::string word;
+    while (std::getline(words, word, ',')) {
+        char *end = nullptr;
+        long size = std::strtol(word.c_str(), &end, 10);
+        if (word.empty() || *end || size <= 0 || size > std::numeric_limits<int>::max()) {
+            return false;
+        }
+        parsed.push_back(size);
+    }
+    if (parsed.empty()) {
+        return false;
+    }
+    sizes = parsed;
+    return true;
+}
+
+// Checks the output options that cannot be combined, printing why. Tile pyramids already hold every smaller size of the image, and are
+// written from the unfiltered image, so they cannot be thumbnails.
+static bool checkOutputOptions(void) {
+    if (!thumbnailSizes.empty() && isPyramidFormat(outputFormat)) {
+        std::cout << "--thumbnails cannot be combined with --format " << outputFormat << ": a tile pyramid already holds every smaller size"
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Parses a byte count with an optional K, M or G suffix. Returns false for anything else, including negative counts.
+static bool parseByteCount(const std::string &text, long &bytes) {
+    static const char units[] = "KMG";
+    char *end = nullptr;
+    double value = std::strtod(text.c_str(), &end);
+    if (end == text.c_str()) {
+        return false;
+    }
+    if (*end) {
+        const char *unit = std::strchr(units, std::toupper(*end));
+        if (!unit || end[1]) {
+            return false;
+        }
+        value *= std::pow(1024.0, unit - units + 1);
+    }
+    if (!(value >= 0) || value > (double)std::numeric_limits<long>::max()) {
+        return false;
+    }
+    bytes = (long)value;
+    return true;
+}
+
+// Reads the byte count given to a size option, printing a usage error if it is not one.
+static bool parseByteCountOption(const std::string &option, const std::string &text, long &bytes) {
+    if (!parseByteCount(text, bytes)) {
+        std::cout << option << " needs a byte count such as 512M, with an optional K, M or G suffix, not '" << text << "'" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Handles a daemon line that is a tile server command rather than an image path, and prints its reply. Returns false for an image path.
+//   open PATH               builds the image's palette ahead of its first tile; replies "opened PATH WIDTHxHEIGHT TIME ms"
+//   tile PATH COLUMN ROW    writes the filtered tile to output/filtered-NAME_tiles/COLUMN_ROW.png, NAME being the file name without its
+//                           extension; replies "tile PATH COLUMN ROW TILE-PATH hit|miss TIME ms"
+//   close PATH              drops the image and its cached tiles
+// Failures reply "failed PATH: reason", like jobs.
+static bool serveTileCommand(TileServer &server, JobScheduler &scheduler, const std::string &line) {
+    size_t space = line.find(' ');
+    std::string command = line.substr(0, space), uri, error;
+    if (space == std::string::npos || (command != "open" && command != "tile" && command != "close")) {
+        return false;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::ostringstream reply;
+    uri = line.substr(space + 1);
+    if (command == "close") {
+        server.close(uri);
+        return true;
+    }
+    long column = 0, row = 0, width = 0, height = 0;
+    if (command == "tile") {
+        // The path may contain spaces; the column and row are the last two words.
+        size_t rowSpace = uri.rfind(' '), columnSpace = rowSpace == std::string::npos || !rowSpace ? std::string::npos : uri.rfind(' ', rowSpace - 1);
+        std::string columnText, rowText;
+        char *columnEnd = nullptr, *rowEnd = nullptr;
+        if (columnSpace != std::string::npos) {
+            columnText = uri.substr(columnSpace + 1, rowSpace - columnSpace - 1);
+            rowText = uri.substr(rowSpace + 1);
+            column = std::strtol(columnText.c_str(), &columnEnd, 10);
+            row = std::strtol(rowText.c_str(), &rowEnd, 10);
+        }
+        if (columnText.empty() || rowText.empty() || *columnEnd || *rowEnd) {
+            scheduler.print("failed " + uri + ": tile needs a column and a row");
+            return true;
+        }
+        uri.erase(columnSpace);
+    }
+    if (command == "open") {
+        if (!server.open(uri, error)) {
+            scheduler.print("failed " + uri + ": " + error);
+            return true;
+        }
+        server.size(uri, width, height);
+        reply << "opened " << uri << " " << width << "x" << height;
+    } else {
+        std::vector<unsigned char> png;
+        bool hit = false;
+        std::string name = ImageFilter::getFileName(uri, true), directory = name.substr(0, name.rfind('.')) + "_tiles";
+        std::string path = directory + "/" + std::to_string(column) + "_" + std::to_string(row) + ".png";
+        if (!server.tile(uri, column, row, png, hit, error)) {
+            scheduler.print("failed " + uri + ": " + error);
+            return true;
+        }
+        mkdir(directory.c_str(), 0777);
+        std::FILE *file = std::fopen(path.c_str(), "wb");
+        bool written = file && std::fwrite(png.data(), 1, png.size(), file) == png.size();
+        if (!file || std::fclose(file) != 0 || !written) {
+            scheduler.print("failed " + uri + ": cannot write " + path);
+            return true;
+        }
+        reply << "tile " << uri << " " << column << " " << row << " " << path << " " << (hit ? "hit" : "miss");
+    }
+    reply << " " << std::fixed << std::setprecision(1) << secondsSince(start) * 1000 << " ms";
+    scheduler.print(reply.str());
+    return true;
+}
+
+// Batch and daemon modes:
+//   ./main --batch [--jobs N] [--memory-budget SIZE] [--buffer-pool SIZE] [--huge-pages] [--png-level 0-9] [--format EXT]
+//           [--webp-method 0-6] [--tile-size N] [--thumbnails SIZE,...] images...
+//   ./main --daemon [same options] [--tile-cache SIZE]    (reads one image path or tile command per line on stdin)
+// The budget defaults to half of physical memory and the worker count to the number of hardware threads. The buffer pool keeps up to a
+// quarter of the budget in idle image buffers between jobs; 0 disables it. Each finished job prints one line. Tile commands (see
+// serveTileCommand) are answered on the input thread as they arrive, alongside the jobs. --tile-size, 256 by default, sets the size of
+// pyramid tiles and served tiles; the cache of encoded tiles holds 64 MB unless told otherwise.
+static int schedulerMain(int argc, char *argv[]) {
+    bool daemon = std::string(argv[1]) == "--daemon";
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    long budget = physicalMemoryBytes() / 2;
+    long poolBytes = -1;
+    bool hugePages = false;
+    long tileCache = 64L << 20;
+    std::vector<std::string> uris;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--jobs" && i + 1 < argc) {
+            threads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--memory-budget" && i + 1 < argc) {
+            if (!parseByteCountOption(arg, argv[++i], budget)) {
+                return 1;
+            }
+        } else if (arg == "--buffer-pool" && i + 1 < argc) {
+            if (!parseByteCountOption(arg, argv[++i], poolBytes)) {
+                return 1;
+            }
+        } else if (arg == "--huge-pages") {
+            hugePages = true;
+        } else if (arg == "--png-level" && i + 1 < argc) {
+            pngCompressionLevel = std::max(0, std::min(9, std::atoi(argv[++i])));
+        } else if (arg == "--format" && i + 1 < argc) {
+            outputFormat = argv[++i];
+        } else if (arg == "--webp-method" && i + 1 < argc) {
+            webpMethod = std::max(0, std::min(6, std::atoi(argv[++i])));
+        } else if (arg == "--tile-size" && i + 1 < argc) {
+            outputTileSize = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--thumbnails" && i + 1 < argc) {
+            if (!parseSizes(argv[++i], thumbnailSizes)) {
+                std::cout << "--thumbnails needs a comma-separated list of positive sizes, not '" << argv[i] << "'" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--tile-cache" && i + 1 < argc) {
+            if (!parseByteCountOption(arg, argv[++i], tileCache)) {
+                return 1;
+            }
+        } else {
+            uris.push_back(arg);
+        }
+    }
+    if (!checkOutputOptions()) {
+        return 1;
+    }
+    BufferPool pool(poolBytes < 0 ? budget / 4 : poolBytes, hugePages);
+    JobScheduler scheduler(threads, budget, std::cout, poolBytes == 0 ? nullptr : &pool);
+    for (const std::string &uri : uris) {
+        scheduler.submit(uri);
+    }
+    TileServer tiles(outputTileSize, tileCache, &scheduler);
+    std::string line;
+    while (daemon && std::getline(std::cin, line)) {
+        if (!line.empty() && !serveTileCommand(tiles, scheduler, line)) {
+            scheduler.submit(line);
+        }
+    }
+    scheduler.finish();
+    if (poolBytes != 0) {
+        std::cout << pool.summary() << std::endl;
+    }
+    return 0;
+}
+
+// Throughput summary for one pipeline stage across repeated benchmark runs, in megapixels per second.
+struct StageSample {
+    double median = 0;
+    double mad = 0;
+};
+
+static double medianOf(std::vector<double> values) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t mid = values.size() / 2;
+    return (values.size() % 2) ? values[mid] : (values[mid - 1] + values[mid]) / 2;
+}
+
+// Median and median absolute deviation. The MAD is used as the noise estimate because a single slow run (page cache, frequency scaling)
+// should not widen the regression threshold the way a standard deviation would.
+static StageSample summarize(const std::vector<double> &values) {
+    StageSample sample;
+    sample.median = medianOf(values);
+    std::vector<double> deviations;
+    for (double v : values) {
+        deviations.push_back(std::fabs(v - sample.median));
+    }
+    sample.mad = medianOf(deviations);
+    return sample;
+}
+
+// Stages reported by the benchmark. Only the per-pixel stages are gated, since decode and encode time belongs to CImg and the codecs.
+static const char *benchStages[] = {"load", "getColorPalette", "applyFilter", "save"};
+static const int benchStageCount = 4;
+static bool isGatedStage(const std::string &stage) { return stage == "getColorPalette" || stage == "applyFilter"; }
+
+typedef std::map<std::string, StageSample> BenchResult;
+
+static void writeBenchJson(const std::string &path, const BenchResult &result, int runs) {
+    std::ofstream out(path.c_str());
+    out << std::fixed << std::setprecision(3);
+    out << "{\n  \"unit\": \"megapixels_per_second\",\n  \"runs\": " << runs << ",\n  \"stages\": {\n";
+    for (int i = 0; i < benchStageCount; i++) {
+        const StageSample &s = result.at(benchStages[i]);
+        out << "    \"" << benchStages[i] << "\": {\"median\": " << s.median << ", \"mad\": " << s.mad << "}"
+            << (i + 1 < benchStageCount ? "," : "") << "\n";
+    }
+    out << "  }\n}\n";
+}
 
-using namespace cimg_library;
+// Reads a baseline written by writeBenchJson. Only the fields that file contains are understood, which keeps this free of a JSON dependency.
+static bool readBenchJson(const std::string &path, BenchResult &result) {
+    std::ifstream in(path.c_str());
+    if (!in) {
+        return false;
+    }
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    std::string text = buffer.str();
+    for (int i = 0; i < benchStageCount; i++) {
+        size_t at = text.find("\"" + std::string(benchStages[i]) + "\"");
+        if (at == std::string::npos) {
+            continue;
+        }
+        size_t median = text.find("\"median\":", at);
+        size_t mad = text.find("\"mad\":", at);
+        if (median == std::string::npos || mad == std::string::npos) {
+            return false;
+        }
+        StageSample &s = result[benchStages[i]];
+        s.median = std::atof(text.c_str() + median + 9);
+        s.mad = std::atof(text.c_str() + mad + 6);
+    }
+    return !result.empty();
+}
 
-// RGB_Triple is a frequently-used structure for storing data about a given color within an image.
-class RGB_Triple {
-private:
-    // Commonly used variables. Instantiated here and reused to speed up by reducing the number of allocations needed in loops.
-    int red;
-    int green;
-    int blue;
-    int frequency;
+// A stage regresses when its median throughput drops by more than the tolerance and the drop is also larger than three times the combined
+// run-to-run noise of both measurements.
+static bool isRegression(const StageSample &baseline, const StageSample &current, double tolerance) {
+    double drop = baseline.median - current.median;
+    return drop > baseline.median * tolerance && drop > 3 * (baseline.mad + current.mad);
+}
 
-public:
-    RGB_Triple(int r = 0, int g = 0, int b = 0, int fr = 0) : red(r), green(g), blue(b), frequency(fr){};
-    void mergeValue(int r, int g, int b) {
-        if (frequency < 10) {
-            red = ((frequency * red) + r) / (frequency + 1);
-            green = ((frequency * green) + g) / (frequency + 1);
-            blue = ((frequency * blue) + b) / (frequency + 1);
+static bool printBenchDiff(const BenchResult &baseline, const BenchResult &current, double tolerance) {
+    bool regressed = false;
+    std::cout << std::left << std::setw(18) << "stage" << std::right << std::setw(14) << "baseline MP/s" << std::setw(14) << "current MP/s"
+              << std::setw(10) << "delta" << "  status" << std::endl;
+    for (int i = 0; i < benchStageCount; i++) {
+        std::string stage = benchStages[i];
+        const StageSample &now = current.at(stage);
+        std::map<std::string, StageSample>::const_iterator old = baseline.find(stage);
+        std::cout << std::left << std::setw(18) << stage << std::right << std::fixed << std::setprecision(1);
+        if (old == baseline.end()) {
+            std::cout << std::setw(14) << "-" << std::setw(14) << now.median << std::setw(10) << "-" << "  no baseline" << std::endl;
+            continue;
+        }
+        double delta = old->second.median > 0 ? 100.0 * (now.median - old->second.median) / old->second.median : 0;
+        std::string status = "ok";
+        if (isRegression(old->second, now, tolerance)) {
+            status = isGatedStage(stage) ? "REGRESSION" : "slower (not gated)";
+            regressed = regressed || isGatedStage(stage);
+        }
+        std::cout << std::setw(14) << old->second.median << std::setw(14) << now.median << std::setw(9) << std::showpos << delta << "%"
+                  << std::noshowpos << "  " << status << std::endl;
+    }
+    return regressed;
+}
+
+// Runs the full pipeline over the given images several times and records per-stage throughput. The first run only warms the page cache and
+// allocator and is discarded.
+static BenchResult runBenchmark(const std::vector<std::string> &uris, int runs) {
+    std::map<std::string, std::vector<double>> samples;
+    for (int run = 0; run <= runs; run++) {
+        StageTimes total;
+        double pixels = 0;
+        for (const std::string &uri : uris) {
+            ImageFilter filter(uri);
+            filter.applyFilter();
+            filter.saveImageFile(uri);
+            const StageTimes &t = filter.getStageTimes();
+            total.load += t.load;
+            total.palette += t.palette;
+            total.apply += t.apply;
+            total.save += t.save;
+            pixels += filter.pixelCount();
+        }
+        if (run == 0) {
+            continue;
+        }
+        double megapixels = pixels / 1e6;
+        samples["load"].push_back(megapixels / total.load);
+        samples["getColorPalette"].push_back(megapixels / total.palette);
+        samples["applyFilter"].push_back(megapixels / total.apply);
+        samples["save"].push_back(megapixels / total.save);
+    }
+    BenchResult result;
+    for (int i = 0; i < benchStageCount; i++) {
+        result[benchStages[i]] = summarize(samples[benchStages[i]]);
+    }
+    return result;
+}
+
+// Benchmark mode: ./main --bench [--runs N] [--tolerance 0.10] [--baseline FILE] [--save-baseline FILE] [images...]
+// Exits with status 3 when a gated stage regresses against the baseline.
+static int benchMain(int argc, char *argv[]) {
+    int runs = 7;
+    double tolerance = 0.10;
+    std::string baselinePath = "bench/baseline.json", savePath;
+    std::vector<std::string> uris;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--runs" && i + 1 < argc) {
+            runs = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--tolerance" && i + 1 < argc) {
+            tolerance = std::atof(argv[++i]);
+        } else if (arg == "--baseline" && i + 1 < argc) {
+            baselinePath = argv[++i];
+        } else if (arg == "--save-baseline" && i + 1 < argc) {
+            savePath = argv[++i];
         } else {
-            red = (red * 9 + r) / 10;
-            green = (green * 9 + g) / 10;
-            blue = (blue * 9 + b) / 10;
+            uris.push_back(arg);
         }
-        frequency++;
     }
-    int getRed(void) { return red; }
-    int getGreen(void) { return green; }
-    int getBlue(void) { return blue; }
-};
+    if (uris.empty()) {
+        uris = {"input/img1.jpeg", "input/img2.jpeg", "input/img3.jpeg"};
+    }
+    BenchResult current = runBenchmark(uris, runs);
+    if (!savePath.empty()) {
+        writeBenchJson(savePath, current, runs);
+        std::cout << "Saved baseline to " << savePath << std::endl;
+    }
+    BenchResult baseline;
+    if (!readBenchJson(baselinePath, baseline)) {
+        std::cout << "No baseline found at " << baselinePath << ", reporting current numbers only" << std::endl;
+    }
+    if (printBenchDiff(baseline, current, tolerance)) {
+        std::cout << "Performance regression beyond " << tolerance * 100 << "% in a gated stage" << std::endl;
+        return 3;
+    }
+    return 0;
+}
+
+// Repacks the image into each interleaved layout, with padded rows and filler in the extra channels, runs the library kernels on it in place
+// and compares the colour channels with the reference output. The filler must come back untouched. Greyscale images are repacked into the
+// grey layouts instead, and images with alpha only into the layouts that carry it.
+template <typename T>
+static bool verifyLayouts(const std::string &name, const CImg<T> &source, const CImg<T> &want) {
+    struct Packing {
+        const char *name;
+        Layout layout;
+        int channels;
+        bool alpha;
+    };
+    const Packing packings[] = {{"RGB", Layout::RGB, 3, false},   {"BGR", Layout::BGR, 3, false},
+                                {"RGBA", Layout::RGBA, 4, true},  {"BGRA", Layout::BGRA, 4, true},
+                                {"RGBx", Layout::RGB, 4, false},  {"RGB in 5-byte pixels", Layout::RGB, 5, false},
+                                {"grey", Layout::Gray, 1, false}, {"grey and alpha", Layout::Gray, 2, true}};
+    long width = source.width(), height = source.height();
+    bool gray = source.spectrum() < 3, alpha = source.spectrum() == 2 || source.spectrum() >= 4;
+    int colors = gray ? 1 : 3;
+    for (const Packing &packing : packings) {
+        if ((packing.layout == Layout::Gray) != gray || (alpha && !packing.alpha)) {
+            continue;
+        }
+        long rowSamples = width * packing.channels + 7;
+        std::vector<T> buffer(rowSamples * height, (T)0x5A);
+        int red = (packing.layout == Layout::BGR || packing.layout == Layout::BGRA) ? 2 : 0;
+        const int offsets[3] = {red, 1, 2 - red};
+        for (long y = 0; y < height; y++) {
+            for (long x = 0; x < width; x++) {
+                T *pixel = &buffer[y * rowSamples + x * packing.channels];
+                for (int c = 0; c < colors; c++) {
+                    pixel[offsets[c]] = source(x, y, c);
+                }
+                if (alpha) {
+                    pixel[colors] = source(x, y, colors);
+                }
+            }
+        }
+        BasicImageView<T> view = interleavedView(buffer.data(), width, height, packing.channels, rowSamples * (long)sizeof(T), packing.layout);
+        BasicColorPalette<T> palette;
+        palette.merge(view);
+        palette.finalize();
+        palette.apply(view);
+        for (long y = 0; y < height; y++) {
+            for (long x = 0; x < width; x++) {
+                const T *pixel = &buffer[y * rowSamples + x * packing.channels];
+                bool same = true;
+                for (int c = 0; c < colors; c++) {
+                    same = same && pixel[offsets[c]] == want(x, y, c);
+                }
+                for (int c = colors; c < packing.channels; c++) {
+                    same = same && pixel[c] == (alpha && c == colors ? source(x, y, colors) : (T)0x5A);
+                }
+                if (!same) {
+                    std::cout << "FAIL " << name << ": " << packing.name << " layout differs at pixel (" << x << ", " << y << ")" << std::endl;
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Runs the reference and fast kernels on the same image and reports the first difference in the palette or the filtered pixels.
+template <typename T>
+static bool verifyKernels(const std::string &name, const CImg<T> &source) {
+    BasicImageFilter<T> reference(source, Kernel::Reference), fast(source, Kernel::Fast);
+    std::vector<typename BasicColorPalette<T>::Triple> expected = reference.getPalette(), actual = fast.getPalette();
+    for (int i = 0; i < 21; i++) {
+        if (expected[i].getRed() != actual[i].getRed() || expected[i].getGreen() != actual[i].getGreen() ||
+            expected[i].getBlue() != actual[i].getBlue() || expected[i].getFrequency() != actual[i].getFrequency()) {
+            std::cout << "FAIL " << name << ": palette class " << i << " differs" << std::endl;
+            return false;
+        }
+    }
+    reference.applyFilter();
+    fast.applyFilter();
+    const CImg<T> &want = reference.getImage(), &got = fast.getImage();
+    for (unsigned long i = 0; i < want.size(); i++) {
+        if (want[i] != got[i]) {
+            long plane = (long)want.width() * want.height();
+            std::cout << "FAIL " << name << ": pixel (" << (i % plane) % want.width() << ", " << (i % plane) / want.width() << ") channel "
+                      << i / plane << " is " << (double)got[i] << ", reference " << (double)want[i] << std::endl;
+            return false;
+        }
+    }
+    if (!verifyLayouts(name, source, want)) {
+        return false;
+    }
+    std::cout << "ok   " << name << std::endl;
+    return true;
+}
+
+// Creates an empty file under TMPDIR for the codec checks and returns its path, or an empty string.
+static std::string verifyScratchFile(void) {
+    const char *directory = std::getenv("TMPDIR");
+    std::string path = std::string(directory && *directory ? directory : "/tmp") + "/imagefilter-verify-XXXXXX";
+    std::vector<char> buffer(path.begin(), path.end());
+    buffer.push_back(0);
+    int descriptor = mkstemp(buffer.data());
+    if (descriptor < 0) {
+        return std::string();
+    }
+    close(descriptor);
+    return buffer.data();
+}
+
+// Reports the first pixel where two decodes of the same image differ.
+static bool sameDecode(const std::string &name, const char *what, const CImg<unsigned char> &want, const CImg<unsigned char> &got) {
+    if (!want.is_sameXYZC(got)) {
+        std::cout << "FAIL " << name << ": " << what << " has the wrong dimensions" << std::endl;
+        return false;
+    }
+    cimg_forXYC(want, x, y, c) {
+        if (want(x, y, c) != got(x, y, c)) {
+            std::cout << "FAIL " << name << ": " << what << " differs at (" << x << ", " << y << ") channel " << c << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Encodes the image as a baseline JPEG with the given restart interval and luma sampling factors, decodes it serially with CImg and in parallel
+// with RestartJpegDecoder, and compares the two. The parallel decoder must take the file and match bit for bit.
+static bool verifyRestartJpeg(const std::string &name, const CImg<unsigned char> &source, int restartMcus, int hSampling, int vSampling) {
+    std::string path = verifyScratchFile();
+    std::FILE *file = path.empty() ? nullptr : std::fopen(path.c_str(), "wb");
+    if (!file) {
+        std::cout << "FAIL " << name << ": cannot create a temporary file" << std::endl;
+        return false;
+    }
+    long width = source.width(), height = source.height();
+    int components = source.spectrum();
+    std::vector<unsigned char> row(width * components);
+    jpeg_compress_struct encoder;
+    jpeg_error_mgr errors;
+    encoder.err = jpeg_std_error(&errors);
+    jpeg_create_compress(&encoder);
+    jpeg_stdio_dest(&encoder, file);
+    encoder.image_width = width;
+    encoder.image_height = height;
+    encoder.input_components = components;
+    encoder.in_color_space = components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_set_defaults(&encoder);
+    jpeg_set_quality(&encoder, 90, TRUE);
+    encoder.restart_interval = restartMcus;
+    encoder.comp_info[0].h_samp_factor = hSampling;
+    encoder.comp_info[0].v_samp_factor = vSampling;
+    jpeg_start_compress(&encoder, TRUE);
+    for (long y = 0; y < height; y++) {
+        for (long x = 0; x < width; x++) {
+            for (int c = 0; c < components; c++) {
+                row[x * components + c] = source(x, y, c);
+            }
+        }
+        JSAMPROW rowPointer = row.data();
+        jpeg_write_scanlines(&encoder, &rowPointer, 1);
+    }
+    jpeg_finish_compress(&encoder);
+    jpeg_destroy_compress(&encoder);
+    std::fclose(file);
+
+    CImg<unsigned char> serial(path.c_str()), parallel(width, height, 1, components);
+    RestartJpegDecoder decoder(4);
+    bool split = decoder.decode(path, parallel);
+    std::remove(path.c_str());
+    if (!split) {
+        std::cout << "FAIL " << name << ": the parallel decoder did not split the file" << std::endl;
+        return false;
+    }
+    if (!sameDecode(name, "parallel decode", serial, parallel)) {
+        return false;
+    }
+    std::cout << "ok   " << name << std::endl;
+    return true;
+}
 
-class ImageFilter {
+// Throws from one index of a four-way parallelFor, on whichever thread picks it up, and checks the exception reaches the caller.
+static bool verifyParallelFor(const std::string &name) {
+    std::atomic<long> calls(0);
+    bool passed = false;
+    try {
+        parallelFor(100000, 4, [&](long i) {
+            calls++;
+            if (i == 1000) {
+                throw std::runtime_error("index 1000");
+            }
+        });
+    } catch (const std::runtime_error &e) {
+        passed = std::string(e.what()) == "index 1000";
+    }
+    if (!passed || calls == 100000) {
+        std::cout << "FAIL " << name << ": " << (passed ? "kept handing out indices after a failure" : "the exception was lost") << std::endl;
+        return false;
+    }
+    std::cout << "ok   " << name << std::endl;
+    return true;
+}
+
+// Saves the image with a four-way ParallelPngWriter at every level and checks that it loads back unchanged.
+template <typename T>
+static bool verifyParallelPng(const std::string &name, const CImg<T> &source) {
+    std::string path = verifyScratchFile();
+    int savedLevel = pngCompressionLevel;
+    bool passed = !path.empty();
+    for (int level = 0; level <= 9 && passed; level += 3) {
+        pngCompressionLevel = level;
+        CImg<T> loaded;
+        passed = saveParallelPng(source, path, 4);
+        if (passed) {
+            loaded.load_png(path.c_str());
+            passed = loaded == source;
+        }
+        if (!passed) {
+            std::cout << "FAIL " << name << ": level " << level << " does not load back unchanged" << std::endl;
+        }
+    }
+    pngCompressionLevel = savedLevel;
+    std::remove(path.c_str());
+    if (passed) {
+        std::cout << "ok   " << name << std::endl;
+    }
+    return passed;
+}
+
+// Saves the image with CImg and with a four-way StripJpegEncoder, and checks that both files decode to the same pixels, serially and, for the
+// stitched file, with RestartJpegDecoder.
+static bool verifyStripJpeg(const std::string &name, const CImg<unsigned char> &source) {
+    std::string serialPath = verifyScratchFile(), stripPath = verifyScratchFile();
+    StripJpegEncoder encoder(4);
+    bool saved = !serialPath.empty() && !stripPath.empty() && encoder.save(source, stripPath);
+    CImg<unsigned char> serial, stitched, parallel(source.width(), source.height(), 1, source.spectrum());
+    RestartJpegDecoder decoder(4);
+    bool split = false;
+    if (saved) {
+        source.save_jpeg(serialPath.c_str());
+        serial.load_jpeg(serialPath.c_str());
+        stitched.load_jpeg(stripPath.c_str());
+        split = decoder.decode(stripPath, parallel);
+    }
+    std::remove(serialPath.c_str());
+    std::remove(stripPath.c_str());
+    if (!saved || !split) {
+        std::cout << "FAIL " << name << ": " << (saved ? "the parallel decoder did not split the file" : "the strip encoder refused the image")
+                  << std::endl;
+        return false;
+    }
+    if (!sameDecode(name, "stitched file", serial, stitched) || !sameDecode(name, "parallel decode of the stitched file", serial, parallel)) {
+        return false;
+    }
+    std::cout << "ok   " << name << std::endl;
+    return true;
+}
+
+// QOI holds only RGB and RGBA: the colours a grey image, or a grey and alpha one, loads back with.
+static CImg<unsigned char> expandToQoi(const CImg<unsigned char> &image) {
+    if (image.spectrum() > 2) {
+        return image;
+    }
+    CImg<unsigned char> grey = image.get_channel(0), expanded = grey.get_append(grey, 'c').append(grey, 'c');
+    return image.spectrum() == 2 ? expanded.append(image.get_channel(1), 'c') : expanded;
+}
+
+// Saves the image as QOI and checks that it loads back unchanged, greyscale as RGB. The fused path, which remaps each row just before encoding
+// it, must match filtering first and saving afterwards.
+static bool verifyQoi(const std::string &name, const CImg<unsigned char> &source) {
+    std::string path = verifyScratchFile();
+    CImg<unsigned char> loaded(source.width(), source.height(), 1, source.spectrum() == 2 ? 4 : std::max(3, source.spectrum()));
+    CImg<unsigned char> filtered(source), fused(source);
+    bool passed = !path.empty() && saveQoi(source, path) && loadQoi(path, loaded) && loaded == expandToQoi(source);
+    if (passed) {
+        ColorPalette palette;
+        palette.merge(planarView(fused.data(), fused.width(), fused.height(), fused.spectrum()));
+        palette.finalize();
+        filterImage(planarView(filtered.data(), filtered.width(), filtered.height(), filtered.spectrum()));
+        ImageView row = planarView(fused.data(), fused.width(), 1, fused.spectrum());
+        row.planeStride = (long)fused.width() * fused.height();
+        passed = saveQoi(fused, path, [&](long y) {
+            row.data = fused.data(0, y);
+            palette.apply(row);
+        });
+        passed = passed && loadQoi(path, loaded) && loaded == expandToQoi(filtered);
+    }
+    std::remove(path.c_str());
+    std::cout << (passed ? "ok   " : "FAIL ") << name << (passed ? "" : ": does not load back unchanged") << std::endl;
+    return passed;
+}
+
+// Decodes the lossless WebP files WebpLosslessEncoder writes, for the WebP round trip. Written from the VP8L specification rather than from the
+// encoder, it handles both of the encoder's transforms and a colour cache, and refuses predictor and cross-colour transforms and meta prefix
+// codes, which the encoder never sends. Pixels come back as ARGB words.
+class WebpLosslessDecoder {
 private:
-    int width;
-    int height;
-    CImg<unsigned char> image;
-    // The filter averages the colors in different R, G, and B color categories and creates a palette with light and dark options for each.
-    int getLuminosityIndex(int intensity) {
-        if (intensity > 170) {
-            return 0;
-        } else if (intensity < 85) {
-            return 2;
+    const unsigned char *data = nullptr;
+    size_t size = 0, bit = 0;
+    bool failed = false;
+
+    // A canonical prefix code, decoded a bit at a time as in puff: the number of codes of each length, and the symbols in code order.
+    struct PrefixCode {
+        int counts[16];
+        std::vector<int> symbols;
+    };
+
+    uint32_t bits(int count) {
+        uint32_t value = 0;
+        for (int i = 0; i < count; i++, bit++) {
+            if (bit >= size * 8) {
+                failed = true;
+                return 0;
+            }
+            value |= (uint32_t)((data[bit >> 3] >> (bit & 7)) & 1) << i;
         }
-        return 1;
+        return value;
+    }
+    bool build(const std::vector<int> &lengths, PrefixCode &code) {
+        std::fill(code.counts, code.counts + 16, 0);
+        code.symbols.clear();
+        for (int length : lengths) {
+            code.counts[length]++;
+        }
+        code.counts[0] = 0;
+        for (int length = 1; length < 16; length++) {
+            for (size_t s = 0; s < lengths.size(); s++) {
+                if (lengths[s] == length) {
+                    code.symbols.push_back(s);
+                }
+            }
+        }
+        return !code.symbols.empty();
+    }
+    // A code with a single symbol takes no bits.
+    int decode(const PrefixCode &code) {
+        if (code.symbols.size() == 1) {
+            return code.symbols[0];
+        }
+        int value = 0, first = 0, index = 0;
+        for (int length = 1; length < 16 && !failed; length++) {
+            value |= bits(1);
+            if (value - first < code.counts[length]) {
+                return code.symbols[index + value - first];
+            }
+            index += code.counts[length];
+            first = (first + code.counts[length]) << 1;
+            value <<= 1;
+        }
+        failed = true;
+        return 0;
+    }
+    bool readCode(int alphabet, PrefixCode &code) {
+        std::vector<int> lengths(alphabet, 0);
+        if (bits(1)) {
+            int symbols = bits(1) + 1, first = bits(bits(1) ? 8 : 1);
+            if (first >= alphabet) {
+                return false;
+            }
+            lengths[first] = 1;
+            if (symbols == 2) {
+                int second = bits(8);
+                if (second >= alphabet) {
+                    return false;
+                }
+                lengths[second] = 1;
+            }
+            return build(lengths, code) && !failed;
+        }
+        static const int order[19] = {17, 18, 0, 1, 2, 3, 4, 5, 16, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+        std::vector<int> lengthLengths(19, 0);
+        int sent = bits(4) + 4;
+        for (int i = 0; i < sent; i++) {
+            lengthLengths[order[i]] = bits(3);
+        }
+        PrefixCode lengthCode;
+        if (!build(lengthLengths, lengthCode)) {
+            return false;
+        }
+        int limit = alphabet;
+        if (bits(1)) {
+            limit = 2 + bits(2 + 2 * bits(3));
+            if (limit > alphabet) {
+                return false;
+            }
+        }
+        for (int symbol = 0, previous = 8; symbol < alphabet && limit-- > 0 && !failed;) {
+            int length = decode(lengthCode);
+            if (length < 16) {
+                lengths[symbol++] = length;
+                previous = length ? length : previous;
+                continue;
+            }
+            int repeat = length == 16 ? 3 + bits(2) : length == 17 ? 3 + bits(3) : 11 + bits(7);
+            if (symbol + repeat > alphabet) {
+                return false;
+            }
+            std::fill(&lengths[symbol], &lengths[symbol] + repeat, length == 16 ? previous : 0);
+            symbol += repeat;
+        }
+        return build(lengths, code) && !failed;
+    }
+    uint32_t lz77Value(int prefix) {
+        if (prefix < 4) {
+            return prefix + 1;
+        }
+        int extraBits = (prefix - 2) >> 1;
+        return ((2 + (prefix & 1)) << extraBits) + bits(extraBits) + 1;
+    }
+    // Decodes one entropy-coded image of width x height pixels. Only the main image may have meta prefix codes.
+    bool readImage(long width, long height, bool topLevel, std::vector<uint32_t> &pixels) {
+        int cacheBits = bits(1) ? bits(4) : 0;
+        if (cacheBits > 11 || (topLevel && bits(1))) {
+            return false;
+        }
+        std::vector<uint32_t> cache(cacheBits ? 1 << cacheBits : 0, 0);
+        PrefixCode codes[5];
+        const int alphabets[5] = {256 + 24 + (int)cache.size(), 256, 256, 256, 40};
+        for (int i = 0; i < 5; i++) {
+            if (!readCode(alphabets[i], codes[i])) {
+                return false;
+            }
+        }
+        pixels.assign(width * height, 0);
+        for (long i = 0; i < width * height && !failed;) {
+            int green = decode(codes[0]);
+            long first = i;
+            if (green < 256) {
+                int red = decode(codes[1]), blue = decode(codes[2]), alpha = decode(codes[3]);
+                pixels[i++] = (uint32_t)alpha << 24 | red << 16 | green << 8 | blue;
+            } else if (green < 256 + 24) {
+                long length = lz77Value(green - 256), code = lz77Value(decode(codes[4]));
+                long distance = code > 120 ? code - 120 : webpNeighbours[code - 1][0] + webpNeighbours[code - 1][1] * width;
+                distance = std::max(1L, distance);
+                if (distance > i || length > width * height - i) {
+                    return false;
+                }
+                for (long end = i + length; i < end; i++) {
+                    pixels[i] = pixels[i - distance];
+                }
+            } else {
+                pixels[i++] = cache[green - 256 - 24];
+            }
+            for (long j = first; cacheBits && j < i; j++) {
+                cache[(0x1E35A7BDu * pixels[j]) >> (32 - cacheBits)] = pixels[j];
+            }
+        }
+        return !failed;
     }
-    int getColorIndex(int intensity) { return (intensity > 170 ? 0 : 1); }
-    RGB_Triple vectorDefault;
-    // Colors ranked by greatest to least pronounced color value. Rg is red >= green >= blue, Bg is blue >= green >= red, etc. Each set has a value
-    // for lighter and darker hues. Index 0 is for lighter (dominant value greater than one third), index 1 is for middle shades (dominant value in
-    // middle third), and index 2 is for darker (dominant value less than half).
-    std::vector<RGB_Triple> Rg = {vectorDefault, vectorDefault, vectorDefault}, Rb = {vectorDefault, vectorDefault, vectorDefault},
-                            Gr = {vectorDefault, vectorDefault, vectorDefault}, Gb = {vectorDefault, vectorDefault, vectorDefault},
-                            Br = {vectorDefault, vectorDefault, vectorDefault}, Bg = {vectorDefault, vectorDefault, vectorDefault},
-                            noColor = {vectorDefault, vectorDefault, vectorDefault};
 
-    void getColorPalette(void) {
-        int r, g, b;
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                r = image(x, y, 0);
-                g = image(x, y, 1);
-                b = image(x, y, 2);
-                if (r == g && r == b) {
-                    noColor[getLuminosityIndex(r)].mergeValue(r, g, b);
-                } else if (r >= g && r >= b) {
-                    if (g >= b) {
-                        Rg[getLuminosityIndex(r)].mergeValue(r, g, b);
-                    } else {
-                        Rb[getLuminosityIndex(r)].mergeValue(r, g, b);
-                    }
-                } else if (g >= r && g >= b) {
-                    if (r >= b) {
-                        Gr[getLuminosityIndex(g)].mergeValue(r, g, b);
-                    } else {
-                        Gb[getLuminosityIndex(g)].mergeValue(r, g, b);
-                    }
-                } else if (b >= r && b >= g) {
-                    if (r >= b) {
-                        Br[getLuminosityIndex(b)].mergeValue(r, g, b);
-                    } else {
-                        Bg[getLuminosityIndex(b)].mergeValue(r, g, b);
+public:
+    // Decodes a RIFF WebP file holding one VP8L chunk. Returns false for anything malformed or outside the subset above.
+    bool decode(const std::vector<unsigned char> &file, long &width, long &height, std::vector<uint32_t> &pixels) {
+        if (file.size() < 25 || std::memcmp(&file[0], "RIFF", 4) || std::memcmp(&file[8], "WEBPVP8L", 8)) {
+            return false;
+        }
+        size_t chunk = file[16] | file[17] << 8 | file[18] << 16 | (size_t)file[19] << 24;
+        if (chunk > file.size() - 20) {
+            return false;
+        }
+        data = &file[20];
+        size = chunk;
+        bit = 0;
+        failed = false;
+        if (bits(8) != 0x2F) {
+            return false;
+        }
+        width = bits(14) + 1;
+        height = bits(14) + 1;
+        bits(1);
+        if (bits(3)) {
+            return false;
+        }
+        long codedWidth = width;
+        bool subtractGreen = false;
+        int bundling = -1;
+        std::vector<uint32_t> palette;
+        while (bits(1) && !failed) {
+            int type = bits(2);
+            if (type == 2 && !subtractGreen && bundling < 0) {
+                subtractGreen = true;
+            } else if (type == 3 && bundling < 0) {
+                int colors = bits(8) + 1;
+                if (!readImage(colors, 1, false, palette)) {
+                    return false;
+                }
+                for (int i = 1; i < colors; i++) {
+                    uint32_t sum = 0;
+                    for (int shift = 0; shift < 32; shift += 8) {
+                        sum |= (((palette[i] >> shift) + (palette[i - 1] >> shift)) & 255) << shift;
                     }
+                    palette[i] = sum;
+                }
+                bundling = colors <= 2 ? 3 : colors <= 4 ? 2 : colors <= 16 ? 1 : 0;
+                codedWidth = (width + (1 << bundling) - 1) >> bundling;
+            } else {
+                return false;
+            }
+        }
+        std::vector<uint32_t> coded;
+        if (failed || !readImage(codedWidth, height, true, coded)) {
+            return false;
+        }
+        pixels.swap(coded);
+        if (bundling >= 0) {
+            int indexBits = 8 >> bundling;
+            std::vector<uint32_t> expanded(width * height);
+            for (long y = 0; y < height; y++) {
+                for (long x = 0; x < width; x++) {
+                    uint32_t packed = pixels[y * codedWidth + (x >> bundling)] >> 8;
+                    uint32_t index = (packed >> (indexBits * (x & ((1 << bundling) - 1)))) & ((1 << indexBits) - 1);
+                    expanded[y * width + x] = index < palette.size() ? palette[index] : 0;
                 }
             }
+            pixels.swap(expanded);
+        }
+        for (long i = 0; subtractGreen && i < width * height; i++) {
+            uint32_t green = (pixels[i] >> 8) & 255;
+            pixels[i] = (pixels[i] & 0xFF00FF00u) | ((((pixels[i] >> 16) + green) & 255) << 16) | (((pixels[i] & 255) + green) & 255);
+        }
+        return true;
+    }
+};
+
+// Saves the image as WebP at every --webp-method and checks that each file decodes back to the same pixels. Grey is read back as r == g == b,
+// and images without alpha as opaque.
+static bool verifyWebp(const std::string &name, const CImg<unsigned char> &source) {
+    std::string path = verifyScratchFile();
+    long plane = (long)source.width() * source.height();
+    int channels = source.spectrum();
+    std::vector<uint32_t> want(plane);
+    for (long i = 0; i < plane; i++) {
+        const unsigned char *red = source.data() + i;
+        uint32_t green = channels >= 3 ? red[plane] : red[0], blue = channels >= 3 ? red[2 * plane] : red[0];
+        uint32_t alpha = channels == 2 ? red[plane] : channels == 4 ? red[3 * plane] : 255;
+        want[i] = alpha << 24 | (uint32_t)red[0] << 16 | green << 8 | blue;
+    }
+    bool passed = !path.empty();
+    for (int method = 0; method <= 6 && passed; method++) {
+        std::vector<unsigned char> file;
+        std::vector<uint32_t> pixels;
+        long width = 0, height = 0;
+        passed = WebpLosslessEncoder(method).save(source, path);
+        if (passed) {
+            std::ifstream in(path.c_str(), std::ios::binary);
+            file.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            passed = WebpLosslessDecoder().decode(file, width, height, pixels) && width == source.width() && height == source.height() &&
+                     pixels == want;
         }
+        if (!passed) {
+            std::cout << "FAIL " << name << ": method " << method << " does not decode back unchanged" << std::endl;
+        }
+    }
+    std::remove(path.c_str());
+    if (passed) {
+        std::cout << "ok   " << name << std::endl;
     }
-    // Based on the RGB and luminosity alignment of an input color, return the closest color available within the pre-defined palette.
-    RGB_Triple getPaletteHue(int r, int g, int b) {
-        if (r == g && r == b) {
-            return noColor[getLuminosityIndex(r)];
-        } else if (r >= g && r >= b) {
-            if (g >= b) {
-                return Rg[getLuminosityIndex(r)];
+    return passed;
+}
+
+// TIFF LZW encoder matching lzwDecode, for the TIFF round trip: codes widen one code early, and the table is cleared just before it fills.
+static std::vector<unsigned char> lzwEncode(const std::vector<unsigned char> &in) {
+    std::vector<unsigned char> out;
+    std::vector<uint16_t> children(4096 * 256, 0);
+    std::vector<long> used;
+    uint32_t buffer = 0;
+    int pending = 0, width = 9, next = 258, prefix = -1;
+    std::function<void(int)> emit = [&](int code) {
+        buffer = (buffer << width) | code;
+        for (pending += width; pending >= 8; pending -= 8) {
+            out.push_back(buffer >> (pending - 8));
+        }
+    };
+    emit(256);
+    for (unsigned char byte : in) {
+        if (prefix >= 0 && children[prefix * 256 + byte]) {
+            prefix = children[prefix * 256 + byte];
+            continue;
+        }
+        if (prefix >= 0) {
+            emit(prefix);
+            used.push_back(prefix * 256 + byte);
+            children[used.back()] = next++;
+            if (next >= (1 << width) && width < 12) {
+                width++;
             }
-            return Rb[getLuminosityIndex(r)];
-        } else if (g >= r && g >= b) {
-            if (r >= b) {
-                return Gr[getLuminosityIndex(g)];
+            if (next == 4093) {
+                emit(256);
+                for (long entry : used) {
+                    children[entry] = 0;
+                }
+                used.clear();
+                width = 9;
+                next = 258;
             }
-            return Gb[getLuminosityIndex(g)];
         }
-        if (r >= g) {
-            return Br[getLuminosityIndex(b)];
+        prefix = byte;
+    }
+    if (prefix >= 0) {
+        // The decoder adds a table entry for this last code too, which can widen the end code.
+        emit(prefix);
+        if (++next >= (1 << width) && width < 12) {
+            width++;
         }
-        return Bg[getLuminosityIndex(b)];
     }
-    // Renames filtered files and places them in an output folder.
-    std::string getFileName(std::string uri) {
-        int searcher, slash = 0;
-        for (searcher = 0; searcher < uri.size(); searcher++) {
-            if (uri[searcher] == '/') {
-                slash = searcher;
-                slash++;
+    emit(257);
+    if (pending > 0) {
+        out.push_back(buffer << (8 - pending));
+    }
+    return out;
+}
+
+// Writes the image as a TIFF in the given byte order, container, tile or strip grid, compression and predictor, and checks that TiffReader
+// decodes every tile back to the image. The file is then rewritten with its first tile cut in half, which the reader must refuse.
+template <typename T>
+static bool verifyTiff(const std::string &name, const CImg<T> &source, bool bigEndian, bool bigTiff, bool tiled, int compression, int predictor) {
+    std::string path = verifyScratchFile();
+    TiffLayout layout;
+    layout.bigTiff = bigTiff;
+    layout.tiled = tiled;
+    layout.width = source.width();
+    layout.height = source.height();
+    layout.tileWidth = tiled ? 48 : source.width();
+    layout.tileHeight = tiled ? 32 : 13;
+    layout.channels = source.spectrum();
+    layout.bitsPerSample = 8 * sizeof(T);
+    layout.compression = compression;
+    layout.predictor = predictor;
+    long across = layout.tilesAcross(), count = across * layout.tilesDown(), channels = layout.channels;
+    std::vector<std::vector<unsigned char>> tiles(count);
+    for (long index = 0; index < count; index++) {
+        long x0 = index % across * layout.tileWidth, y0 = index / across * layout.tileHeight, rows = layout.storedRows(index);
+        std::vector<T> samples(rows * layout.tileWidth * channels, 0);
+        for (long y = 0; y < rows && y0 + y < layout.height; y++) {
+            T *row = &samples[y * layout.tileWidth * channels];
+            for (long x = 0; x < layout.tileWidth && x0 + x < layout.width; x++) {
+                for (int c = 0; c < channels; c++) {
+                    row[x * channels + c] = source(x0 + x, y0 + y, c);
+                }
+            }
+            for (long i = layout.tileWidth * channels - 1; predictor == 2 && i >= channels; i--) {
+                row[i] -= row[i - channels];
+            }
+        }
+        std::vector<unsigned char> raw;
+        for (T sample : samples) {
+            for (size_t i = 0; i < sizeof(T); i++) {
+                raw.push_back(sample >> (8 * (bigEndian ? sizeof(T) - 1 - i : i)));
+            }
+        }
+        if (compression == 5) {
+            tiles[index] = lzwEncode(raw);
+        } else if (compression == 8) {
+            uLongf size = compressBound(raw.size());
+            tiles[index].resize(size);
+            compress2(tiles[index].data(), &size, raw.data(), raw.size(), Z_DEFAULT_COMPRESSION);
+            tiles[index].resize(size);
+        } else {
+            tiles[index] = raw;
+        }
+    }
+    bool passed = !path.empty(), refused = false;
+    for (int pass = 0; pass < 2 && passed; pass++) {
+        TiffWriter writer;
+        passed = writer.open(path, layout, bigEndian);
+        for (long index = 0; index < count && passed; index++) {
+            std::vector<unsigned char> tile(tiles[index].begin(), tiles[index].end() - (pass && !index ? tiles[index].size() / 2 : 0));
+            passed = writer.writeTile(tile);
+        }
+        passed = passed && writer.finish();
+        TiffReader reader;
+        std::string error;
+        std::vector<unsigned char> pixels;
+        // The truncated tile may be refused when the file is opened, if its stored size cannot hold it, or when it is decoded.
+        if (pass) {
+            refused = passed && (!reader.open(path, error) || !reader.readTile(0, pixels, error));
+            break;
+        }
+        passed = passed && reader.open(path, error);
+        CImg<T> loaded(source.width(), source.height(), 1, channels, 0);
+        for (long index = 0; index < count && passed; index++) {
+            long x0 = index % across * layout.tileWidth, y0 = index / across * layout.tileHeight;
+            passed = reader.readTile(index, pixels, error);
+            const T *samples = reinterpret_cast<const T *>(pixels.data());
+            for (long y = 0; passed && y < layout.storedRows(index) && y0 + y < layout.height; y++) {
+                for (long x = 0; x < layout.tileWidth && x0 + x < layout.width; x++) {
+                    for (int c = 0; c < channels; c++) {
+                        loaded(x0 + x, y0 + y, c) = samples[(y * layout.tileWidth + x) * channels + c];
+                    }
+                }
             }
         }
-        return ("output/filtered-" + uri.substr(slash, searcher));
+        passed = passed && loaded == source;
     }
+    std::remove(path.c_str());
+    passed = passed && refused;
+    const char *problem = refused ? ": does not decode back unchanged" : ": a truncated tile was accepted";
+    std::cout << (passed ? "ok   " : "FAIL ") << name << (passed ? "" : problem) << std::endl;
+    return passed;
+}
 
-public:
-    ImageFilter(std::string uri) {
-        CImg<unsigned char> newImg(uri.c_str());
-        image = newImg;
-        width = image.width();
-        height = image.height();
-        getColorPalette();
+// Saves the image as IFP, on tiles of an awkward size, and checks that it decodes to the filtered image, whole and in random regions.
+template <typename T>
+static bool verifyIfp(const std::string &name, const CImg<T> &source, std::mt19937 &rng) {
+    std::string path = verifyScratchFile();
+    CImg<T> filtered(source), loaded(source.width(), source.height(), 1, source.spectrum());
+    BasicColorPalette<T> palette;
+    palette.merge(planarView(filtered.data(), filtered.width(), filtered.height(), filtered.spectrum()));
+    palette.finalize();
+    palette.apply(planarView(filtered.data(), filtered.width(), filtered.height(), filtered.spectrum()));
+    IfpReader reader;
+    bool passed = !path.empty() && saveIfp(source, palette, path, 37, 4) && reader.open(path) && reader.read(0, 0, loaded) && loaded == filtered;
+    for (int i = 0; i < 20 && passed; i++) {
+        int x = rng() % source.width(), y = rng() % source.height();
+        CImg<T> region(1 + rng() % (source.width() - x), 1 + rng() % (source.height() - y), 1, source.spectrum());
+        passed = reader.read(x, y, region) && region == filtered.get_crop(x, y, x + region.width() - 1, y + region.height() - 1);
     }
-    void saveImageFile(std::string uri) { image.save(getFileName(uri).c_str()); }
-    void applyFilter(void) {
-        RGB_Triple newColor;
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                newColor = getPaletteHue(image(x, y, 0), image(x, y, 1), image(x, y, 2));
-                image(x, y, 0) = newColor.getRed();
-                image(x, y, 1) = newColor.getGreen();
-                image(x, y, 2) = newColor.getBlue();
+    std::remove(path.c_str());
+    std::cout << (passed ? "ok   " : "FAIL ") << name << (passed ? "" : ": does not decode to the filtered image") << std::endl;
+    return passed;
+}
+
+// Serves the image as tiles of an awkward size, from a PNG and from an IFP file, through a cache too small to hold them all, and checks that
+// every tile, fetched twice in different orders, decodes to the matching crop of the filtered image.
+static bool verifyTiles(const std::string &name, const CImg<unsigned char> &source) {
+    std::string scratch = verifyScratchFile(), png = scratch + ".png", ifp = scratch + ".ifp";
+    CImg<unsigned char> filtered(source);
+    ColorPalette palette;
+    palette.merge(planarView(filtered.data(), filtered.width(), filtered.height(), filtered.spectrum()));
+    palette.finalize();
+    bool passed = !scratch.empty() && saveParallelPng(source, png) && saveIfp(source, palette, ifp, 64, 4);
+    palette.apply(planarView(filtered.data(), filtered.width(), filtered.height(), filtered.spectrum()));
+    const long size = 37;
+    long columns = (source.width() + size - 1) / size, rows = (source.height() + size - 1) / size;
+    TileServer server(size, 256 << 10);
+    std::vector<unsigned char> bytes;
+    bool hit = false;
+    std::string error;
+    for (int pass = 0; pass < 4 && passed; pass++) {
+        const std::string &uri = pass % 2 ? ifp : png;
+        for (long i = 0; i < columns * rows && passed; i++) {
+            long t = pass < 2 ? i : columns * rows - 1 - i, column = t % columns, row = t / columns;
+            std::FILE *file = nullptr;
+            passed = server.tile(uri, column, row, bytes, hit, error) && (file = std::fopen(scratch.c_str(), "wb"));
+            passed = passed && std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+            if (file) {
+                std::fclose(file);
             }
+            CImg<unsigned char> tile;
+            passed = passed && tile.load_png(scratch.c_str()).is_sameXYC(std::min(size, source.width() - column * size),
+                                                                      std::min(size, source.height() - row * size), source.spectrum());
+            passed = passed && tile == filtered.get_crop(column * size, row * size, column * size + tile.width() - 1, row * size + tile.height() - 1);
         }
     }
-};
+    std::remove(scratch.c_str());
+    std::remove(png.c_str());
+    std::remove(ifp.c_str());
+    std::cout << (passed ? "ok   " : "FAIL ") << name << (passed ? "" : ": a tile does not match the filtered image") << std::endl;
+    return passed;
+}
+
+// Writes the image as a DZI pyramid on tiles of an awkward size and checks every tile of every level against a reference built from the whole
+// class map at once: each level rendered from its classes, then halved by majority vote over 2x2 blocks with alpha averaged.
+static bool verifyPyramid(const std::string &name, const CImg<unsigned char> &source) {
+    std::string scratch = verifyScratchFile(), directory = scratch + "_files";
+    CImg<unsigned char> image(source), classes(source.width(), source.height()), alpha(source.get_channel(source.spectrum() - 1));
+    ColorPalette palette;
+    palette.merge(planarView(image.data(), image.width(), image.height(), image.spectrum()));
+    palette.finalize();
+    palette.classify(planarView(image.data(), image.width(), image.height(), image.spectrum()), classes.data(), classes.width());
+    const long size = 37;
+    int channels = source.spectrum(), level = 0;
+    PyramidWriter<unsigned char> writer(palette, false, size, 4);
+    bool passed = !scratch.empty() && writer.open(scratch + ".dzi", image.width(), image.height(), channels) &&
+                  writer.writeRows(planarView(image.data(), image.width(), image.height(), channels)) && writer.finish();
+    while ((1L << level) < std::max(source.width(), source.height())) {
+        level++;
+    }
+    for (; level >= 0; level--) {
+        CImg<unsigned char> expected(classes.width(), classes.height(), 1, channels);
+        cimg_forXY(expected, x, y) {
+            ColorPalette::Triple &color = palette.entry(classes(x, y));
+            const unsigned char samples[3] = {(unsigned char)color.getRed(), (unsigned char)color.getGreen(), (unsigned char)color.getBlue()};
+            for (int c = 0; c < channels; c++) {
+                expected(x, y, c) = (channels == 2 || channels == 4) && c == channels - 1 ? alpha(x, y) : samples[c];
+            }
+        }
+        for (long row = 0; row * size < expected.height(); row++) {
+            for (long column = 0; column * size < expected.width(); column++) {
+                std::string tilePath = directory + "/" + std::to_string(level) + "/" + std::to_string(column) + "_" + std::to_string(row) + ".png";
+                CImg<unsigned char> tile;
+                try {
+                    tile.load_png(tilePath.c_str());
+                } catch (const CImgException &) {
+                    passed = false;
+                }
+                long right = std::min((long)expected.width(), (column + 1) * size) - 1;
+                long bottom = std::min((long)expected.height(), (row + 1) * size) - 1;
+                passed = passed && tile == expected.get_crop(column * size, row * size, right, bottom);
+                std::remove(tilePath.c_str());
+            }
+        }
+        rmdir((directory + "/" + std::to_string(level)).c_str());
+        CImg<unsigned char> halfClasses((classes.width() + 1) / 2, (classes.height() + 1) / 2), halfAlpha(halfClasses);
+        cimg_forXY(halfClasses, x, y) {
+            unsigned char votes[4], opacity[4];
+            int count = 0, best = 0, bestCount = 0;
+            for (int i = 0; i < 4; i++) {
+                if (2 * x + (i & 1) < classes.width() && 2 * y + i / 2 < classes.height()) {
+                    votes[count] = classes(2 * x + (i & 1), 2 * y + i / 2);
+                    opacity[count++] = alpha(2 * x + (i & 1), 2 * y + i / 2);
+                }
+            }
+            double total = 0;
+            for (int i = 0; i < count; i++) {
+                total += opacity[i];
+                int same = std::count(votes, votes + count, votes[i]);
+                if (same > bestCount) {
+                    best = i;
+                    bestCount = same;
+                }
+            }
+            halfClasses(x, y) = votes[best];
+            halfAlpha(x, y) = total / count + 0.5;
+        }
+        classes.swap(halfClasses);
+        alpha.swap(halfAlpha);
+    }
+    std::remove((scratch + ".dzi").c_str());
+    std::remove(scratch.c_str());
+    rmdir(directory.c_str());
+    std::cout << (passed ? "ok   " : "FAIL ") << name << (passed ? "" : ": a tile does not match the reference pyramid") << std::endl;
+    return passed;
+}
+
+// Checks the thumbnails against the image shrunk to each size with downscaleArea and then remapped with a palette built from the whole image,
+// and downscaleArea itself against the area integral of every output pixel, to within a level of rounding.
+template <typename T>
+static bool verifyThumbnails(const std::string &name, const CImg<T> &source) {
+    const std::vector<int> sizes = {100, 1024, 37, 1};
+    BasicImageFilter<T> filter(source, Kernel::Fast);
+    std::vector<CImg<T>> thumbnails = filter.getThumbnails(sizes, true);
+    CImg<T> whole(source);
+    BasicColorPalette<T> palette;
+    palette.merge(planarView(whole.data(), whole.width(), whole.height(), whole.spectrum()));
+    palette.finalize();
+    double longest = std::max(source.width(), source.height());
+    bool passed = thumbnails.size() == sizes.size();
+    for (size_t i = 0; i < sizes.size() && passed; i++) {
+        long w = std::max(1L, std::lround(source.width() * std::min(1.0, sizes[i] / longest)));
+        long h = std::max(1L, std::lround(source.height() * std::min(1.0, sizes[i] / longest)));
+        CImg<T> expected = w == source.width() && h == source.height() ? source : downscaleArea(source, w, h);
+        palette.apply(planarView(expected.data(), w, h, expected.spectrum()));
+        passed = thumbnails[i] == expected;
+        if (!passed) {
+            std::cout << "FAIL " << name << ": the " << sizes[i] << " thumbnail does not match the remapped downscale" << std::endl;
+        }
+    }
+    CImg<T> small = downscaleArea(source, 100, 33);
+    double scaleX = source.width() / 100.0, scaleY = source.height() / 33.0, tolerance = std::numeric_limits<T>::is_integer ? 1 : 1e-4;
+    cimg_forXYC(small, x, y, c) {
+        double sum = 0;
+        for (long sy = y * scaleY; passed && sy < (y + 1) * scaleY; sy++) {
+            for (long sx = x * scaleX; sx < (x + 1) * scaleX; sx++) {
+                double coverX = std::min((x + 1) * scaleX, sx + 1.0) - std::max(x * scaleX, (double)sx);
+                double coverY = std::min((y + 1) * scaleY, sy + 1.0) - std::max(y * scaleY, (double)sy);
+                sum += coverX * coverY * source(sx, sy, c);
+            }
+        }
+        if (passed && std::fabs(sum / (scaleX * scaleY) - small(x, y, c)) > tolerance) {
+            std::cout << "FAIL " << name << ": downscaleArea differs from the area integral at (" << x << ", " << y << ") channel " << c
+                      << std::endl;
+            passed = false;
+        }
+    }
+    if (passed) {
+        std::cout << "ok   " << name << std::endl;
+    }
+    return passed;
+}
+
+// Differential harness: ./main --verify [images...]
+// Checks the fast kernels, in the planar layout and every interleaved one, against the reference on every 24-bit colour, on values clustered
+// around the luminosity thresholds and channel ties, on seeded random noise of awkward sizes, and on any images given on the command line.
+// The 16-bit and float kernels get the same threshold and noise cases at their own scale. The parallel JPEG decoder is checked against CImg's
+// serial decode for the common sampling factors and restart intervals, the parallel JPEG encoder against CImg's save_jpeg, and the parallel
+// PNG writer and the QOI, TIFF and IFP codecs by loading their files back, the tile server and tile pyramids against the filtered image, and
+// thumbnails against a downscale of the whole image. Every case runs and reports ok or FAIL, and the exit status is 4 if any of them failed.
+static int verifyMain(int argc, char *argv[]) {
+    bool passed = true;
+    CImg<unsigned char> everyColor(4096, 4096, 1, 3);
+    cimg_forXY(everyColor, x, y) {
+        int color = y * 4096 + x;
+        everyColor(x, y, 0) = color >> 16;
+        everyColor(x, y, 1) = (color >> 8) & 255;
+        everyColor(x, y, 2) = color & 255;
+    }
+    passed = verifyKernels("every 24-bit colour", everyColor) && passed;
+
+    std::mt19937 rng(20221226);
+    const int edges[] = {0, 1, 84, 85, 86, 169, 170, 171, 254, 255};
+    CImg<unsigned char> thresholds(641, 479, 1, 3);
+    cimg_forXYC(thresholds, x, y, c) { thresholds(x, y, c) = edges[rng() % 10]; }
+    passed = verifyKernels("threshold and tie values", thresholds) && passed;
+
+    const int sizes[][2] = {{1, 1}, {1, 1000}, {1000, 1}, {7, 13}, {997, 331}, {1920, 1080}};
+    for (const int *size : sizes) {
+        CImg<unsigned char> noise(size[0], size[1], 1, 3);
+        cimg_for(noise, ptr, unsigned char) { *ptr = rng() & 255; }
+        passed = verifyKernels("random noise " + std::to_string(size[0]) + "x" + std::to_string(size[1]), noise) && passed;
+    }
+
+    CImg<unsigned char> everyGray(256, 3, 1, 1), grayNoise(997, 331, 1, 1), grayAlpha(997, 331, 1, 2);
+    cimg_forXY(everyGray, x, y) { everyGray(x, y) = y == 1 ? 255 - x : x; }
+    cimg_for(grayNoise, ptr, unsigned char) { *ptr = rng() & 255; }
+    cimg_forXY(grayAlpha, x, y) {
+        grayAlpha(x, y, 0) = rng() & 255;
+        grayAlpha(x, y, 1) = (x / 37 + y / 11) % 3 == 0 ? 0 : 255;
+    }
+    passed = verifyKernels("every grey level", everyGray) && passed;
+    passed = verifyKernels("greyscale noise 997x331", grayNoise) && passed;
+    passed = verifyKernels("greyscale noise with alpha 997x331", grayAlpha) && passed;
+
+    // Alpha is mostly opaque, with runs of fully transparent pixels and a few translucent ones.
+    CImg<unsigned char> withAlpha(997, 331, 1, 4);
+    cimg_forXY(withAlpha, x, y) {
+        for (int c = 0; c < 3; c++) {
+            withAlpha(x, y, c) = rng() & 255;
+        }
+        withAlpha(x, y, 3) = (x / 37 + y / 11) % 3 == 0 ? 0 : (rng() % 8 == 0 ? rng() & 255 : 255);
+    }
+    passed = verifyKernels("random noise with alpha 997x331", withAlpha) && passed;
+
+    CImg<unsigned short> wideThresholds(641, 479, 1, 3), wideNoise(997, 331, 1, 3);
+    cimg_forXYC(wideThresholds, x, y, c) { wideThresholds(x, y, c) = edges[rng() % 10] * 257 + (int)(rng() % 3) - 1; }
+    cimg_for(wideNoise, ptr, unsigned short) { *ptr = rng() & 65535; }
+    passed = verifyKernels("16-bit threshold and tie values", wideThresholds) && passed;
+    passed = verifyKernels("16-bit random noise 997x331", wideNoise) && passed;
+
+    CImg<float> floatThresholds(641, 479, 1, 3), floatNoise(997, 331, 1, 3);
+    cimg_forXYC(floatThresholds, x, y, c) { floatThresholds(x, y, c) = edges[rng() % 10] / 255.0f; }
+    cimg_for(floatNoise, ptr, float) { *ptr = (rng() & 0xFFFFFF) / (float)0xFFFFFF; }
+    passed = verifyKernels("float threshold and tie values", floatThresholds) && passed;
+    passed = verifyKernels("float random noise 997x331", floatNoise) && passed;
+
+    // A smooth gradient with noise on top, so the chroma upsampling at chunk edges has something to get wrong.
+    CImg<unsigned char> photo(997, 331, 1, 3);
+    cimg_forXYC(photo, x, y, c) { photo(x, y, c) = (x * (c + 1) / 5 + y * (3 - c) / 3 + (int)(rng() % 24)) & 255; }
+    passed = verifyRestartJpeg("restart JPEG 4:2:0, one MCU row per interval", photo, 63, 2, 2) && passed;
+    passed = verifyRestartJpeg("restart JPEG 4:2:2, 10 MCUs per interval", photo, 10, 2, 1) && passed;
+    passed = verifyRestartJpeg("restart JPEG 4:4:4, 7 MCUs per interval", photo, 7, 1, 1) && passed;
+    passed = verifyRestartJpeg("restart JPEG greyscale, 3 MCUs per interval", photo.get_channel(1), 3, 1, 1) && passed;
+    passed = verifyStripJpeg("strip-encoded JPEG 997x331", photo) && passed;
+    passed = verifyStripJpeg("strip-encoded greyscale JPEG 997x331", photo.get_channel(1)) && passed;
+    passed = verifyStripJpeg("strip-encoded JPEG 5x331", photo.get_crop(0, 0, 4, 330)) && passed;
+    passed = verifyParallelFor("parallelFor rethrows a helper's exception") && passed;
+    passed = verifyParallelPng("parallel PNG RGB 997x331", photo) && passed;
+    passed = verifyParallelPng("parallel PNG RGBA 997x331", withAlpha) && passed;
+    passed = verifyParallelPng("parallel PNG grey and alpha 997x331", grayAlpha) && passed;
+    passed = verifyParallelPng("parallel PNG 16-bit RGB 997x331", wideNoise) && passed;
+    // Filtered images have few enough colours to be written indexed, at 2 bits per pixel for a three-colour image.
+    CImg<unsigned char> posterized(photo), posterizedAlpha(withAlpha), threeColors(997, 331, 1, 3);
+    filterImage(planarView(posterized.data(), posterized.width(), posterized.height(), 3));
+    cimg_forXY(posterizedAlpha, x, y) { posterizedAlpha(x, y, 3) = posterizedAlpha(x, y, 3) ? 255 : 0; }
+    filterImage(planarView(posterizedAlpha.data(), posterizedAlpha.width(), posterizedAlpha.height(), 4));
+    cimg_forXYC(threeColors, x, y, c) { threeColors(x, y, c) = (x / 50 + y / 30) % 3 * 100 + c; }
+    passed = verifyParallelPng("indexed PNG of a filtered image", posterized) && passed;
+    passed = verifyParallelPng("indexed PNG of a filtered image with alpha", posterizedAlpha) && passed;
+    passed = verifyParallelPng("indexed PNG with three colours", threeColors) && passed;
+    CImg<unsigned char> twoColors(threeColors.get_channel(0)), sixteenColors(997, 331, 1, 3);
+    cimg_forXY(twoColors, x, y) { twoColors(x, y) = (x / 50 + y / 30) % 2 * 255; }
+    cimg_forXYC(sixteenColors, x, y, c) { sixteenColors(x, y, c) = (x / 40 + y / 20) % 16 * 16 + c; }
+    passed = verifyWebp("WebP RGB 997x331", photo) && passed;
+    passed = verifyWebp("WebP RGBA 997x331", withAlpha) && passed;
+    passed = verifyWebp("WebP greyscale 997x331", grayNoise) && passed;
+    passed = verifyWebp("WebP grey and alpha 997x331", grayAlpha) && passed;
+    passed = verifyWebp("WebP of a filtered image", posterized) && passed;
+    passed = verifyWebp("WebP of a filtered image with alpha", posterizedAlpha) && passed;
+    passed = verifyWebp("WebP with sixteen colours", sixteenColors) && passed;
+    passed = verifyWebp("WebP with three colours", threeColors) && passed;
+    passed = verifyWebp("WebP with two colours", twoColors) && passed;
+    passed = verifyQoi("QOI RGB 997x331", photo) && passed;
+    passed = verifyQoi("QOI RGBA 997x331", withAlpha) && passed;
+    passed = verifyQoi("QOI of a filtered image", posterized) && passed;
+    passed = verifyQoi("QOI greyscale 997x331", grayNoise) && passed;
+    passed = verifyQoi("QOI grey and alpha 997x331", grayAlpha) && passed;
+    passed = verifyTiff("TIFF little-endian tiled RGB, uncompressed", photo, false, false, true, 1, 1) && passed;
+    passed = verifyTiff("TIFF big-endian stripped RGB, LZW with predictor", photo, true, false, false, 5, 2) && passed;
+    passed = verifyTiff("TIFF little-endian stripped RGB, LZW", photo, false, false, false, 5, 1) && passed;
+    passed = verifyTiff("BigTIFF big-endian tiled RGBA, Deflate with predictor", withAlpha, true, true, true, 8, 2) && passed;
+    passed = verifyTiff("TIFF little-endian stripped grey and alpha, Deflate", grayAlpha, false, false, false, 8, 1) && passed;
+    passed = verifyTiff("TIFF 16-bit big-endian stripped RGB, LZW with predictor", wideNoise, true, false, false, 5, 2) && passed;
+    passed = verifyTiff("BigTIFF 16-bit little-endian tiled RGB, uncompressed", wideNoise, false, true, true, 1, 1) && passed;
+    passed = verifyTiff("BigTIFF 16-bit big-endian tiled RGB, Deflate", wideNoise, true, true, true, 8, 1) && passed;
+    passed = verifyIfp("IFP RGB 997x331", photo, rng) && passed;
+    passed = verifyIfp("IFP RGBA 997x331", withAlpha, rng) && passed;
+    passed = verifyIfp("IFP grey and alpha 997x331", grayAlpha, rng) && passed;
+    passed = verifyIfp("IFP 16-bit RGB 997x331", wideNoise, rng) && passed;
+    passed = verifyIfp("IFP float RGB 997x331", floatNoise, rng) && passed;
+    passed = verifyIfp("IFP 1x331", CImg<unsigned char>(photo.get_crop(5, 0, 5, 330)), rng) && passed;
+    passed = verifyTiles("tiles RGB 997x331", photo) && passed;
+    passed = verifyTiles("tiles RGBA 997x331", posterizedAlpha) && passed;
+    passed = verifyPyramid("pyramid RGB 997x331", photo) && passed;
+    passed = verifyPyramid("pyramid RGBA 997x331", withAlpha) && passed;
+    passed = verifyPyramid("pyramid grey and alpha 997x331", grayAlpha) && passed;
+    passed = verifyThumbnails("thumbnails RGB 997x331", photo) && passed;
+    passed = verifyThumbnails("thumbnails RGBA 997x331", withAlpha) && passed;
+    passed = verifyThumbnails("thumbnails 16-bit RGB 997x331", wideNoise) && passed;
+    passed = verifyThumbnails("thumbnails float RGB 997x331", floatNoise) && passed;
+    for (int i = 2; i < argc; i++) {
+        CImg<unsigned char> image;
+        try {
+            image.load(argv[i]);
+        } catch (const CImgException &) {
+            std::cout << "FAIL " << argv[i] << ": cannot be read" << std::endl;
+            passed = false;
+            continue;
+        }
+        passed = verifyKernels(argv[i], image) && passed;
+    }
+    return passed ? 0 : 4;
+}
 
 int main(int argc, char *argv[]) {
     if (argc < 2) {
         std::cout << "Please provide a file name argument" << std::endl;
         return 1;
     }
+    if (std::string(argv[1]) == "--bench") {
+        return benchMain(argc, argv);
+    }
+    if (std::string(argv[1]) == "--batch" || std::string(argv[1]) == "--daemon") {
+        return schedulerMain(argc, argv);
+    }
+    if (std::string(argv[1]) == "--verify") {
+        return verifyMain(argc, argv);
+    }
+    bool stats = false;
+    int first = 1;
+    for (; first < argc && argv[first][0] == '-' && argv[first][1] == '-'; first++) {
+        if (std::string(argv[first]) == "--stats") {
+            stats = true;
+        } else if (std::string(argv[first]) == "--png-level" && first + 1 < argc) {
+            pngCompressionLevel = std::max(0, std::min(9, std::atoi(argv[++first])));
+        } else if (std::string(argv[first]) == "--format" && first + 1 < argc) {
+            outputFormat = argv[++first];
+        } else if (std::string(argv[first]) == "--webp-method" && first + 1 < argc) {
+            webpMethod = std::max(0, std::min(6, std::atoi(argv[++first])));
+        } else if (std::string(argv[first]) == "--tile-size" && first + 1 < argc) {
+            outputTileSize = std::max(1, std::atoi(argv[++first]));
+        } else if (std::string(argv[first]) == "--thumbnails" && first + 1 < argc) {
+            if (!parseSizes(argv[++first], thumbnailSizes)) {
+                std::cout << "--thumbnails needs a comma-separated list of positive sizes, not '" << argv[first] << "'" << std::endl;
+                return 1;
+            }
+        }
+    }
+    if (!checkOutputOptions()) {
+        return 1;
+    }
+    if (first >= argc) {
+        std::cout << "Please provide a file name argument" << std::endl;
+        return 1;
+    }
     // Image file URL is passed as a CLI argument
-    std::string uri = argv[1];
-    ImageFilter newImage(uri.c_str());
-
-    newImage.applyFilter();
-    newImage.saveImageFile(uri);
+    std::string uri = argv[first];
+    ImageHeader header = readImageHeader(uri);
+    if (header.tiff && !thumbnailSizes.empty()) {
+        std::cout << "thumbnails are made from images decoded into memory, and TIFFs are filtered tile by tile" << std::endl;
+        return 1;
+    }
+    if (header.tiff) {
+        std::string error;
+        if (!filterTiff(uri, header.bytesPerSample, error)) {
+            std::cout << error << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (!stats && (outputFormat.empty() || isPyramidFormat(outputFormat)) && thumbnailSizes.empty() && header.png && header.bytesPerSample == 1 &&
+        estimateInMemoryBytes(header) > physicalMemoryBytes() / 2) {
+        PngTiledFilter filter(uri);
+        if (!filter.run()) {
+            std::cout << filter.getError() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    try {
+        filterFile(uri, header.bytesPerSample, nullptr, stats ? &std::cout : nullptr);
+    } catch (const std::exception &e) {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
     return 0;
 }
 
 /*
 To compile: (deprecated flag needed as of Dec. 2022)
-g++ -std=c++11 -Wno-deprecated -I/opt/X11/include -L/opt/X11/lib -lX11 -lpthread main.cpp -o main
+g++ -std=c++11 -Wno-deprecated -I/opt/X11/include -L/opt/X11/lib main.cpp imagefilter.cpp -o main -lX11 -lpthread -ljpeg -lpng -lz
+
+The palette engine (imagefilter.h, and the C interface in imagefilter_c.h) builds on its own, with no CImg or codec dependency. As a static
+library:
+g++ -std=c++11 -O2 -c imagefilter.cpp imagefilter_c.cpp && ar rcs libimagefilter.a imagefilter.o imagefilter_c.o
+As a shared library exporting only the ifl_* C functions:
+g++ -std=c++11 -O2 -shared -fPIC -fvisibility=hidden imagefilter.cpp imagefilter_c.cpp -o libimagefilter.so
 
 To run:
 ./main input/img3.jpeg
+16-bit PNGs and PFM (float) images are filtered and saved at their own depth:
+./main input/scan16.png
+Tiled or stripped TIFF and BigTIFF files (8 or 16 bits, uncompressed, LZW or Deflate) are filtered tile by tile, in parallel, into a Deflate
+TIFF on the same tile grid:
+./main input/archive.tif
+
+To filter many images concurrently under a memory budget (jobs too large for the budget stream JPEGs strip by strip, and 8-bit PNGs tile by tile
+through a memory-mapped scratch file in TMPDIR):
+./main --batch --jobs 4 --memory-budget 512M input/img1.jpeg input/img2.jpeg input/img3.jpeg
+find input -name '*.jpeg' | ./main --daemon --memory-budget 1G
+
+PNG output is deflated on every core, and filtered colour images, which have at most 21 colours, are written as indexed PNGs that decode to
+the same pixels. --png-level trades speed for size, from 1 (fastest) to 9 (smallest), 0 storing uncompressed; the default
+is zlib's 6. It goes before the file name, and works in batch mode too:
+./main --png-level 1 input/scan.png
+
+--format writes the output in another format, by extension. WebP output is lossless, which on posterized images is far smaller than JPEG
+and smaller than PNG; --webp-method sets the encoder's effort, from 0 (fastest) to 6 (smallest), 4 by default. TIFFs stay TIFFs:
+./main --format webp --webp-method 6 input/img3.jpeg
+
+IFP is the native archival format: the palette plus every pixel's class, 5 bits each, in 256x256 tiles deflated independently, so a viewer
+can decode any region from the tiles it overlaps. It is written straight from the classes, without applying the palette, at any sample
+depth, and read back like any other input:
+./main --format ifp input/scan16.png
+
+--format dzi writes a Deep Zoom tile pyramid instead of a single file: output/filtered-NAME.dzi and output/filtered-NAME_files/LEVEL/, with
+every level built in the same single pass by majority vote over the classes of the level above, so each keeps the palette's colours.
+--format xyz writes output/filtered-NAME.xyz/Z/X/Y.png instead. --tile-size sets the tile size, 256 by default. Large PNGs and TIFFs
+stream into the pyramid without ever holding the full image:
+./main --format dzi --tile-size 512 input/archive.tif
+
+The daemon also serves filtered tiles on demand for zoomable previews. The palette is built once when an image is opened, and each tile is
+filtered from the source only when asked for, then kept in an LRU cache of encoded tiles (--tile-cache, 64M by default). TIFF and IFP
+inputs are read only where a tile overlaps them, and IFP needs no palette pass at all. Each tile is written to output/filtered-NAME_tiles/:
+printf 'open input/archive.tif\ntile input/archive.tif 3 7\n' | ./main --daemon --tile-size 512
+
+QOI images are read and written too. Saving to QOI remaps each row just before encoding it, so the filter and the encoder share one pass:
+./main input/frame.qoi
+
+--thumbnails writes filtered copies scaled to fit each size instead, as output/filtered-NAME-SIZE.EXT, from one decode and one palette.
+Each size is area-averaged from the full image and only the small planes are remapped. TIFFs, filtered tile by tile, and tile pyramids,
+which already hold every smaller size, are not supported:
+./main --thumbnails 256,512,1024 input/img3.jpeg
+
+To print per-stage time, heap allocations and peak memory:
+./main --stats input/img3.jpeg
+
+To check the optimized kernels against the scalar reference (exits with status 4 on any difference):
+./main --verify input/img1.jpeg
+
+To benchmark against the committed baseline (exits with status 3 on a regression):
+./main --bench
+./main --bench --runs 15 --save-baseline bench/baseline.json
 */
@@ -0,0 +1,208 @@
+// Python binding for libimagefilter. Arrays are passed through the buffer protocol and filtered in place, so NumPy callers never copy pixels
+// or round-trip through files. The GIL is released while the kernels run, which lets a Python thread pool filter several images at once.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <string.h>
+
+#include "../imagefilter_c.h"
+
+namespace {
+
+// Describes a writable uint8 HxWxC buffer to the C API. Channels must sit at unit stride (interleaved, including RGB views into RGBA data) or
+// pixels at unit stride (planar, as a transposed CxHxW array). Anything else raises ValueError. A fourth channel is treated as alpha.
+// Greyscale comes as a packed HxW array or an HxWx1 / HxWx2 (grey and alpha) array.
+bool describeBuffer(PyObject *object, Py_buffer &buffer, ifl_image &image) {
+    if (PyObject_GetBuffer(object, &buffer, PyBUF_RECORDS) < 0) {
+        return false;
+    }
+    const char *error = nullptr;
+    long channels = buffer.ndim == 3 ? buffer.shape[2] : 1;
+    if (buffer.format && strcmp(buffer.format, "B") && strcmp(buffer.format, "=B")) {
+        error = "expected a uint8 buffer";
+    } else if (buffer.ndim != 2 && buffer.ndim != 3) {
+        error = "expected an HxW or HxWxC buffer";
+    } else if (buffer.strides[0] < 0 || buffer.strides[1] < 0 || (buffer.ndim == 3 && buffer.strides[2] < 0)) {
+        error = "negative strides are not supported";
+    }
+    if (!error) {
+        image.data = static_cast<uint8_t *>(buffer.buf);
+        image.height = buffer.shape[0];
+        image.width = buffer.shape[1];
+        image.row_stride = buffer.strides[0];
+    }
+    if (!error && channels < 3) {
+        if (buffer.strides[1] != channels || (channels == 2 && buffer.strides[2] != 1)) {
+            error = "greyscale buffers must have packed pixels";
+        }
+        image.layout = IFL_LAYOUT_GRAY;
+        image.channels = (int32_t)channels;
+        image.plane_stride = 0;
+    } else if (!error && buffer.strides[2] == 1 && buffer.strides[1] >= 3) {
+        image.layout = buffer.shape[2] >= 4 ? IFL_LAYOUT_RGBA : IFL_LAYOUT_INTERLEAVED;
+        image.channels = (int32_t)buffer.strides[1];
+        image.plane_stride = 0;
+    } else if (!error && buffer.strides[1] == 1) {
+        image.layout = IFL_LAYOUT_PLANAR;
+        image.channels = (int32_t)buffer.shape[2];
+        image.plane_stride = buffer.strides[2];
+    } else if (!error) {
+        error = "unsupported strides: channels or pixels must be contiguous";
+    }
+    if (error) {
+        PyBuffer_Release(&buffer);
+        PyErr_SetString(PyExc_ValueError, error);
+        return false;
+    }
+    return true;
+}
+
+bool checkStatus(ifl_status status) {
+    if (status == IFL_OK) {
+        return true;
+    }
+    PyErr_SetString(status == IFL_ERR_NO_MEMORY ? PyExc_MemoryError : PyExc_ValueError, ifl_status_string(status));
+    return false;
+}
+
+// A palette is not safe to use from two threads at once, and build() and apply() release the GIL. busy is only read and written with the
+// GIL held, and marks a palette one of them is working on, so that calls from other threads can be refused instead of racing it.
+struct PaletteObject {
+    PyObject_HEAD
+    ifl_palette *palette;
+    bool busy;
+};
+
+// Sets RuntimeError and returns true if build() or apply() is working on the palette.
+bool paletteBusy(const bool *busy) {
+    if (busy && *busy) {
+        PyErr_SetString(PyExc_RuntimeError, "palette is in use by another thread");
+        return true;
+    }
+    return false;
+}
+
+PyObject *paletteNew(PyTypeObject *type, PyObject *, PyObject *) {
+    PaletteObject *self = reinterpret_cast<PaletteObject *>(type->tp_alloc(type, 0));
+    if (self && !checkStatus(ifl_palette_new(&self->palette))) {
+        Py_DECREF(self);
+        return nullptr;
+    }
+    return reinterpret_cast<PyObject *>(self);
+}
+
+void paletteDealloc(PyObject *object) {
+    ifl_palette_free(reinterpret_cast<PaletteObject *>(object)->palette);
+    Py_TYPE(object)->tp_free(object);
+}
+
+// Runs one palette call on a buffer with the GIL released. busy, if given, is the owning object's flag and is held for the whole call.
+PyObject *runOnBuffer(PyObject *object, ifl_palette *palette, ifl_status (*call)(ifl_palette *, const ifl_image *), bool *busy) {
+    Py_buffer buffer;
+    ifl_image image;
+    if (!describeBuffer(object, buffer, image)) {
+        return nullptr;
+    }
+    if (paletteBusy(busy)) {
+        PyBuffer_Release(&buffer);
+        return nullptr;
+    }
+    if (busy) {
+        *busy = true;
+    }
+    ifl_status status;
+    Py_BEGIN_ALLOW_THREADS
+    status = call(palette, &image);
+    Py_END_ALLOW_THREADS
+    if (busy) {
+        *busy = false;
+    }
+    PyBuffer_Release(&buffer);
+    if (!checkStatus(status)) {
+        return nullptr;
+    }
+    Py_RETURN_NONE;
+}
+
+ifl_status applyCall(ifl_palette *palette, const ifl_image *image) { return ifl_palette_apply(palette, image); }
+
+PyObject *paletteBuild(PyObject *self, PyObject *array) {
+    PaletteObject *palette = reinterpret_cast<PaletteObject *>(self);
+    return runOnBuffer(array, palette->palette, ifl_palette_build, &palette->busy);
+}
+
+PyObject *paletteApply(PyObject *self, PyObject *array) {
+    PaletteObject *palette = reinterpret_cast<PaletteObject *>(self);
+    return runOnBuffer(array, palette->palette, applyCall, &palette->busy);
+}
+
+// Runs with the GIL held, so it only has to check that no build() or apply() is under way.
+PyObject *paletteColors(PyObject *self, PyObject *) {
+    PaletteObject *palette = reinterpret_cast<PaletteObject *>(self);
+    uint8_t colors[63];
+    if (paletteBusy(&palette->busy) || !checkStatus(ifl_palette_colors(palette->palette, colors))) {
+        return nullptr;
+    }
+    return PyBytes_FromStringAndSize(reinterpret_cast<const char *>(colors), sizeof(colors));
+}
+
+PyMethodDef paletteMethods[] = {
+    {"build", paletteBuild, METH_O,
+     "build(array): rebuild the palette from a uint8 HxWxC or greyscale HxW array. Raises RuntimeError if another thread is using the palette."},
+    {"apply", paletteApply, METH_O,
+     "apply(array): remap a uint8 HxWxC or greyscale HxW array in place onto the palette. Raises RuntimeError if another thread is using it."},
+    {"colors", paletteColors, METH_NOARGS,
+     "colors() -> bytes: the 21 palette colours as 63 RGB bytes in class order. Raises RuntimeError while build() or apply() runs."},
+    {nullptr, nullptr, 0, nullptr},
+};
+
+PyTypeObject paletteType = {PyVarObject_HEAD_INIT(nullptr, 0)};
+
+// filter(array): builds a palette from the array and remaps it in place.
+PyObject *filterArray(PyObject *, PyObject *array) {
+    ifl_palette *palette;
+    if (!checkStatus(ifl_palette_new(&palette))) {
+        return nullptr;
+    }
+    PyObject *result = runOnBuffer(array, palette, ifl_palette_build, nullptr);
+    if (result) {
+        Py_DECREF(result);
+        result = runOnBuffer(array, palette, applyCall, nullptr);
+    }
+    ifl_palette_free(palette);
+    return result;
+}
+
+PyMethodDef moduleMethods[] = {
+    {"filter", filterArray, METH_O, "filter(array): build a palette from a uint8 HxWxC array and remap it in place."},
+    {nullptr, nullptr, 0, nullptr},
+};
+
+PyModuleDef moduleDef = {PyModuleDef_HEAD_INIT, "imagefilter", "Palette filter over in-memory uint8 image buffers.", -1, moduleMethods};
+
+}  // namespace
+
+PyMODINIT_FUNC PyInit_imagefilter(void) {
+    paletteType.tp_name = "imagefilter.Palette";
+    paletteType.tp_basicsize = sizeof(PaletteObject);
+    paletteType.tp_flags = Py_TPFLAGS_DEFAULT;
+    paletteType.tp_doc = "A reusable palette. build() and apply() take any writable uint8 HxWxC buffer and run without the GIL. One palette serves "
+                         "one call at a time: a call made while another thread is using it raises RuntimeError. filter() is safe from any thread.";
+    paletteType.tp_new = paletteNew;
+    paletteType.tp_dealloc = paletteDealloc;
+    paletteType.tp_methods = paletteMethods;
+    if (PyType_Ready(&paletteType) < 0) {
+        return nullptr;
+    }
+    PyObject *module = PyModule_Create(&moduleDef);
+    if (!module) {
+        return nullptr;
+    }
+    Py_INCREF(&paletteType);
+    if (PyModule_AddObject(module, "Palette", reinterpret_cast<PyObject *>(&paletteType)) < 0) {
+        Py_DECREF(&paletteType);
+        Py_DECREF(module);
+        return nullptr;
+    }
+    return module;
+}
@@ -0,0 +1,14 @@
+# Builds the imagefilter Python module against the library sources in the parent directory:
+#   cd python && python3 setup.py build_ext --inplace
+from setuptools import Extension, setup
+
+setup(
+    name="imagefilter",
+    ext_modules=[
+        Extension(
+            "imagefilter",
+            sources=["imagefilter_module.cpp", "../imagefilter.cpp", "../imagefilter_c.cpp"],
+            extra_compile_args=["-std=c++11", "-O2"],
+        )
+    ],
+)